@@ -0,0 +1,190 @@
+//
+// Round trip check of the lossless codec used to compress older dubs. It is built with
+// the same flags as the plugin (see the test target of the Makefile), as the codec must
+// stay bit exact with them, e.g. for denormals and -0.
+//
+
+#include "loopor.cpp"
+
+/// The number of failed checks
+static size_t failures = 0;
+
+/// Count and report a failed check.
+static void check(bool condition, const char* what, size_t block)
+{
+    if (condition)
+        return;
+    printf("FAILED: %s (block %zu)\n", what, block);
+    failures++;
+}
+
+/// A deterministic source of random bits, so a failure can be reproduced.
+static uint32_t nextRandom()
+{
+    static uint32_t state = 12345;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+/// A float from its bits.
+static float fromBits(uint32_t bits)
+{
+    float sample;
+    memcpy(&sample, &bits, sizeof(sample));
+    return sample;
+}
+
+/// The kinds of blocks checked
+enum BlockKind
+{
+    /// Uniform noise between -1 and 1, not 24 bit samples
+    BLOCK_RANDOM,
+    /// Noise made of 24 bit samples
+    BLOCK_24_BIT,
+    /// Only zeros
+    BLOCK_SILENT,
+    /// Samples at or near full scale, alternating in sign
+    BLOCK_FULL_SCALE,
+    /// Denormals and zeros of both signs
+    BLOCK_DENORMAL,
+    /// Any bits, so also infinities and NaNs
+    BLOCK_ANY_BITS,
+    NR_OF_BLOCK_KINDS
+};
+
+/// Fill a block with samples of a kind.
+static void fillBlock(BlockKind kind, float* samples, size_t length)
+{
+    for (size_t s = 0; s < length; s++)
+    {
+        uint32_t random = nextRandom();
+        switch (kind)
+        {
+            case BLOCK_RANDOM: samples[s] = float(random) / float(UINT32_MAX) * 2.0f - 1.0f; break;
+            case BLOCK_24_BIT: samples[s] = float(int32_t(random) >> 8) / 8388608.0f; break;
+            case BLOCK_SILENT: samples[s] = 0.0f; break;
+            case BLOCK_FULL_SCALE:
+                samples[s] = (s % 2 == 0 ? 1.0f : -1.0f) * (random % 4 == 0 ? 1.0f : 1.0f - float(random % 3) / 8388608.0f);
+                break;
+            case BLOCK_DENORMAL:
+                samples[s] = fromBits((random & 0x80000000u) | (random % 8 == 0 ? 0u : random & 0x007fffffu));
+                break;
+            default: samples[s] = fromBits(random); break;
+        }
+    }
+}
+
+/// Encode and decode a block and compare the bits of the samples.
+static void checkRoundTrip(BlockKind kind, size_t length, size_t block)
+{
+    float input1[COMPRESSION_BLOCK_SIZE];
+    float input2[COMPRESSION_BLOCK_SIZE];
+    fillBlock(kind, input1, length);
+    fillBlock(kind, input2, length);
+    uint8_t encoded[16 + 2 * COMPRESSION_BLOCK_SIZE * sizeof(float)];
+    size_t size = LosslessCodec::encodeBlock(input1, input2, length, encoded, sizeof(encoded));
+    check(size > 0 && size <= 5 + 2 * length * sizeof(float), "encoded size", block);
+    if (size == 0)
+        return;
+
+    float output1[COMPRESSION_BLOCK_SIZE];
+    float output2[COMPRESSION_BLOCK_SIZE];
+    LosslessCodec::decodeBlock(encoded, size, length, output1, output2);
+    check(memcmp(input1, output1, length * sizeof(float)) == 0, "first channel bit exact", block);
+    check(memcmp(input2, output2, length * sizeof(float)) == 0, "second channel bit exact", block);
+
+    float peak = 0.0f;
+    for (size_t s = 0; s < length; s++)
+        peak = fmaxf(peak, fmaxf(fabsf(input1[s]), fabsf(input2[s])));
+    if (kind != BLOCK_ANY_BITS)
+        check(LosslessCodec::peak(encoded) == peak, "peak", block);
+
+    // A block which does not fit is refused, not truncated.
+    check(LosslessCodec::encodeBlock(input1, input2, length, encoded, size - 1) == 0, "block too large", block);
+}
+
+/// Compress a segment with the offloader thread into a pool, and check that it is
+/// decoded bit exact, or refused if the pool is too small.
+/// \param poolSize The size of the pool in bytes.
+/// \return Did the segment fit into the pool?
+static bool checkOffloader(size_t poolSize)
+{
+    const size_t length = 10 * COMPRESSION_BLOCK_SIZE + 37;
+    float* storage1 = new float[length];
+    float* storage2 = new float[length];
+    float* peaks = new float[length / PEAK_BLOCK_SIZE + 1];
+    uint8_t* pool = new uint8_t[poolSize + 1];
+    for (size_t b = 0; b * COMPRESSION_BLOCK_SIZE < length; b++)
+    {
+        size_t count = length - b * COMPRESSION_BLOCK_SIZE;
+        count = count < COMPRESSION_BLOCK_SIZE ? count : COMPRESSION_BLOCK_SIZE;
+        BlockKind kind = BlockKind(b % NR_OF_BLOCK_KINDS);
+        fillBlock(kind, &storage1[b * COMPRESSION_BLOCK_SIZE], count);
+        fillBlock(kind, &storage2[b * COMPRESSION_BLOCK_SIZE], count);
+    }
+    // A byte after the pool which must not be written.
+    pool[poolSize] = 0xa5;
+
+    DubOffloader offloader;
+    offloader.start(storage1, storage2, peaks, pool, poolSize, -1, [](const OffloadJob& job) { return true; });
+    OffloadJob job;
+    job.m_type = OFFLOAD_COMPRESS;
+    job.m_nrOfSegments = 1;
+    job.m_segments[0].m_length = length;
+    offloader.pushJob(job);
+    OffloadResult result;
+    while (!offloader.popResult(result))
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    offloader.stop();
+
+    check(pool[poolSize] == 0xa5, "pool not overrun", poolSize);
+    if (result.m_success)
+    {
+        check(result.m_end <= poolSize, "segment within the pool", poolSize);
+        for (size_t b = 0; b * COMPRESSION_BLOCK_SIZE < length; b++)
+        {
+            size_t count = length - b * COMPRESSION_BLOCK_SIZE;
+            count = count < COMPRESSION_BLOCK_SIZE ? count : COMPRESSION_BLOCK_SIZE;
+            size_t size;
+            size_t position = DubOffloader::blockOffset(pool, result.m_offsets[0], b, size);
+            float output1[COMPRESSION_BLOCK_SIZE];
+            float output2[COMPRESSION_BLOCK_SIZE];
+            LosslessCodec::decodeBlock(&pool[position], size, count, output1, output2);
+            check(memcmp(&storage1[b * COMPRESSION_BLOCK_SIZE], output1, count * sizeof(float)) == 0 &&
+                memcmp(&storage2[b * COMPRESSION_BLOCK_SIZE], output2, count * sizeof(float)) == 0,
+                "segment decoded from the pool", b);
+        }
+    }
+
+    delete[] storage1;
+    delete[] storage2;
+    delete[] peaks;
+    delete[] pool;
+    return result.m_success;
+}
+
+int main()
+{
+    size_t block = 0;
+    const size_t tailLengths[] = {1, 2, 3, 17, COMPRESSION_BLOCK_SIZE - 1};
+    for (size_t round = 0; round < 200; round++)
+    {
+        for (size_t kind = 0; kind < NR_OF_BLOCK_KINDS; kind++)
+        {
+            checkRoundTrip(BlockKind(kind), COMPRESSION_BLOCK_SIZE, block++);
+            for (size_t length : tailLengths)
+                checkRoundTrip(BlockKind(kind), length, block++);
+        }
+    }
+
+    // The pool full path: a pool large enough, one too small for the last blocks and one
+    // too small for the offset table.
+    check(checkOffloader(1 << 20), "segment fits into a large pool", 0);
+    check(!checkOffloader(4 * COMPRESSION_BLOCK_SIZE), "segment refused by a small pool", 0);
+    check(!checkOffloader(16), "segment refused by a tiny pool", 0);
+
+    printf("%zu blocks checked, %zu failures\n", block, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -21,12 +21,33 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <float.h>
 #include <math.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 // Needed for the callbacks
 #include <functional>
 
+// Needed for measuring the DSP load
+#include <chrono>
+
+// Needed for allocating the storage in the LV2 worker
+#include <new>
+
+// Needed for the OSC control endpoint
+#include <arpa/inet.h>
+#include <atomic>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+// Needed for the priority of the mixing threads
+#include <pthread.h>
+
 // Needed for writing debug output to a log file
 #include <stdarg.h>
 #include <string.h>
@@ -34,22 +55,181 @@
 // Core definitions for the LV2 interface
 #include "lv2/lv2plug.in/ns/lv2core/lv2.h"
 
+// Needed for the mixer messages on the control port
+#include "lv2/lv2plug.in/ns/ext/atom/atom.h"
+#include "lv2/lv2plug.in/ns/ext/atom/util.h"
+#include "lv2/lv2plug.in/ns/ext/patch/patch.h"
+#include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+
+// Needed for following the tempo of the host
+#include "lv2/lv2plug.in/ns/ext/time/time.h"
+
+// Needed for configuring the capacity per instance
+#include "lv2/lv2plug.in/ns/ext/options/options.h"
+#include "lv2/lv2plug.in/ns/ext/worker/worker.h"
+
 //
 // Configuration constants
 //
 
 /// URI which identifies the plugin
 static const char* LOOPER_URI = "http://radig.com/plugins/loopor";
-/// The maximum number of dubs that can be recorded
+/// URIs of the mixer properties which can be set per dub on the control port
+static const char* LOOPER_URI_DUB = "http://radig.com/plugins/loopor#dub";
+static const char* LOOPER_URI_DUB_GAIN = "http://radig.com/plugins/loopor#dubGain";
+static const char* LOOPER_URI_DUB_MUTE = "http://radig.com/plugins/loopor#dubMute";
+static const char* LOOPER_URI_DUB_PAN = "http://radig.com/plugins/loopor#dubPan";
+static const char* LOOPER_URI_DUB_SCENES = "http://radig.com/plugins/loopor#dubScenes";
+/// URIs of the commands which can be sent for a dub on the control port
+static const char* LOOPER_URI_DUB_DELETE = "http://radig.com/plugins/loopor#dubDelete";
+static const char* LOOPER_URI_DUB_REPLACE = "http://radig.com/plugins/loopor#dubReplace";
+/// URIs of the mixer properties which can be set per track on the control port
+static const char* LOOPER_URI_TRACK = "http://radig.com/plugins/loopor#track";
+static const char* LOOPER_URI_TRACK_GAIN = "http://radig.com/plugins/loopor#trackGain";
+static const char* LOOPER_URI_TRACK_MUTE = "http://radig.com/plugins/loopor#trackMute";
+/// URIs of the options the host can give at instantiation to limit the capacity
+static const char* LOOPER_URI_MAX_DUBS = "http://radig.com/plugins/loopor#maxDubs";
+static const char* LOOPER_URI_STORAGE_SECONDS = "http://radig.com/plugins/loopor#storageSeconds";
+/// The maximum number of dubs that can be recorded. Fewer can be configured per instance.
 static const size_t NR_OF_DUBS = 128;
-/// The maximum number of seconds which can be recorded for all dubs.
+/// The number of tracks, each with its own dubs within the same loop and storage
+static const size_t NR_OF_TRACKS = 4;
+/// The number of scenes, each playing the dubs which are part of it
+static const size_t NR_OF_SCENES = 8;
+/// The scenes a dub is part of when recorded while all dubs are played, a bit for each scene
+static const uint32_t ALL_SCENES = (1u << NR_OF_SCENES) - 1;
+/// The default number of seconds which can be recorded for all dubs.
 /// Note that each dub can have an individual length. If audio starts
 /// after the loop start and/or finishes before the end of the loop
 /// it will consume less memory.
 static const size_t STORAGE_MEMORY_SECONDS = 360;
+/// The maximum number of seconds which can be configured per instance
+static const size_t MAX_STORAGE_SECONDS = 3600;
+/// The default number of samples over which the edges of each recorded segment are faded
 static const size_t NR_OF_BLEND_SAMPLES = 64;
+/// The maximum number of samples which can be set for the fades
+static const size_t MAX_BLEND_SAMPLES = 4096;
+/// The number of entries in each precomputed fade curve
+static const size_t FADE_TABLE_SIZE = 1024;
+/// The number of samples over which the gain of a dub changes, e.g. when it is faded
+/// out on undo or faded in on redo
+static const size_t NR_OF_RAMP_SAMPLES = 512;
+/// The DSP load is averaged over about this many seconds before it is compared to the
+/// load at which the quietest dubs are left out
+static const double CULLING_LOAD_SECONDS = 0.1;
+/// While dubs are left out, the load has to stay below this part of that load for
+/// CULLING_HOLD_SECONDS before all dubs are played again
+static const float CULLING_RELEASE_RATIO = 0.5f;
+static const double CULLING_HOLD_SECONDS = 2.0;
+/// The largest factor the loop can be multiplied by at once
+static const size_t MAX_LOOP_MULTIPLY = 16;
+/// The highest playback speed, forwards and backwards
+static const float MAX_PLAYBACK_SPEED = 2.0f;
+/// The number of samples interpolated at a time when the loop is played at another speed
+static const size_t VARISPEED_CHUNK = 256;
+/// The number of loop samples needed for such a chunk at the highest speed, including
+/// the ones around them needed by the interpolation
+static const size_t VARISPEED_BUS_SIZE = size_t(MAX_PLAYBACK_SPEED) * VARISPEED_CHUNK + 8;
+/// The slowest and the fastest tempo the loop can be played at without changing its pitch,
+/// relative to the tempo it was recorded at
+static const float MIN_TEMPO_RATIO = 0.5f;
+static const float MAX_TEMPO_RATIO = 2.0f;
+/// The number of output samples between two grains when the loop is played at another
+/// tempo. Each grain is twice as long, so it overlaps with the grains before and after it.
+static const size_t STRETCH_HOP = 512;
+/// A grain is moved up to this many samples away from its position in the loop, to where
+/// it continues the grain before it best
+static const size_t STRETCH_SEARCH = 256;
+/// The step between the positions, and between the samples compared, of the coarse search
+/// for the best position of a grain. Only the best one is refined sample by sample.
+static const size_t STRETCH_SEARCH_STEP = 4;
+/// The number of offsets of a grain compared by the coarse search and around its best one
+static const size_t STRETCH_COARSE_CANDIDATES = 2 * STRETCH_SEARCH / STRETCH_SEARCH_STEP + 1;
+static const size_t STRETCH_FINE_CANDIDATES = 2 * STRETCH_SEARCH_STEP - 1;
+/// The number of loop samples the dubs are mixed ahead of the one played at another tempo.
+/// The current grain, the continuation of it and the offsets searched for the next one
+/// must be mixed while it is played.
+static const size_t STRETCH_LOOKAHEAD = STRETCH_SEARCH + STRETCH_SEARCH_STEP + 2 * STRETCH_HOP;
+/// The number of mixed loop samples kept for playing at another tempo, a power of two.
+/// The grains, the positions searched and the samples mixed ahead must fit in.
+static const size_t STRETCH_RING_SIZE = 8192;
+/// The maximum gain of a dub which can be set in dB
+static const float MAX_DUB_GAIN_DB = 12.0f;
+/// The maximum number of segments of a dub. A dub is split into segments at
+/// silent gaps, so the silence does not need to be stored.
+static const size_t NR_OF_SEGMENTS = 16;
+/// The number of samples for which the peak is stored. Blocks with a peak below
+/// the silence floor are skipped when playing back.
+static const size_t PEAK_BLOCK_SIZE = 64;
+/// Audio below this level (about -90dB) is considered silence
+static const float SILENCE_FLOOR = 0.00003f;
 /// Allow to enable logging to a file (/root/loopor.log)
 static const bool LOG_ENABLED = false;
+/// Allow to control the looper via OSC messages sent to a UDP port on localhost
+static const bool OSC_ENABLED = false;
+/// The UDP port the OSC control endpoint listens on
+static const uint16_t OSC_PORT = 9951;
+/// The maximum number of OSC commands / replies which can be queued between
+/// the listener thread and the audio thread
+static const size_t OSC_QUEUE_SIZE = 64;
+/// Allow to losslessly compress older dubs in a background thread, so their memory
+/// can be used for recording more audio
+static const bool COMPRESSION_ENABLED = false;
+/// The number of most recent dubs which are never compressed
+static const size_t COMPRESSION_KEEP_RAW_DUBS = 4;
+/// The number of samples compressed together. Each block can be decoded on its own.
+static const size_t COMPRESSION_BLOCK_SIZE = 256;
+/// The part of the memory for the storage which is used for compressed audio instead,
+/// so compressing does not need any more memory
+static const double COMPRESSION_POOL_RATIO = 0.25;
+/// Allow to move the oldest dubs to a file when the storage gets full. They are played
+/// back from a buffer which a background thread fills ahead of the play position.
+static const bool TIERING_ENABLED = false;
+/// The directory for the file. It should be on a disk, not in memory.
+static const char* TIERING_DIRECTORY = "/root";
+/// Dubs are moved to the file while more than this part of the storage is used
+static const double TIERING_STORAGE_THRESHOLD = 0.75;
+/// The number of most recent dubs which are never moved to the file
+static const size_t TIERING_KEEP_DUBS = 8;
+/// The number of samples the dubs on file are read ahead of the play position
+static const size_t TIERING_PREFETCH_SAMPLES = 32768;
+/// The number of samples read from the file at a time
+static const size_t TIERING_BLOCK_SIZE = 256;
+/// The most samples a dub is moved down in the storage at a time. A dub moved by less than
+/// its length overlaps itself, it is moved by at most that distance at a time then.
+static const size_t MOVE_CHUNK_SIZE = 4096;
+/// Mix the dubs of each scene in the background, so switching to a scene crossfades
+/// two mixes instead of mixing its dubs on the audio thread
+static const bool SCENE_BUSES_ENABLED = true;
+/// The memory for the mixes of the scenes, as a part of the number of samples of the
+/// storage. The buses of the scene played and of the next one always get memory, the
+/// ones of the other scenes only if it fits.
+static const double SCENE_BUS_RATIO = 0.25;
+/// The number of scene buses: one for each scene and one for all dubs, one for the bus
+/// faded out and one being mixed
+static const size_t NR_OF_SCENE_BUSES = NR_OF_SCENES + 3;
+/// Allow to write a histogram of the time spent in each run call to a file
+/// (/root/loopor-profile.log)
+static const bool PROFILING_ENABLED = false;
+/// The number of threads helping the audio thread to mix the dubs, for hosts with
+/// many cores and sessions with many dubs. 0 mixes all dubs in the audio thread.
+static const size_t NR_OF_MIXING_THREADS = 0;
+/// The number of dubs a thread mixes at a time
+static const size_t MIXING_DUBS_PER_JOB = 4;
+/// Fewer dubs are mixed by the audio thread alone, handing them over costs more than it saves
+static const size_t MIXING_MIN_DUBS = 16;
+/// Shorter chunks are mixed by the audio thread alone, for the same reason
+static const uint32_t MIXING_MIN_SAMPLES = 64;
+/// The size of the buffer each mixing thread adds its dubs to. Chunks reaching beyond
+/// it are mixed by the audio thread alone.
+static const uint32_t MIXING_BUFFER_SIZE = 8192;
+/// The maximum number of jobs the dubs are split into
+static const size_t MAX_MIXING_JOBS = (NR_OF_DUBS + MIXING_DUBS_PER_JOB - 1) / MIXING_DUBS_PER_JOB;
+/// How long the audio thread waits for the jobs claimed by the mixing threads, as the
+/// number of its own jobs it could have mixed meanwhile, but at least MIXING_MIN_WAIT
+/// microseconds. Then it mixes them itself.
+static const size_t MIXING_WAIT_JOBS = 2;
+static const size_t MIXING_MIN_WAIT = 50;
 
 ///
 /// Convert an input parameter expressed as db into a linear float value
@@ -106,6 +286,65 @@ enum PortIndex
     LOOPER_DRY_AMOUNT = 10,
     /// Select if dub ends at end of loop
     LOOPER_CONTINUOUS_DUB = 11,
+    /// Output: the looper state
+    LOOPER_STATE_OUTPUT = 12,
+    /// Output: the number of active dubs
+    LOOPER_DUBS_OUTPUT = 13,
+    /// Output: the number of recorded dubs, including those which could be redone
+    LOOPER_RECORDED_DUBS_OUTPUT = 14,
+    /// Output: storage used in percent
+    LOOPER_STORAGE_OUTPUT = 15,
+    /// Output: position in the loop (0..1)
+    LOOPER_POSITION_OUTPUT = 16,
+    /// Output: time spent in run as a fraction of the real time of the processed samples
+    LOOPER_DSP_LOAD_OUTPUT = 17,
+    /// Silence longer than this many seconds is not stored (0 to always store it)
+    LOOPER_SILENCE_GAP = 18,
+    /// Atom sequence with patch messages for the mixer
+    LOOPER_CONTROL = 19,
+    /// The number of samples over which the edges of the segments are faded
+    LOOPER_FADE_LENGTH = 20,
+    /// The shape of the fades (see FadeShape)
+    LOOPER_FADE_SHAPE = 21,
+    /// The playback speed, negative to play backwards
+    LOOPER_SPEED = 22,
+    /// The tempo relative to the one the loop was recorded at, without changing the pitch
+    LOOPER_TEMPO = 23,
+    /// Multiply the tempo with the change of the tempo of the host since the first dub?
+    LOOPER_FOLLOW_TEMPO = 24,
+    /// The track which is recorded, undone and redone (1 for the first one)
+    LOOPER_TRACK = 25,
+    /// The scene played (1 for the first one, 0 to play all dubs), it changes at the start of the loop
+    LOOPER_SCENE = 26,
+    /// Branch button: switch the last dub of the track to the next one recorded on the same dubs
+    LOOPER_BRANCH = 27,
+    /// Snapshot button: keep the current dubs to go back to them later, double press to drop them
+    LOOPER_SNAPSHOT = 28,
+    /// Restore button: go back to the dubs of the snapshot
+    LOOPER_RESTORE = 29,
+    /// The maximum number of dubs, 0 for the one given by the host
+    LOOPER_MAX_DUBS = 30,
+    /// The number of seconds which can be recorded, 0 for the one given by the host
+    LOOPER_STORAGE_SECONDS = 31,
+    /// The level (in dB relative to the mix) up to which the quietest dubs are left out
+    LOOPER_CULL_LEVEL = 32,
+    /// The DSP load above which the quietest dubs are left out, 1 to always play all dubs
+    LOOPER_CULL_LOAD = 33,
+    /// The first audio output of the first track, each track has two after the ones of the track before
+    LOOPER_TRACK_OUTPUTS = 34,
+};
+
+///
+/// The shapes of the fades at the edges of the segments
+///
+enum FadeShape
+{
+    /// The gain changes linearly
+    FADE_LINEAR = 0,
+    /// The power stays constant when crossfading uncorrelated audio
+    FADE_EQUAL_POWER = 1,
+    /// The number of shapes
+    NR_OF_FADE_SHAPES = 2
 };
 
 ///
@@ -114,15 +353,819 @@ enum PortIndex
 class Dub
 {
 public:
+    ///
+    /// A part of the dub which is actually stored. The silence between segments
+    /// does not use any memory.
+    ///
+    class Segment
+    {
+    public:
+        /// The start of the segment in the loop, relative to the start of the dub
+        size_t m_loopOffset = 0;
+        /// Where is the segment's audio memory starting in the global audio storage?
+        size_t m_storageOffset = 0;
+        /// The number of samples stored for the segment
+        size_t m_length = 0;
+        /// Where is the segment's compressed audio starting in the compression pool?
+        size_t m_compressedOffset = 0;
+        /// Where is the segment's audio starting in the tiering file (in bytes)?
+        size_t m_fileOffset = 0;
+        /// Does the segment directly continue the previous one? That is the case if
+        /// it was only split because the storage wrapped, so there is no fade between.
+        bool m_continued = false;
+    };
+
     /// Where is the dub's audio memory starting in the global audio storage?
     size_t m_storageOffset = 0;
-    /// The length of the dub. Each dub can have an individual length, but they
-    /// will still stay in sync!
+    /// The length of the dub in the loop, including the gaps between segments.
+    /// Each dub can have an individual length, but they will still stay in sync!
     size_t m_length = 0;
     /// The start index in the loop. This allows to save the memory before there
     /// is actual audio in the loop. A dub only needs the memory between the
     /// first and the last audio saved in the dub.
     size_t m_startIndex = 0;
+    /// The length of the loop when the dub was recorded. If the loop was multiplied
+    /// since, the dub repeats within it.
+    size_t m_period = 0;
+    /// Identifies the recording, a new recording in the same slot gets a new id.
+    size_t m_id = 0;
+    /// The track the dub was recorded on
+    size_t m_track = 0;
+    /// The id of the dub of the track which was played last when the dub was recorded,
+    /// 0 if none. The dubs recorded on the same dub are branches of the undo history.
+    size_t m_parentId = 0;
+    /// When the dub was last recorded, redone or switched to. Redo follows the branch
+    /// played last.
+    size_t m_visit = 0;
+    /// Was the dub deleted, or dropped from the undo history to free storage? It cannot be
+    /// redone anymore, but keeps its slot as long as a dub after it is kept. Its audio is
+    /// not needed anymore once it is faded out.
+    bool m_discarded = false;
+    ///
+    /// Where the audio of a dub is kept
+    ///
+    enum Location
+    {
+        /// In the global audio storage
+        IN_STORAGE,
+        /// In the compression pool
+        COMPRESSED,
+        /// In the tiering file
+        ON_FILE
+    };
+
+    /// Where is the audio of the dub?
+    Location m_location = IN_STORAGE;
+    /// Where does the dub's compressed audio end in the compression pool?
+    size_t m_compressedEnd = 0;
+    /// Where does the dub's audio end in the tiering file?
+    size_t m_fileEnd = 0;
+    /// The stored parts of the dub, ordered by their position in the loop and storage
+    Segment m_segments[NR_OF_SEGMENTS];
+    /// The number of segments in use
+    size_t m_nrOfSegments = 0;
+    /// Are the edges of the segments faded when the dub is played? Not for a bounced
+    /// dub, it contains the other dubs with their fades already.
+    bool m_fades = true;
+    /// The highest peak of the audio, before any gain is applied
+    float m_peak = 0.0f;
+
+    /// Where does the dub's audio memory end in the global audio storage?
+    size_t storageEnd() const
+    {
+        if (m_nrOfSegments == 0)
+            return m_storageOffset;
+        const Segment& last = m_segments[m_nrOfSegments - 1];
+        return last.m_storageOffset + last.m_length;
+    }
+
+    /// The number of samples recorded past the end of the period, only the first dub has
+    /// them. They are kept as the end of its last segment and crossfaded into its start
+    /// when played.
+    size_t tailLength() const
+    {
+        return m_length > m_period ? m_length - m_period : 0;
+    }
+};
+
+typedef Dub::Segment Segment;
+
+///
+/// The fade-in curves of all shapes, computed once. A fade-out uses the same curve
+/// backwards.
+///
+class FadeTable
+{
+public:
+    /// Constructor
+    FadeTable()
+    {
+        for (size_t i = 0; i < FADE_TABLE_SIZE; i++)
+        {
+            float x = float(i) / FADE_TABLE_SIZE;
+            m_curves[FADE_LINEAR][i] = x;
+            m_curves[FADE_EQUAL_POWER][i] = sinf(x * float(M_PI / 2));
+        }
+    }
+
+    /// The curve of a shape.
+    /// \param shape The shape.
+    /// \return FADE_TABLE_SIZE gains, rising from 0 towards 1.
+    const float* curve(FadeShape shape) const
+    {
+        return m_curves[shape];
+    }
+
+    /// The gain of a sample within a fade-in.
+    /// \param shape The shape.
+    /// \param distance The distance of the sample from the start of the fade.
+    /// \param length The length of the fade.
+    /// \return The gain, 1 after the fade.
+    float gain(FadeShape shape, size_t distance, size_t length) const
+    {
+        return distance < length ? m_curves[shape][distance * FADE_TABLE_SIZE / length] : 1.0f;
+    }
+
+private:
+    /// The curves, one per shape
+    float m_curves[NR_OF_FADE_SHAPES][FADE_TABLE_SIZE];
+};
+
+/// The fade curves
+static const FadeTable FADE_TABLE;
+
+///
+/// The fades at both edges of a segment. A segment which is continued by others because
+/// the storage wrapped is faded as a whole. The audio in the storage stays as it was
+/// recorded, the fades are applied when it is played.
+///
+struct EdgeFade
+{
+    /// The start of the faded segment in the loop, relative to the start of the dub
+    size_t m_start = 0;
+    /// The end of the faded segment, relative to the start of the dub. The samples after
+    /// it are silent, they are the part of a tail which is not crossfaded.
+    size_t m_end = 0;
+    /// The number of samples faded in at the start, at most half of the segment
+    size_t m_inLength = 0;
+    /// The number of samples faded out at the end, at most half of the segment
+    size_t m_outLength = 0;
+    /// The fade-in curve
+    const float* m_curve = NULL;
+    /// Added to a sample in the output to get the sample relative to the start of the dub
+    int64_t m_offset = 0;
+
+    /// Get the fades of a segment.
+    /// \param dub The dub.
+    /// \param segmentIndex The index of the segment in the dub.
+    /// \param length The number of samples to fade at each edge.
+    /// \param shape The shape of the fades.
+    /// \return The fades, with a length of 0 for each edge which is not faded.
+    static EdgeFade forSegment(const Dub& dub, size_t segmentIndex, size_t length, FadeShape shape)
+    {
+        EdgeFade fade;
+        size_t first = segmentIndex;
+        while (first > 0 && dub.m_segments[first].m_continued)
+            first--;
+        size_t last = segmentIndex;
+        while (last + 1 < dub.m_nrOfSegments && dub.m_segments[last + 1].m_continued)
+            last++;
+        fade.m_start = dub.m_segments[first].m_loopOffset;
+        fade.m_end = dub.m_segments[last].m_loopOffset + dub.m_segments[last].m_length;
+        size_t half = (fade.m_end - fade.m_start) / 2;
+        size_t fadeLength = dub.m_fades ? (length < half ? length : half) : 0;
+        fade.m_inLength = fadeLength;
+        fade.m_outLength = fadeLength;
+        size_t tail = dub.tailLength();
+        if (tail > 0)
+        {
+            // The start of the dub is crossfaded with the tail, over at most the part of the
+            // tail which was recorded.
+            size_t crossfade = fadeLength < tail ? fadeLength : tail;
+            if (fade.m_start == 0)
+                fade.m_inLength = crossfade;
+            if (fade.m_end == dub.m_length)
+            {
+                fade.m_end = dub.m_period + crossfade;
+                fade.m_outLength = crossfade;
+            }
+        }
+        fade.m_curve = FADE_TABLE.curve(shape);
+        return fade;
+    }
+
+    /// Get the gain of a sample within the segment.
+    /// \param position The sample relative to the start of the dub.
+    /// \return The gain, 1 between the fades and 0 after the end.
+    float gain(size_t position) const
+    {
+        size_t fromStart = position - m_start;
+        if (fromStart < m_inLength)
+            return m_curve[fromStart * FADE_TABLE_SIZE / m_inLength];
+        if (position >= m_end)
+            return 0.0f;
+        size_t fromEnd = m_end - 1 - position;
+        if (fromEnd < m_outLength)
+            return m_curve[fromEnd * FADE_TABLE_SIZE / m_outLength];
+        return 1.0f;
+    }
+};
+
+///
+/// The gains of a dub within a chunk of the output: They change linearly for the first
+/// samples of the ramp, afterwards they stay at the target.
+///
+struct GainRamp
+{
+    /// The sample in the output where the ramp starts
+    uint32_t m_start = 0;
+    /// The gain of the first channel at the start
+    float m_gain1 = 1.0f;
+    /// The gain of the second channel at the start
+    float m_gain2 = 1.0f;
+    /// The change of the gain of the first channel per sample
+    float m_step1 = 0.0f;
+    /// The change of the gain of the second channel per sample
+    float m_step2 = 0.0f;
+    /// The number of samples until the targets are reached
+    size_t m_length = 0;
+    /// The gain of the first channel after the ramp
+    float m_target1 = 1.0f;
+    /// The gain of the second channel after the ramp
+    float m_target2 = 1.0f;
+
+    /// Get the gains at a sample of the output.
+    /// \param sample The sample in the output, not before the start.
+    /// \param gain1 Set to the gain of the first channel.
+    /// \param gain2 Set to the gain of the second channel.
+    void gainsAt(uint32_t sample, float& gain1, float& gain2) const
+    {
+        size_t position = sample - m_start;
+        gain1 = position < m_length ? m_gain1 + m_step1 * position : m_target1;
+        gain2 = position < m_length ? m_gain2 + m_step2 * position : m_target2;
+    }
+};
+
+///
+/// What the dubs are mixed from. The audio thread mixes from the state of the looper,
+/// the jobs of the mixing threads from a copy made for their round (see MixingThreads),
+/// so a thread which is late does not see the changes of the next run call.
+///
+struct MixSource
+{
+    /// The dubs
+    const Dub* m_dubs;
+    /// The audio storage of the first channel
+    const float* m_storage1;
+    /// The audio storage of the second channel
+    const float* m_storage2;
+    /// The peak table of the storage
+    const float* m_peaks;
+    /// Where the compressed audio is
+    const uint8_t* m_compressionPool;
+    /// The number of samples faded at the edges of the segments
+    size_t m_fadeLength;
+    /// The shape of the fades
+    FadeShape m_fadeShape;
+    /// The dub moved within the storage, NR_OF_DUBS if none
+    size_t m_movingDub;
+    /// The id of the dub moved
+    size_t m_movingId;
+    /// Where the dub is moved to
+    size_t m_movingDestination;
+    /// The number of samples of the dub played from where they were moved to
+    size_t m_movedSamples;
+};
+
+///
+/// Where dubs are added to. The samples are indexed like the output of the block.
+///
+struct MixBus
+{
+    /// The first channel
+    float* m_output1;
+    /// The second channel
+    float* m_output2;
+    /// Where compressed blocks are decoded to instead of the cache of the dub, NULL to
+    /// use the cache. The first channel.
+    float* m_decoded1;
+    /// The second channel
+    float* m_decoded2;
+    /// What the dubs are mixed from
+    const MixSource* m_source;
+};
+
+///
+/// Where the dubs are added to, a bus for each track
+///
+struct TrackBuses
+{
+    /// The first channel of each track
+    float* m_outputs1[NR_OF_TRACKS];
+    /// The second channel of each track
+    float* m_outputs2[NR_OF_TRACKS];
+    /// See MixBus
+    float* m_decoded1;
+    /// See MixBus
+    float* m_decoded2;
+    /// See MixBus
+    const MixSource* m_source;
+
+    /// The bus of a track.
+    MixBus track(size_t track) const
+    {
+        MixBus bus = {m_outputs1[track], m_outputs2[track], m_decoded1, m_decoded2, m_source};
+        return bus;
+    }
+};
+
+///
+/// The mixer settings (gain, mute, pan) of all dubs and the gains they are currently
+/// played with. Each value is kept in an array indexed by the dub, so the gains of all
+/// dubs are next to each other when they are advanced for each chunk. Changes are
+/// smoothed by a linear ramp over NR_OF_RAMP_SAMPLES. The gain and mute of a track
+/// apply to all of its dubs. Dubs which are not part of the scene played are silent.
+/// The scene buses, mixes of the dubs of a scene, are crossfaded with the same ramp
+/// when the scene changes.
+///
+class DubMixer
+{
+public:
+    /// Constructor
+    DubMixer()
+    {
+        for (size_t k = 0; k < NR_OF_TRACKS; k++)
+        {
+            m_trackGains[k] = 1.0f;
+            m_trackMutes[k] = false;
+        }
+        for (size_t t = 0; t < NR_OF_DUBS; t++)
+            resetDub(t, 0, ALL_SCENES);
+    }
+
+    /// Set a dub to unity gain without a ramp, e.g. when it is recorded. It is still
+    /// played with the settings of its track.
+    /// \param dubIndex The index of the dub.
+    /// \param track The track of the dub.
+    /// \param scenes The scenes the dub is part of, a bit for each scene.
+    void resetDub(size_t dubIndex, size_t track, uint32_t scenes)
+    {
+        m_tracks[dubIndex] = track;
+        m_scenes[dubIndex] = scenes;
+        m_gains[dubIndex] = 1.0f;
+        m_pans[dubIndex] = 0.0f;
+        m_mutes[dubIndex] = false;
+        m_active[dubIndex] = true;
+        m_culled[dubIndex] = false;
+        m_levels1[dubIndex] = m_targets1[dubIndex] = mixGain1(dubIndex);
+        m_levels2[dubIndex] = m_targets2[dubIndex] = mixGain2(dubIndex);
+        m_rampSamples[dubIndex] = 0;
+        m_followsBuses[dubIndex] = false;
+    }
+
+    ///
+    /// The settings of a dub, to record it again with them
+    ///
+    struct Settings
+    {
+        float m_gain = 1.0f;
+        float m_pan = 0.0f;
+        bool m_mute = false;
+        uint32_t m_scenes = ALL_SCENES;
+    };
+
+    /// Get the settings of a dub.
+    /// \param dubIndex The index of the dub.
+    Settings settings(size_t dubIndex) const
+    {
+        Settings settings;
+        settings.m_gain = m_gains[dubIndex];
+        settings.m_pan = m_pans[dubIndex];
+        settings.m_mute = m_mutes[dubIndex];
+        settings.m_scenes = m_scenes[dubIndex];
+        return settings;
+    }
+
+    /// Set all settings of a dub without a ramp, e.g. when it is recorded.
+    /// \param dubIndex The index of the dub.
+    /// \param settings The settings.
+    void setSettings(size_t dubIndex, const Settings& settings)
+    {
+        m_gains[dubIndex] = settings.m_gain;
+        m_pans[dubIndex] = settings.m_pan;
+        m_mutes[dubIndex] = settings.m_mute;
+        m_scenes[dubIndex] = settings.m_scenes;
+        float played = this->played(dubIndex) ? 1.0f : 0.0f;
+        m_levels1[dubIndex] = m_targets1[dubIndex] = mixGain1(dubIndex) * played;
+        m_levels2[dubIndex] = m_targets2[dubIndex] = mixGain2(dubIndex) * played;
+        m_rampSamples[dubIndex] = 0;
+        m_followsBuses[dubIndex] = false;
+    }
+
+    /// Change all settings of a dub, e.g. when a snapshot is restored. The gains ramp from
+    /// where they are, or from silence if another dub was played in the slot before.
+    /// \param dubIndex The index of the dub.
+    /// \param track The track of the dub.
+    /// \param settings The settings.
+    /// \param active false if the dub is undone.
+    /// \param played Was the same dub played in the slot before?
+    void restoreDub(size_t dubIndex, size_t track, const Settings& settings, bool active, bool played)
+    {
+        if (!played)
+        {
+            m_levels1[dubIndex] = m_targets1[dubIndex] = 0.0f;
+            m_levels2[dubIndex] = m_targets2[dubIndex] = 0.0f;
+            m_rampSamples[dubIndex] = 0;
+            m_followsBuses[dubIndex] = false;
+        }
+        m_tracks[dubIndex] = track;
+        m_gains[dubIndex] = settings.m_gain;
+        m_pans[dubIndex] = settings.m_pan;
+        m_mutes[dubIndex] = settings.m_mute;
+        m_scenes[dubIndex] = settings.m_scenes;
+        m_active[dubIndex] = active;
+        startRamp(dubIndex);
+    }
+
+    /// Set the gain of a dub.
+    /// \param dubIndex The index of the dub.
+    /// \param gain The linear gain.
+    void setGain(size_t dubIndex, float gain)
+    {
+        m_gains[dubIndex] = gain;
+        startRamp(dubIndex);
+    }
+
+    /// Mute or unmute a dub.
+    /// \param dubIndex The index of the dub.
+    /// \param mute true to mute the dub.
+    void setMute(size_t dubIndex, bool mute)
+    {
+        m_mutes[dubIndex] = mute;
+        startRamp(dubIndex);
+    }
+
+    /// Set the balance of a dub between the two channels.
+    /// \param dubIndex The index of the dub.
+    /// \param pan -1 for the first channel only, 0 for both, 1 for the second channel only.
+    void setPan(size_t dubIndex, float pan)
+    {
+        m_pans[dubIndex] = pan;
+        startRamp(dubIndex);
+    }
+
+    /// Set the scenes a dub is part of.
+    /// \param dubIndex The index of the dub.
+    /// \param scenes A bit for each scene, the lowest one for the first scene.
+    void setScenes(size_t dubIndex, uint32_t scenes)
+    {
+        m_scenes[dubIndex] = scenes;
+        startRamp(dubIndex);
+    }
+
+    /// Play another scene. The dubs which are only part of one of the scenes are
+    /// crossfaded, the others keep playing.
+    /// \param scene The scene, 1 for the first one or 0 to play all dubs.
+    void setScene(size_t scene)
+    {
+        size_t previous = m_scene;
+        m_scene = scene;
+        for (size_t t = 0; t < NR_OF_DUBS; t++)
+        {
+            if (inScene(t, scene) != inScene(t, previous))
+                startRamp(t);
+        }
+        // The bus of the scene fades in, the one of the scene before fades out.
+        m_busLevel = 0.0f;
+        m_busRampSamples = NR_OF_RAMP_SAMPLES;
+        for (size_t t = 0; t < NR_OF_DUBS; t++)
+            m_followsBuses[t] = false;
+    }
+
+    /// Let a dub follow the crossfade of the scene buses if its gains ramp from the ones
+    /// it has in the bus faded out to the ones in the bus faded in, both starting right
+    /// now. It does not need to be mixed on its own then, until its gains are changed.
+    /// \param dubIndex The index of the dub.
+    /// \param from1 The gain of the first channel in the bus faded out, 0 if none.
+    /// \param from2 The gain of the second channel in the bus faded out.
+    /// \param to1 The gain of the first channel in the bus faded in, 0 if none.
+    /// \param to2 The gain of the second channel in the bus faded in.
+    void followBuses(size_t dubIndex, float from1, float from2, float to1, float to2)
+    {
+        m_followsBuses[dubIndex] = m_rampSamples[dubIndex] == NR_OF_RAMP_SAMPLES && m_busRampSamples ==
+            NR_OF_RAMP_SAMPLES && m_levels1[dubIndex] == from1 && m_levels2[dubIndex] == from2 &&
+            m_targets1[dubIndex] == to1 && m_targets2[dubIndex] == to2;
+    }
+
+    /// Does the dub follow the crossfade of the scene buses?
+    bool followsBuses(size_t dubIndex) const
+    {
+        return m_followsBuses[dubIndex];
+    }
+
+    /// Is the crossfade of the scene buses done?
+    bool busesSettled() const
+    {
+        return m_busRampSamples == 0;
+    }
+
+    /// The gain of a scene bus for the next chunk, see ramp.
+    /// \param start The first sample of the chunk in the output.
+    /// \param stretch The number of samples of the chunk per sample of the output.
+    /// \param fadedIn The bus of the scene played, otherwise the one of the scene before.
+    GainRamp busRamp(uint32_t start, float stretch, bool fadedIn) const
+    {
+        GainRamp ramp;
+        ramp.m_start = start;
+        ramp.m_gain1 = ramp.m_gain2 = fadedIn ? m_busLevel : 1.0f - m_busLevel;
+        ramp.m_length = size_t(m_busRampSamples * stretch);
+        ramp.m_target1 = ramp.m_target2 = fadedIn ? 1.0f : 0.0f;
+        if (ramp.m_length > 0)
+            ramp.m_step1 = ramp.m_step2 = (ramp.m_target1 - ramp.m_gain1) / ramp.m_length;
+        return ramp;
+    }
+
+    /// Set the gain of all dubs of a track.
+    /// \param track The track.
+    /// \param gain The linear gain.
+    void setTrackGain(size_t track, float gain)
+    {
+        m_trackGains[track] = gain;
+        startTrackRamps(track);
+    }
+
+    /// Mute or unmute all dubs of a track.
+    /// \param track The track.
+    /// \param mute true to mute the track.
+    void setTrackMute(size_t track, bool mute)
+    {
+        m_trackMutes[track] = mute;
+        startTrackRamps(track);
+    }
+
+    /// Fade a dub in or out, e.g. on undo and redo.
+    /// \param dubIndex The index of the dub.
+    /// \param active false to fade the dub out.
+    void setActive(size_t dubIndex, bool active)
+    {
+        m_active[dubIndex] = active;
+        startRamp(dubIndex);
+    }
+
+    /// Leave out a dub to save processing time, or play it again. The dub is faded like on
+    /// undo and redo, but it stays active.
+    /// \param dubIndex The index of the dub.
+    /// \param culled true to leave out the dub.
+    void setCulled(size_t dubIndex, bool culled)
+    {
+        if (m_culled[dubIndex] == culled)
+            return;
+        m_culled[dubIndex] = culled;
+        startRamp(dubIndex);
+    }
+
+    /// Start fading in a dub from silence.
+    /// \param dubIndex The index of the dub.
+    void fadeIn(size_t dubIndex)
+    {
+        m_levels1[dubIndex] = 0.0f;
+        m_levels2[dubIndex] = 0.0f;
+        m_followsBuses[dubIndex] = false;
+        setActive(dubIndex, true);
+    }
+
+    /// Is the dub faded in (or fading in)?
+    bool active(size_t dubIndex) const
+    {
+        return m_active[dubIndex];
+    }
+
+    /// Is the ramp of the dub done?
+    bool settled(size_t dubIndex) const
+    {
+        return m_rampSamples[dubIndex] == 0;
+    }
+
+    /// Is nothing of the dub heard, so it can be skipped?
+    bool silent(size_t dubIndex) const
+    {
+        return m_rampSamples[dubIndex] == 0 && m_targets1[dubIndex] == 0.0f && m_targets2[dubIndex] == 0.0f;
+    }
+
+    /// The scenes the dub is part of
+    uint32_t scenes(size_t dubIndex) const
+    {
+        return m_scenes[dubIndex];
+    }
+
+    /// The scene played, 0 if all dubs are played
+    size_t scene() const
+    {
+        return m_scene;
+    }
+
+    /// The number of ramps started so far, it changes whenever a gain is changed
+    size_t nrOfChanges() const
+    {
+        return m_nrOfChanges;
+    }
+
+    /// The gain of the first channel as set by the mixer settings of the dub and its
+    /// track and by the scene, no matter if the dub is active.
+    float mixGain1(size_t dubIndex) const
+    {
+        return sceneGain1(dubIndex, m_scene);
+    }
+
+    /// The gain of the second channel as set by the mixer settings of the dub and its
+    /// track and by the scene, no matter if the dub is active.
+    float mixGain2(size_t dubIndex) const
+    {
+        return sceneGain2(dubIndex, m_scene);
+    }
+
+    /// The gain of the first channel in a scene, no matter if the dub is active.
+    /// \param dubIndex The index of the dub.
+    /// \param scene The scene, 0 for all dubs.
+    float sceneGain1(size_t dubIndex, size_t scene) const
+    {
+        if (m_trackMutes[m_tracks[dubIndex]] || !inScene(dubIndex, scene))
+            return 0.0f;
+        return dubGain1(dubIndex) * m_trackGains[m_tracks[dubIndex]];
+    }
+
+    /// The gain of the second channel in a scene, no matter if the dub is active.
+    /// \param dubIndex The index of the dub.
+    /// \param scene The scene, 0 for all dubs.
+    float sceneGain2(size_t dubIndex, size_t scene) const
+    {
+        if (m_trackMutes[m_tracks[dubIndex]] || !inScene(dubIndex, scene))
+            return 0.0f;
+        return dubGain2(dubIndex) * m_trackGains[m_tracks[dubIndex]];
+    }
+
+    /// The gain of the first channel a dub settles at in a scene, like its target in the
+    /// scene played.
+    float playedGain1(size_t dubIndex, size_t scene) const
+    {
+        return sceneGain1(dubIndex, scene) * (played(dubIndex) ? 1.0f : 0.0f);
+    }
+
+    /// The gain of the second channel a dub settles at in a scene.
+    float playedGain2(size_t dubIndex, size_t scene) const
+    {
+        return sceneGain2(dubIndex, scene) * (played(dubIndex) ? 1.0f : 0.0f);
+    }
+
+    /// The gain of the first channel as set by the mixer settings of the dub alone.
+    float dubGain1(size_t dubIndex) const
+    {
+        if (m_mutes[dubIndex])
+            return 0.0f;
+        return m_pans[dubIndex] > 0.0f ? m_gains[dubIndex] * (1.0f - m_pans[dubIndex]) : m_gains[dubIndex];
+    }
+
+    /// The gain of the second channel as set by the mixer settings of the dub alone.
+    float dubGain2(size_t dubIndex) const
+    {
+        if (m_mutes[dubIndex])
+            return 0.0f;
+        return m_pans[dubIndex] < 0.0f ? m_gains[dubIndex] * (1.0f + m_pans[dubIndex]) : m_gains[dubIndex];
+    }
+
+    /// The gains of a dub for the next chunk.
+    /// \param dubIndex The index of the dub.
+    /// \param start The first sample of the chunk in the output.
+    /// \param stretch The number of samples of the chunk per sample of the output. The ramp
+    /// takes as many times longer, e.g. when the loop is played at another tempo.
+    GainRamp ramp(size_t dubIndex, uint32_t start, float stretch) const
+    {
+        GainRamp ramp;
+        ramp.m_start = start;
+        ramp.m_gain1 = m_levels1[dubIndex];
+        ramp.m_gain2 = m_levels2[dubIndex];
+        ramp.m_length = size_t(m_rampSamples[dubIndex] * stretch);
+        ramp.m_target1 = m_targets1[dubIndex];
+        ramp.m_target2 = m_targets2[dubIndex];
+        if (ramp.m_length > 0)
+        {
+            ramp.m_step1 = (ramp.m_target1 - ramp.m_gain1) / ramp.m_length;
+            ramp.m_step2 = (ramp.m_target2 - ramp.m_gain2) / ramp.m_length;
+        }
+        return ramp;
+    }
+
+    /// Move the gains of the dubs towards their targets.
+    /// \param nrOfDubs The number of dubs played.
+    /// \param nrOfSamples The number of samples played.
+    void advance(size_t nrOfDubs, uint32_t nrOfSamples)
+    {
+        if (m_busRampSamples <= nrOfSamples)
+        {
+            m_busLevel = 1.0f;
+            m_busRampSamples = 0;
+        }
+        else
+        {
+            m_busLevel += (1.0f - m_busLevel) * float(nrOfSamples) / float(m_busRampSamples);
+            m_busRampSamples -= nrOfSamples;
+        }
+        for (size_t t = 0; t < nrOfDubs; t++)
+        {
+            if (m_rampSamples[t] == 0)
+                continue;
+            if (m_rampSamples[t] <= nrOfSamples)
+            {
+                m_levels1[t] = m_targets1[t];
+                m_levels2[t] = m_targets2[t];
+                m_rampSamples[t] = 0;
+                continue;
+            }
+            float progress = float(nrOfSamples) / float(m_rampSamples[t]);
+            m_levels1[t] += (m_targets1[t] - m_levels1[t]) * progress;
+            m_levels2[t] += (m_targets2[t] - m_levels2[t]) * progress;
+            m_rampSamples[t] -= nrOfSamples;
+        }
+    }
+
+private:
+    /// The track of each dub
+    size_t m_tracks[NR_OF_DUBS];
+    /// The gain set for each track (linear)
+    float m_trackGains[NR_OF_TRACKS];
+    /// Is the track muted?
+    bool m_trackMutes[NR_OF_TRACKS];
+    /// The scenes each dub is part of, a bit for each scene
+    uint32_t m_scenes[NR_OF_DUBS];
+    /// The scene played, 1 for the first one or 0 to play all dubs
+    size_t m_scene = 0;
+    /// The gain set for each dub (linear)
+    float m_gains[NR_OF_DUBS];
+    /// The balance set for each dub
+    float m_pans[NR_OF_DUBS];
+    /// Is the dub muted?
+    bool m_mutes[NR_OF_DUBS];
+    /// Is the dub faded in, false after it was undone
+    bool m_active[NR_OF_DUBS];
+    /// Is the dub left out to save processing time?
+    bool m_culled[NR_OF_DUBS];
+    /// The current gain of the first channel
+    float m_levels1[NR_OF_DUBS];
+    /// The current gain of the second channel
+    float m_levels2[NR_OF_DUBS];
+    /// The gain of the first channel at the end of the ramp
+    float m_targets1[NR_OF_DUBS];
+    /// The gain of the second channel at the end of the ramp
+    float m_targets2[NR_OF_DUBS];
+    /// The number of samples until the ramp is done
+    uint32_t m_rampSamples[NR_OF_DUBS];
+    /// The number of ramps started so far
+    size_t m_nrOfChanges = 0;
+    /// The gain of the scene bus faded in
+    float m_busLevel = 1.0f;
+    /// The number of samples until the crossfade of the scene buses is done
+    uint32_t m_busRampSamples = 0;
+    /// Does the dub follow the crossfade of the scene buses?
+    bool m_followsBuses[NR_OF_DUBS] = {};
+
+    /// Ramp the gains of a dub from where they are to the ones of its current settings.
+    /// A dub which has these gains already keeps them without a ramp, so a dub which is
+    /// faded out stays settled.
+    void startRamp(size_t dubIndex)
+    {
+        float played = this->played(dubIndex) ? 1.0f : 0.0f;
+        float target1 = mixGain1(dubIndex) * played;
+        float target2 = mixGain2(dubIndex) * played;
+        if (m_rampSamples[dubIndex] == 0 && m_levels1[dubIndex] == target1 && m_levels2[dubIndex] == target2)
+            return;
+        m_followsBuses[dubIndex] = false;
+        m_targets1[dubIndex] = target1;
+        m_targets2[dubIndex] = target2;
+        m_rampSamples[dubIndex] = NR_OF_RAMP_SAMPLES;
+        m_nrOfChanges++;
+    }
+
+    /// Is a dub played at all, i.e. active and not left out?
+    bool played(size_t dubIndex) const
+    {
+        return m_active[dubIndex] && !m_culled[dubIndex];
+    }
+
+    /// Is a dub played in a scene?
+    bool inScene(size_t dubIndex, size_t scene) const
+    {
+        return scene == 0 || ((m_scenes[dubIndex] >> (scene - 1)) & 1) != 0;
+    }
+
+    /// Ramp the gains of all dubs of a track to the ones of the current settings.
+    void startTrackRamps(size_t track)
+    {
+        for (size_t t = 0; t < NR_OF_DUBS; t++)
+        {
+            if (m_tracks[t] == track)
+                startRamp(t);
+        }
+    }
 };
 
 ///
@@ -181,460 +1224,6584 @@ public:
 };
 
 ///
-/// The looper class
+/// Collects a histogram of the time spent in each run call, separately for each
+/// looper state, plus the worst case. The audio thread only increments counters.
+/// A separate thread regularly writes the histogram to a file.
 ///
-class Looper
+class RunTimeProfiler
 {
 public:
-    /// Constructor
-    /// \param sampleRate The sample rate is used for calculation of the storage needed
-    ///                   and also the current time.
-    Looper(double sampleRate)
-        : m_sampleRate(sampleRate)
-    {
-        // Allocate the needed memory
-        m_storageSize = sampleRate * STORAGE_MEMORY_SECONDS * 2;
-        m_storage1 = new float[m_storageSize];
-        m_storage2 = new float[m_storageSize];
+    /// The number of looper states we distinguish
+    static const size_t NR_OF_STATES = LOOPER_STATE_PLAYING + 1;
+    /// Bucket b counts run calls which took between 2^b and 2^(b+1) microseconds,
+    /// the first bucket also counts anything faster, the last anything slower.
+    static const size_t NR_OF_BUCKETS = 24;
 
-        if (LOG_ENABLED)
-            m_logFile = fopen("/root/loopor.log", "wb");
+    /// Destructor
+    ~RunTimeProfiler()
+    {
+        stop();
     }
 
-    // Destructor
-    ~Looper()
+    /// Start the thread writing the histogram to the given file.
+    void start(const char* path)
     {
-        delete[] m_storage1;
-        delete[] m_storage2;
-        if (m_logFile != NULL)
-            fclose(m_logFile);
+        m_path = path;
+        m_running = true;
+        m_thread = std::thread([this]() { dumpRegularly(); });
     }
 
-    /// Called by the host for each port to connect it to the looper.
+    /// Stop the thread, writing the histogram a last time.
+    void stop()
+    {
+        if (!m_running)
+            return;
+        m_running = false;
+        m_thread.join();
+    }
+
+    /// Add a run call to the histogram. To be called from the audio thread only.
+    /// \param state The looper state at the start of the run call.
+    /// \param nanoseconds The time spent in the run call.
+    void add(State state, uint64_t nanoseconds)
+    {
+        uint64_t microseconds = nanoseconds / 1000;
+        size_t bucket = 0;
+        if (microseconds > 1)
+            bucket = 63 - __builtin_clzll(microseconds);
+        if (bucket >= NR_OF_BUCKETS)
+            bucket = NR_OF_BUCKETS - 1;
+
+        // We are the only writer, so no read-modify-write is needed.
+        std::atomic<uint32_t>& count = m_counts[state][bucket];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (nanoseconds > m_worstCase[state].load(std::memory_order_relaxed))
+            m_worstCase[state].store(nanoseconds, std::memory_order_relaxed);
+    }
+
+private:
+    /// Where to write the histogram to
+    const char* m_path = NULL;
+    /// Is the thread supposed to run?
+    std::atomic<bool> m_running{false};
+    /// The thread writing the histogram
+    std::thread m_thread;
+    /// The number of run calls per state and bucket
+    std::atomic<uint32_t> m_counts[NR_OF_STATES][NR_OF_BUCKETS] = {};
+    /// The longest run call per state in nanoseconds
+    std::atomic<uint64_t> m_worstCase[NR_OF_STATES] = {};
+
+    /// The body of the thread.
+    void dumpRegularly()
+    {
+        while (m_running)
+        {
+            for (int i = 0; i < 10 && m_running; i++)
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            dump();
+        }
+    }
+
+    /// Write the histogram to the file, one line per bucket and one column per state.
+    void dump()
+    {
+        FILE* file = fopen(m_path, "wb");
+        if (file == NULL)
+            return;
+
+        fprintf(file, "# run time [us]   inactive    waiting  recording    playing\n");
+        for (size_t bucket = 0; bucket < NR_OF_BUCKETS; bucket++)
+        {
+            fprintf(file, "%16llu", 1ULL << bucket);
+            for (size_t state = 0; state < NR_OF_STATES; state++)
+                fprintf(file, " %10u", unsigned(m_counts[state][bucket].load(std::memory_order_relaxed)));
+            fprintf(file, "\n");
+        }
+        fprintf(file, "# worst case [us]");
+        for (size_t state = 0; state < NR_OF_STATES; state++)
+            fprintf(file, " %10.1f", double(m_worstCase[state].load(std::memory_order_relaxed)) / 1000.0);
+        fprintf(file, "\n");
+        fclose(file);
+    }
+};
+
+///
+/// A lock-free queue for exactly one producer thread and one consumer thread.
+/// Neither push() nor pop() ever block or allocate, so it is safe to be used from
+/// the audio thread.
+///
+template <typename T, size_t CAPACITY>
+class SpscQueue
+{
+public:
+    /// Add an item to the queue. Must only be called from the producer thread.
+    /// \return false if the queue is full and the item was dropped.
+    bool push(const T& item)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t next = (head + 1) % CAPACITY;
+        if (next == m_tail.load(std::memory_order_acquire))
+            return false;
+        m_items[head] = item;
+        m_head.store(next, std::memory_order_release);
+        return true;
+    }
+
+    /// Remove the oldest item from the queue. Must only be called from the
+    /// consumer thread.
+    /// \return false if the queue is empty.
+    bool pop(T& item)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_head.load(std::memory_order_acquire))
+            return false;
+        item = m_items[tail];
+        m_tail.store((tail + 1) % CAPACITY, std::memory_order_release);
+        return true;
+    }
+
+private:
+    /// The items. One slot always stays empty to distinguish full from empty.
+    T m_items[CAPACITY];
+    /// Where the producer writes the next item
+    std::atomic<size_t> m_head{0};
+    /// Where the consumer reads the next item
+    std::atomic<size_t> m_tail{0};
+};
+
+///
+/// The commands which can be sent to the looper via OSC
+///
+typedef enum
+{
+    /// Same as the "Activate" button: start or finish recording
+    OSC_COMMAND_RECORD,
+    /// Same as the "Dub" button: finish any recording and start a new dub
+    OSC_COMMAND_DUB,
+    /// Undo the last dub
+    OSC_COMMAND_UNDO,
+    /// Redo the last undone dub
+    OSC_COMMAND_REDO,
+    /// Clear all loops
+    OSC_COMMAND_RESET,
+    /// Mix all dubs down into the first one
+    OSC_COMMAND_BOUNCE,
+    /// Multiply the loop length by the argument (2 if there is none)
+    OSC_COMMAND_MULTIPLY,
+    /// Same as the "Branch" button: switch to the next branch of the undo history
+    OSC_COMMAND_BRANCH,
+    /// Delete the dub with the index given by the argument
+    OSC_COMMAND_DELETE,
+    /// Record the dub with the index given by the argument again
+    OSC_COMMAND_REPLACE,
+    /// Same as the "Snapshot" button: keep the current dubs to go back to them later
+    OSC_COMMAND_SNAPSHOT,
+    /// Same as the "Restore" button: go back to the dubs of the snapshot
+    OSC_COMMAND_RESTORE,
+    /// Drop the snapshot, so the storage of its dubs can be reused
+    OSC_COMMAND_RELEASE,
+    /// Do nothing, just reply with the state
+    OSC_COMMAND_QUERY
+} OscCommandType;
+
+///
+/// A command received via OSC, to be executed by the audio thread
+///
+struct OscCommand
+{
+    /// What to do
+    OscCommandType m_type = OSC_COMMAND_QUERY;
+    /// The integer argument, 0 if there is none
+    int32_t m_argument = 0;
+    /// Where to send the reply to
+    sockaddr_in m_sender;
+};
+
+///
+/// A reply to an OSC command, describing the looper state after executing it
+///
+struct OscReply
+{
+    /// Where to send the reply to
+    sockaddr_in m_receiver;
+    /// The looper state (see State)
+    int32_t m_state = 0;
+    /// The number of active dubs
+    int32_t m_nrOfDubs = 0;
+    /// The number of dubs which could be redone
+    int32_t m_maxUsedDubs = 0;
+    /// The loop length in samples
+    int32_t m_loopLength = 0;
+    /// The current position in the loop in samples
+    int32_t m_loopIndex = 0;
+    /// The number of samples of storage used
+    int32_t m_usedSamples = 0;
+};
+
+///
+/// Receive OSC messages on a UDP port bound to localhost. A separate thread
+/// listens to the socket, so the audio thread only needs to poll the command
+/// queue once per run call. Replies are sent by the same thread.
+///
+/// Understood addresses are /loopor/record, /loopor/dub, /loopor/undo, /loopor/redo,
+/// /loopor/reset, /loopor/bounce, /loopor/multiply, /loopor/branch, /loopor/delete,
+/// /loopor/replace, /loopor/snapshot, /loopor/restore, /loopor/release and /loopor/query.
+/// Only a first integer argument is used, other arguments are ignored. Each command
+/// is answered with /loopor/state ,iiiiii carrying the fields of OscReply.
+///
+class OscServer
+{
+public:
+    /// Destructor
+    ~OscServer()
+    {
+        stop();
+    }
+
+    /// Open the socket and start the listener thread.
+    /// \return false if the port could not be opened.
+    bool start(uint16_t port)
+    {
+        m_socket = socket(AF_INET, SOCK_DGRAM, 0);
+        if (m_socket < 0)
+            return false;
+
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(m_socket, (const sockaddr*)&address, sizeof(address)) < 0)
+        {
+            close(m_socket);
+            m_socket = -1;
+            return false;
+        }
+
+        m_running = true;
+        m_thread = std::thread([this]() { listen(); });
+        return true;
+    }
+
+    /// Stop the listener thread and close the socket.
+    void stop()
+    {
+        if (!m_running)
+            return;
+        m_running = false;
+        m_thread.join();
+        close(m_socket);
+        m_socket = -1;
+    }
+
+    /// Get the next command, if there is any. To be called from the audio thread.
+    bool popCommand(OscCommand& command)
+    {
+        return m_commands.pop(command);
+    }
+
+    /// Queue a reply to be sent by the listener thread. To be called from the
+    /// audio thread.
+    void pushReply(const OscReply& reply)
+    {
+        m_replies.push(reply);
+    }
+
+private:
+    /// The socket we receive from and send to
+    int m_socket = -1;
+    /// Is the listener thread supposed to run?
+    std::atomic<bool> m_running{false};
+    /// The listener thread
+    std::thread m_thread;
+    /// Commands from the listener thread to the audio thread
+    SpscQueue<OscCommand, OSC_QUEUE_SIZE> m_commands;
+    /// Replies from the audio thread to the listener thread
+    SpscQueue<OscReply, OSC_QUEUE_SIZE> m_replies;
+
+    /// The body of the listener thread.
+    void listen()
+    {
+        while (m_running)
+        {
+            // Wake up regularly to send replies and check if we should stop.
+            pollfd fd;
+            fd.fd = m_socket;
+            fd.events = POLLIN;
+            if (poll(&fd, 1, 5) > 0)
+                receive();
+
+            OscReply reply;
+            while (m_replies.pop(reply))
+                send(reply);
+        }
+    }
+
+    /// Receive one packet and queue the command it contains.
+    void receive()
+    {
+        char buffer[512];
+        OscCommand command;
+        socklen_t senderLength = sizeof(command.m_sender);
+        ssize_t length = recvfrom(m_socket, buffer, sizeof(buffer) - 1, 0,
+            (sockaddr*)&command.m_sender, &senderLength);
+        if (length <= 0)
+            return;
+        // The address is a zero terminated string at the start of the packet.
+        buffer[length] = 0;
+
+        static const struct { const char* address; OscCommandType type; } addresses[] =
+        {
+            { "/loopor/record", OSC_COMMAND_RECORD },
+            { "/loopor/dub", OSC_COMMAND_DUB },
+            { "/loopor/undo", OSC_COMMAND_UNDO },
+            { "/loopor/redo", OSC_COMMAND_REDO },
+            { "/loopor/reset", OSC_COMMAND_RESET },
+            { "/loopor/bounce", OSC_COMMAND_BOUNCE },
+            { "/loopor/multiply", OSC_COMMAND_MULTIPLY },
+            { "/loopor/branch", OSC_COMMAND_BRANCH },
+            { "/loopor/delete", OSC_COMMAND_DELETE },
+            { "/loopor/replace", OSC_COMMAND_REPLACE },
+            { "/loopor/snapshot", OSC_COMMAND_SNAPSHOT },
+            { "/loopor/restore", OSC_COMMAND_RESTORE },
+            { "/loopor/release", OSC_COMMAND_RELEASE },
+            { "/loopor/query", OSC_COMMAND_QUERY },
+        };
+        // The type tags follow the address, both are zero padded to a multiple of four bytes.
+        size_t tags = (strlen(buffer) + 4) & ~size_t(3);
+        if (tags < size_t(length) && buffer[tags] == ',' && buffer[tags + 1] == 'i')
+        {
+            size_t argument = tags + ((strlen(&buffer[tags]) + 4) & ~size_t(3));
+            if (argument + sizeof(uint32_t) <= size_t(length))
+            {
+                // OSC integers are big endian
+                uint32_t bigEndian;
+                memcpy(&bigEndian, &buffer[argument], sizeof(bigEndian));
+                command.m_argument = int32_t(ntohl(bigEndian));
+            }
+        }
+        for (const auto& entry : addresses)
+        {
+            if (strcmp(buffer, entry.address) == 0)
+            {
+                command.m_type = entry.type;
+                m_commands.push(command);
+                return;
+            }
+        }
+    }
+
+    /// Encode and send a reply.
+    void send(const OscReply& reply)
+    {
+        // Address and type tags, both zero padded to a multiple of four bytes.
+        static const char header[] = "/loopor/state\0\0\0,iiiiii\0";
+        char buffer[sizeof(header) - 1 + 6 * sizeof(int32_t)];
+        memcpy(buffer, header, sizeof(header) - 1);
+
+        int32_t values[6] = { reply.m_state, reply.m_nrOfDubs, reply.m_maxUsedDubs,
+            reply.m_loopLength, reply.m_loopIndex, reply.m_usedSamples };
+        char* argument = buffer + sizeof(header) - 1;
+        for (int32_t value : values)
+        {
+            // OSC integers are big endian
+            uint32_t bigEndian = htonl(uint32_t(value));
+            memcpy(argument, &bigEndian, sizeof(bigEndian));
+            argument += sizeof(bigEndian);
+        }
+        sendto(m_socket, buffer, sizeof(buffer), 0, (const sockaddr*)&reply.m_receiver,
+            sizeof(reply.m_receiver));
+    }
+};
+
+///
+/// Write single bits to a byte buffer, most significant bit first.
+///
+class BitWriter
+{
+public:
+    /// Constructor
+    /// \param data Where to write to.
+    /// \param capacity The size of the buffer in bytes.
+    BitWriter(uint8_t* data, size_t capacity)
+        : m_data(data), m_capacity(capacity)
+    {
+    }
+
+    /// Write the lowest bits of a value (at most 32).
+    void write(uint32_t value, unsigned nrOfBits)
+    {
+        m_bits = (m_bits << nrOfBits) | (value & (uint32_t(uint64_t(1) << nrOfBits) - 1));
+        m_nrOfBits += nrOfBits;
+        while (m_nrOfBits >= 8)
+        {
+            m_nrOfBits -= 8;
+            writeByte(uint8_t(m_bits >> m_nrOfBits));
+        }
+    }
+
+    /// Write any pending bits, padded with zeros to a whole byte.
+    void flush()
+    {
+        if (m_nrOfBits > 0)
+            write(0, 8 - m_nrOfBits);
+    }
+
+    /// The number of bytes written so far.
+    size_t size() const { return m_size; }
+    /// Did anything not fit into the buffer?
+    bool overflow() const { return m_overflow; }
+
+private:
+    /// The buffer
+    uint8_t* m_data = NULL;
+    /// The size of the buffer
+    size_t m_capacity = 0;
+    /// The number of bytes written
+    size_t m_size = 0;
+    /// Bits not written, yet. Only the lowest m_nrOfBits are valid.
+    uint64_t m_bits = 0;
+    /// The number of bits not written, yet
+    unsigned m_nrOfBits = 0;
+    /// Set if the buffer was too small
+    bool m_overflow = false;
+
+    /// Write a byte if it fits.
+    void writeByte(uint8_t value)
+    {
+        if (m_size >= m_capacity)
+        {
+            m_overflow = true;
+            return;
+        }
+        m_data[m_size++] = value;
+    }
+};
+
+///
+/// Read single bits from a byte buffer, most significant bit first. Reading past
+/// the end of the buffer returns zeros.
+///
+class BitReader
+{
+public:
+    /// Constructor
+    /// \param data Where to read from.
+    /// \param size The size of the buffer in bytes.
+    BitReader(const uint8_t* data, size_t size)
+        : m_data(data), m_size(size)
+    {
+    }
+
+    /// Read a value of at most 32 bits.
+    uint32_t read(unsigned nrOfBits)
+    {
+        if (nrOfBits == 0)
+            return 0;
+        refill();
+        m_nrOfBits -= nrOfBits;
+        return uint32_t(m_bits >> m_nrOfBits) & uint32_t((uint64_t(1) << nrOfBits) - 1);
+    }
+
+    /// Count the ones before the next zero (which is consumed as well). Stops after
+    /// the given maximum of ones without consuming any zero.
+    unsigned readUnary(unsigned maximum)
+    {
+        refill();
+        uint64_t window = m_bits << (64 - m_nrOfBits);
+        unsigned ones = ~window == 0 ? 64 : __builtin_clzll(~window);
+        if (ones >= maximum)
+        {
+            m_nrOfBits -= maximum;
+            return maximum;
+        }
+        m_nrOfBits -= ones + 1;
+        return ones;
+    }
+
+private:
+    /// The buffer
+    const uint8_t* m_data = NULL;
+    /// The size of the buffer
+    size_t m_size = 0;
+    /// The next byte to read
+    size_t m_position = 0;
+    /// Bits read from the buffer but not consumed, yet. Only the lowest m_nrOfBits
+    /// are valid.
+    uint64_t m_bits = 0;
+    /// The number of bits not consumed, yet
+    unsigned m_nrOfBits = 0;
+
+    /// Make sure there are at least 57 bits available.
+    void refill()
+    {
+        while (m_nrOfBits <= 56)
+        {
+            m_bits = (m_bits << 8) | (m_position < m_size ? m_data[m_position] : 0);
+            m_position++;
+            m_nrOfBits += 8;
+        }
+    }
+};
+
+///
+/// Lossless compression of stereo audio in blocks of COMPRESSION_BLOCK_SIZE samples.
+/// Audio which comes from a 24 bit source is an exact multiple of 2^-23. Such blocks
+/// are predicted from the previous two samples and the residual is Rice coded. Other
+/// blocks (e.g. processed audio) are coded the same way, but with the bits of the
+/// floats instead, mapped to integers in the same order as the floats. That saves less,
+/// as the steps between floats grow with their size. Blocks which do not get any
+/// smaller (e.g. noise) are stored as they are.
+///
+/// A block starts with its peak (float) and the mode (one byte). Rice coded blocks
+/// continue with a bit stream containing for each channel the Rice parameter (5 bits)
+/// and the residuals.
+///
+class LosslessCodec
+{
+public:
+    /// Encode a block.
+    /// \param input1 The first channel.
+    /// \param input2 The second channel.
+    /// \param length The number of samples, at most COMPRESSION_BLOCK_SIZE.
+    /// \param output Where to write the block to.
+    /// \param capacity The number of bytes available at output.
+    /// \return The number of bytes written or 0 if the block did not fit.
+    static size_t encodeBlock(const float* input1, const float* input2, size_t length, uint8_t* output,
+        size_t capacity)
+    {
+        if (capacity < HEADER_SIZE)
+            return 0;
+        float peak = 0.0f;
+        for (size_t s = 0; s < length; s++)
+            peak = fmaxf(peak, fmaxf(fabsf(input1[s]), fabsf(input2[s])));
+        memcpy(output, &peak, sizeof(peak));
+
+        uint32_t values1[COMPRESSION_BLOCK_SIZE];
+        uint32_t values2[COMPRESSION_BLOCK_SIZE];
+        output[4] = MODE_RICE;
+        if (!toIntegers(input1, length, values1) || !toIntegers(input2, length, values2))
+        {
+            output[4] = MODE_FLOAT;
+            toOrderedBits(input1, length, values1);
+            toOrderedBits(input2, length, values2);
+        }
+
+        // A coded block must be smaller than the raw one.
+        size_t rawSize = HEADER_SIZE + 2 * length * sizeof(float);
+        BitWriter writer(&output[HEADER_SIZE], (capacity < rawSize ? capacity : rawSize) - HEADER_SIZE);
+        encodeChannel(values1, length, writer);
+        encodeChannel(values2, length, writer);
+        writer.flush();
+        if (!writer.overflow())
+            return HEADER_SIZE + writer.size();
+
+        if (capacity < rawSize)
+            return 0;
+        output[4] = MODE_RAW;
+        memcpy(&output[HEADER_SIZE], input1, length * sizeof(float));
+        memcpy(&output[HEADER_SIZE + length * sizeof(float)], input2, length * sizeof(float));
+        return rawSize;
+    }
+
+    /// Decode a block.
+    /// \param input The encoded block.
+    /// \param size The number of bytes of the encoded block.
+    /// \param length The number of samples in the block.
+    /// \param output1 Where to write the first channel to.
+    /// \param output2 Where to write the second channel to.
+    static void decodeBlock(const uint8_t* input, size_t size, size_t length, float* output1, float* output2)
+    {
+        if (input[4] == MODE_RAW)
+        {
+            memcpy(output1, &input[HEADER_SIZE], length * sizeof(float));
+            memcpy(output2, &input[HEADER_SIZE + length * sizeof(float)], length * sizeof(float));
+            return;
+        }
+
+        BitReader reader(&input[HEADER_SIZE], size - HEADER_SIZE);
+        decodeChannel(reader, length, input[4] == MODE_FLOAT, output1);
+        decodeChannel(reader, length, input[4] == MODE_FLOAT, output2);
+    }
+
+    /// Get the peak of both channels of an encoded block.
+    static float peak(const uint8_t* input)
+    {
+        float peak;
+        memcpy(&peak, input, sizeof(peak));
+        return peak;
+    }
+
+private:
+    /// The size of the block header (peak and mode)
+    static const size_t HEADER_SIZE = 5;
+    /// Mode of a block stored as floats
+    static const uint8_t MODE_RAW = 0;
+    /// Mode of a block stored as Rice coded residuals
+    static const uint8_t MODE_RICE = 1;
+    /// Mode of a block stored as Rice coded residuals of the bits of the floats
+    static const uint8_t MODE_FLOAT = 2;
+    /// Residuals with this many ones in their unary part are stored with 32 bits instead
+    static const unsigned ESCAPE = 32;
+    /// Scale of a 24 bit sample
+    static constexpr float SCALE = 8388608.0f;
+
+    /// Convert to integers if this can be done without any loss.
+    static bool toIntegers(const float* input, size_t length, uint32_t* output)
+    {
+        for (size_t s = 0; s < length; s++)
+        {
+            float scaled = input[s] * SCALE;
+            if (!(fabsf(scaled) <= SCALE * 2.0f))
+                return false;
+            int32_t value = int32_t(scaled);
+            // Compare the bits, so also -0 is detected.
+            float restored = float(value) * (1.0f / SCALE);
+            if (memcmp(&restored, &input[s], sizeof(float)) != 0)
+                return false;
+            output[s] = uint32_t(value);
+        }
+        return true;
+    }
+
+    /// Convert the bits of floats to integers which are ordered like the floats, so
+    /// floats close to each other (also around 0) get integers close to each other.
+    static void toOrderedBits(const float* input, size_t length, uint32_t* output)
+    {
+        for (size_t s = 0; s < length; s++)
+        {
+            uint32_t bits;
+            memcpy(&bits, &input[s], sizeof(bits));
+            output[s] = (bits & 0x80000000u) != 0 ? ~bits : bits | 0x80000000u;
+        }
+    }
+
+    /// Convert an integer made by toOrderedBits back to the float.
+    static float fromOrderedBits(uint32_t value)
+    {
+        uint32_t bits = (value & 0x80000000u) != 0 ? value & 0x7fffffffu : ~value;
+        float sample;
+        memcpy(&sample, &bits, sizeof(sample));
+        return sample;
+    }
+
+    /// The prediction for a sample given the values before it. The values wrap around,
+    /// the decoder does the same, so nothing is lost.
+    static uint32_t predict(const uint32_t* values, size_t s)
+    {
+        if (s == 0)
+            return 0;
+        if (s == 1)
+            return values[0];
+        return 2 * values[s - 1] - values[s - 2];
+    }
+
+    /// Encode the residuals of one channel.
+    static void encodeChannel(const uint32_t* values, size_t length, BitWriter& writer)
+    {
+        uint32_t residuals[COMPRESSION_BLOCK_SIZE];
+        for (size_t s = 0; s < length; s++)
+        {
+            int32_t residual = int32_t(values[s] - predict(values, s));
+            // Interleave positive and negative values: 0, -1, 1, -2, 2...
+            residuals[s] = (uint32_t(residual) << 1) ^ uint32_t(residual >> 31);
+        }
+
+        // Take the Rice parameter which needs the fewest bits. A few large residuals, e.g.
+        // where floats cross 0, would make an estimate from the mean too large.
+        unsigned k = 0;
+        uint64_t fewestBits = UINT64_MAX;
+        for (unsigned candidate = 0; candidate < 32; candidate++)
+        {
+            uint64_t bits = 0;
+            for (size_t s = 0; s < length; s++)
+            {
+                uint32_t quotient = residuals[s] >> candidate;
+                bits += quotient >= ESCAPE ? ESCAPE + 32 : quotient + 1 + candidate;
+            }
+            if (bits < fewestBits)
+            {
+                fewestBits = bits;
+                k = candidate;
+            }
+        }
+        writer.write(k, 5);
+
+        for (size_t s = 0; s < length; s++)
+        {
+            uint32_t quotient = residuals[s] >> k;
+            if (quotient >= ESCAPE)
+            {
+                writer.write(0xffffffff, ESCAPE);
+                writer.write(residuals[s], 32);
+                continue;
+            }
+            // Ones followed by a zero, then the remainder.
+            writer.write(((uint32_t(1) << quotient) - 1) << 1, quotient + 1);
+            writer.write(residuals[s], k);
+        }
+    }
+
+    /// Decode the residuals of one channel and undo the prediction.
+    /// \param floatBits Are the values the bits of the floats, see toOrderedBits?
+    static void decodeChannel(BitReader& reader, size_t length, bool floatBits, float* output)
+    {
+        uint32_t values[COMPRESSION_BLOCK_SIZE];
+        unsigned k = reader.read(5);
+        for (size_t s = 0; s < length; s++)
+        {
+            unsigned quotient = reader.readUnary(ESCAPE);
+            uint32_t residual = quotient == ESCAPE ? reader.read(32) : (quotient << k) | reader.read(k);
+            values[s] = (residual >> 1) ^ (0u - (residual & 1));
+            values[s] += predict(values, s);
+            output[s] = floatBits ? fromOrderedBits(values[s]) : float(int32_t(values[s])) * (1.0f / SCALE);
+        }
+    }
+};
+
+///
+/// A file for the audio of the oldest dubs, so they do not need any memory. The audio
+/// thread cannot wait for the file, so a reader thread mixes the dubs on file into a
+/// ring of blocks ahead of the play position. The blocks are counted over all passes
+/// of the loop, so blocks at the end and the start of the loop can be in the ring at the
+/// same time. Each block is tagged with this count and the dubs mixed into it, so the
+/// audio thread knows if it can use it.
+/// The audio of a segment is stored as the first channel followed by the second one.
+///
+class TieringFile
+{
+public:
+    ///
+    /// A command sent from the audio thread to the reader thread
+    ///
+    struct Command
+    {
+        /// Add a dub (or replace the one with the same index) instead of setting the state?
+        bool m_addDub = false;
+        /// The index of the dub to add
+        size_t m_dubIndex = 0;
+        /// The dub to add
+        Dub m_dub;
+        /// Changes whenever dubs on file are replaced by other ones
+        uint32_t m_generation = 0;
+        /// The number of dubs to mix, from the first one on
+        size_t m_nrOfDubs = 0;
+        /// The length of the loop
+        size_t m_loopLength = 0;
+        /// The gain of the first channel of each dub to mix
+        float m_gains1[NR_OF_DUBS] = {};
+        /// The gain of the second channel of each dub to mix
+        float m_gains2[NR_OF_DUBS] = {};
+        /// The gain of the first channel of each dub in the scene switched to at the next
+        /// start of the loop, the same as m_gains1 if the scene stays
+        float m_nextGains1[NR_OF_DUBS] = {};
+        /// The gain of the second channel of each dub in the next scene
+        float m_nextGains2[NR_OF_DUBS] = {};
+        /// The first block played with the next gains, counted like in streamBlock
+        uint64_t m_switchBlock = 0;
+        /// The number of samples faded at the edges of each segment
+        size_t m_fadeLength = NR_OF_BLEND_SAMPLES;
+        /// The shape of the fades
+        FadeShape m_fadeShape = FADE_LINEAR;
+    };
+
+    /// Destructor
+    ~TieringFile()
+    {
+        close();
+    }
+
+    /// Create the file and start the reader thread. The file is removed from the
+    /// directory right away, so it is gone with the process.
+    /// \param directory Where to create the file.
+    /// \return false if the file could not be created.
+    bool open(const char* directory)
+    {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/loopor-XXXXXX", directory);
+        m_fd = mkstemp(path);
+        if (m_fd < 0)
+            return false;
+        unlink(path);
+
+        m_ring1 = new float[NR_OF_TRACKS * RING_BLOCKS * TIERING_BLOCK_SIZE];
+        m_ring2 = new float[NR_OF_TRACKS * RING_BLOCKS * TIERING_BLOCK_SIZE];
+        for (size_t b = 0; b < RING_BLOCKS; b++)
+            m_tags[b].store(0);
+        m_running = true;
+        m_thread = std::thread([this]() { work(); });
+        return true;
+    }
+
+    /// Stop the reader thread and close the file.
+    void close()
+    {
+        if (m_running)
+        {
+            m_running = false;
+            m_thread.join();
+        }
+        if (m_fd >= 0)
+            ::close(m_fd);
+        m_fd = -1;
+        delete[] m_ring1;
+        delete[] m_ring2;
+        m_ring1 = NULL;
+        m_ring2 = NULL;
+    }
+
+    /// The file descriptor, -1 if the file is not open.
+    int fd() const
+    {
+        return m_fd;
+    }
+
+    /// Queue a command. To be called from the audio thread.
+    bool pushCommand(const Command& command)
+    {
+        return m_commands.push(command);
+    }
+
+    /// Tell the reader thread where the loop is played. To be called from the audio thread.
+    /// \param loopCounter The number of passes of the loop so far.
+    /// \param loopIndex The position in the loop.
+    /// \param loopLength The length of the loop.
+    /// \param nrOfSamples The number of samples played before the position is set again.
+    /// \param reverse Is the loop played backwards? The passes are counted down then.
+    void setPosition(size_t loopCounter, size_t loopIndex, size_t loopLength, size_t nrOfSamples, bool reverse)
+    {
+        // Only the lower bits of the counter are passed on, the blocks are counted with them.
+        loopCounter = uint32_t(loopCounter);
+        m_position.store((uint64_t(loopCounter) << 32) | uint32_t(loopIndex), std::memory_order_relaxed);
+        m_reverse.store(reverse, std::memory_order_relaxed);
+        size_t endIndex = loopIndex + nrOfSamples;
+        if (reverse)
+        {
+            endIndex = loopIndex - nrOfSamples;
+            if (loopIndex < nrOfSamples)
+            {
+                endIndex += loopLength;
+                loopCounter--;
+            }
+        }
+        else if (loopLength > 0 && endIndex >= loopLength)
+        {
+            endIndex -= loopLength;
+            loopCounter++;
+        }
+        m_playedBlock.store(streamBlock(loopCounter, endIndex, loopLength), std::memory_order_relaxed);
+    }
+
+    /// Count the blocks over all passes of the loop.
+    /// \param loopCounter The number of passes of the loop so far.
+    /// \param loopIndex The position in the loop.
+    /// \param loopLength The length of the loop.
+    static uint64_t streamBlock(uint64_t loopCounter, size_t loopIndex, size_t loopLength)
+    {
+        return loopCounter * (loopLength / TIERING_BLOCK_SIZE + 1) + loopIndex / TIERING_BLOCK_SIZE;
+    }
+
+    /// Identify which dubs are mixed.
+    /// \param generation The generation of the dubs.
+    /// \param nrOfDubs The number of dubs mixed, from the first one on.
+    static uint64_t dubsTag(uint32_t generation, size_t nrOfDubs)
+    {
+        return (uint64_t(generation & 0xffffff) << 8) | nrOfDubs;
+    }
+
+    /// Which dubs did the reader thread mix ahead of the play position in its last pass?
+    /// \return The tag as created by dubsTag.
+    uint64_t ready() const
+    {
+        return m_ready.load(std::memory_order_acquire);
+    }
+
+    /// Add the mix of the dubs on file to the output, if the reader thread was fast enough.
+    /// To be called from the audio thread.
+    /// \param loopCounter The number of passes of the loop so far.
+    /// \param loopIndex The first sample in the loop.
+    /// \param loopLength The length of the loop.
+    /// \param length The number of samples. They must not cross a block boundary.
+    /// \param generation The generation of the dubs.
+    /// \param maxNrOfDubs Blocks with more dubs mixed into them are not used.
+    /// \param buses Where to add the dubs of each track to.
+    /// \param offset The first sample in the buses.
+    /// \return The number of dubs which were added, from the first one on.
+    size_t mix(size_t loopCounter, size_t loopIndex, size_t loopLength, size_t length, uint32_t generation,
+        size_t maxNrOfDubs, const TrackBuses& buses, uint32_t offset)
+    {
+        uint64_t block = streamBlock(loopCounter, loopIndex, loopLength);
+        size_t slot = block % RING_BLOCKS;
+        uint64_t tag = m_tags[slot].load(std::memory_order_acquire);
+        size_t nrOfDubs = tag & 0xff;
+        if (tag >> 32 != uint32_t(block + 1) || (tag & 0xffffffff) != dubsTag(generation, nrOfDubs) ||
+            nrOfDubs > maxNrOfDubs)
+            return 0;
+
+        // Copy the samples first, the block might be refilled meanwhile.
+        float samples1[NR_OF_TRACKS][TIERING_BLOCK_SIZE];
+        float samples2[NR_OF_TRACKS][TIERING_BLOCK_SIZE];
+        for (size_t k = 0; k < NR_OF_TRACKS; k++)
+        {
+            size_t index = (k * RING_BLOCKS + slot) * TIERING_BLOCK_SIZE + loopIndex % TIERING_BLOCK_SIZE;
+            memcpy(samples1[k], &m_ring1[index], length * sizeof(float));
+            memcpy(samples2[k], &m_ring2[index], length * sizeof(float));
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_tags[slot].load(std::memory_order_relaxed) != tag)
+            return 0;
+
+        for (size_t k = 0; k < NR_OF_TRACKS; k++)
+        {
+            float* output1 = buses.m_outputs1[k] + offset;
+            float* output2 = buses.m_outputs2[k] + offset;
+            for (size_t s = 0; s < length; s++)
+            {
+                output1[s] += samples1[k][s];
+                output2[s] += samples2[k][s];
+            }
+        }
+        return nrOfDubs;
+    }
+
+    /// Write a buffer to the file.
+    /// \return false on error.
+    static bool writeAll(int fd, const void* data, size_t size, size_t offset)
+    {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        while (size > 0)
+        {
+            ssize_t written = pwrite(fd, bytes, size, off_t(offset));
+            if (written <= 0)
+                return false;
+            bytes += written;
+            offset += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    /// Read a buffer from the file.
+    /// \return false on error.
+    static bool readAll(int fd, void* data, size_t size, size_t offset)
+    {
+        uint8_t* bytes = static_cast<uint8_t*>(data);
+        while (size > 0)
+        {
+            ssize_t read = pread(fd, bytes, size, off_t(offset));
+            if (read <= 0)
+                return false;
+            bytes += read;
+            offset += read;
+            size -= read;
+        }
+        return true;
+    }
+
+private:
+    /// The number of blocks in the ring, twice as many as are read ahead
+    static const size_t RING_BLOCKS = 2 * TIERING_PREFETCH_SAMPLES / TIERING_BLOCK_SIZE;
+    static_assert(NR_OF_DUBS < 256, "The number of dubs must fit into the lowest byte of a tag");
+
+    /// The file
+    int m_fd = -1;
+    /// The mixed first channel of each block in the ring, the ring of each track after
+    /// the one of the track before
+    float* m_ring1 = NULL;
+    /// The mixed second channel of each block in the ring
+    float* m_ring2 = NULL;
+    /// The counted block (plus one) and the dubs tag of each block in the ring, 0 if empty
+    std::atomic<uint64_t> m_tags[RING_BLOCKS];
+    /// The number of passes of the loop and the play position in the loop
+    std::atomic<uint64_t> m_position{0};
+    /// Is the loop played backwards?
+    std::atomic<bool> m_reverse{false};
+    /// The last block which may be played until the position is set again
+    std::atomic<uint64_t> m_playedBlock{0};
+    /// The dubs mixed ahead of the play position
+    std::atomic<uint64_t> m_ready{0};
+    /// Is the thread supposed to run?
+    std::atomic<bool> m_running{false};
+    /// The reader thread
+    std::thread m_thread;
+    /// Commands from the audio thread
+    SpscQueue<Command, 16> m_commands;
+
+    // Only used by the reader thread
+
+    /// The dubs on file
+    Dub m_dubs[NR_OF_DUBS];
+    /// The generation of the dubs
+    uint32_t m_generation = 0;
+    /// The number of dubs to mix
+    size_t m_nrOfDubs = 0;
+    /// The length of the loop
+    size_t m_loopLength = 0;
+    /// The gain of the first channel of each dub
+    float m_gains1[NR_OF_DUBS] = {};
+    /// The gain of the second channel of each dub
+    float m_gains2[NR_OF_DUBS] = {};
+    /// The gain of the first channel of each dub in the blocks ahead
+    float m_mixedGains1[NR_OF_DUBS] = {};
+    /// The gain of the second channel of each dub in the blocks ahead
+    float m_mixedGains2[NR_OF_DUBS] = {};
+    /// The gain of the first channel of each dub from the switch block on
+    float m_nextGains1[NR_OF_DUBS] = {};
+    /// The gain of the second channel of each dub from the switch block on
+    float m_nextGains2[NR_OF_DUBS] = {};
+    /// The gain of the first channel of each dub from the switch block on in the blocks ahead
+    float m_mixedNextGains1[NR_OF_DUBS] = {};
+    /// The gain of the second channel of each dub from the switch block on in the blocks ahead
+    float m_mixedNextGains2[NR_OF_DUBS] = {};
+    /// The first block played with the next gains, counted like in streamBlock
+    uint64_t m_switchBlock = 0;
+    /// The switch block of the blocks ahead
+    uint64_t m_mixedSwitchBlock = 0;
+    /// The number of samples faded at the edges of each segment
+    size_t m_fadeLength = NR_OF_BLEND_SAMPLES;
+    /// The shape of the fades
+    FadeShape m_fadeShape = FADE_LINEAR;
+    /// Have the gains or the fades changed, so the blocks ahead have to be mixed again?
+    bool m_remix = false;
+    /// The first channel of the block being mixed for each track
+    float m_block1[NR_OF_TRACKS][TIERING_BLOCK_SIZE];
+    /// The second channel of the block being mixed for each track
+    float m_block2[NR_OF_TRACKS][TIERING_BLOCK_SIZE];
+
+    /// The body of the reader thread.
+    void work()
+    {
+        while (m_running)
+        {
+            Command command;
+            while (m_commands.pop(command))
+            {
+                if (command.m_addDub)
+                {
+                    m_dubs[command.m_dubIndex] = command.m_dub;
+                    continue;
+                }
+                for (size_t t = 0; t < command.m_nrOfDubs; t++)
+                {
+                    if (t >= m_nrOfDubs)
+                    {
+                        // Dubs which are not mixed yet start right away with their gains.
+                        m_mixedGains1[t] = command.m_gains1[t];
+                        m_mixedGains2[t] = command.m_gains2[t];
+                        m_mixedNextGains1[t] = command.m_nextGains1[t];
+                        m_mixedNextGains2[t] = command.m_nextGains2[t];
+                    }
+                    else if (m_gains1[t] != command.m_gains1[t] || m_gains2[t] != command.m_gains2[t] ||
+                        m_nextGains1[t] != command.m_nextGains1[t] || m_nextGains2[t] != command.m_nextGains2[t])
+                        m_remix = true;
+                    m_gains1[t] = command.m_gains1[t];
+                    m_gains2[t] = command.m_gains2[t];
+                    m_nextGains1[t] = command.m_nextGains1[t];
+                    m_nextGains2[t] = command.m_nextGains2[t];
+                }
+                if (m_switchBlock != command.m_switchBlock)
+                    m_remix = true;
+                m_switchBlock = command.m_switchBlock;
+                if (m_fadeLength != command.m_fadeLength || m_fadeShape != command.m_fadeShape)
+                    m_remix = true;
+                m_fadeLength = command.m_fadeLength;
+                m_fadeShape = command.m_fadeShape;
+                m_generation = command.m_generation;
+                m_nrOfDubs = command.m_nrOfDubs;
+                m_loopLength = command.m_loopLength;
+            }
+
+            if (m_nrOfDubs == 0 || prefetch())
+                m_ready.store(dubsTag(m_generation, m_nrOfDubs), std::memory_order_release);
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
+
+    /// Make sure the blocks ahead of the play position contain the current dubs. After the
+    /// gains changed, the blocks not played yet are mixed again without being marked as
+    /// empty, so they keep playing with the old gains until they are replaced. The first
+    /// block replaced ramps from the old to the new gains. When the loop is played
+    /// backwards, the blocks before the play position are the ones ahead. The blocks from
+    /// the switch block on are mixed with the gains of the next scene already, the switch
+    /// block ramps to them.
+    /// \return false if the file could not be read.
+    bool prefetch()
+    {
+        size_t nrOfBlocks = m_loopLength / TIERING_BLOCK_SIZE + 1;
+        size_t count = TIERING_PREFETCH_SAMPLES / TIERING_BLOCK_SIZE;
+        if (count > nrOfBlocks)
+            count = nrOfBlocks;
+        uint64_t position = m_position.load(std::memory_order_relaxed);
+        bool reverse = m_reverse.load(std::memory_order_relaxed);
+        size_t loopCounter = position >> 32;
+        size_t block = (position & 0xffffffff) / TIERING_BLOCK_SIZE;
+        uint64_t first = streamBlock(loopCounter, position & 0xffffffff, m_loopLength);
+        // The number of blocks ahead which may be played by now.
+        int64_t played = int64_t(reverse ? first - playedBlock() : playedBlock() - first);
+        uint64_t dubs = dubsTag(m_generation, m_nrOfDubs);
+        bool ramp = m_remix;
+        for (size_t b = 0; b < count; b++, nextBlock(loopCounter, block, nrOfBlocks, reverse))
+        {
+            uint64_t counted = uint64_t(loopCounter) * nrOfBlocks + block;
+            size_t slot = counted % RING_BLOCKS;
+            uint64_t tag = (uint64_t(uint32_t(counted + 1)) << 32) | dubs;
+            bool remix = m_tags[slot].load(std::memory_order_relaxed) == tag;
+            if (remix && (!m_remix || int64_t(b) <= played))
+                continue;
+            bool next = reverse ? counted <= m_switchBlock : counted >= m_switchBlock;
+            const float* to1 = next ? m_nextGains1 : m_gains1;
+            const float* to2 = next ? m_nextGains2 : m_gains2;
+            const float* from1 = to1;
+            const float* from2 = to2;
+            if (ramp)
+            {
+                bool mixedNext = reverse ? counted <= m_mixedSwitchBlock : counted >= m_mixedSwitchBlock;
+                from1 = mixedNext ? m_mixedNextGains1 : m_mixedGains1;
+                from2 = mixedNext ? m_mixedNextGains2 : m_mixedGains2;
+            }
+            else if (counted == m_switchBlock)
+            {
+                from1 = m_gains1;
+                from2 = m_gains2;
+            }
+            if (!fillBlock(block, from1, from2, to1, to2, reverse))
+                return false;
+            if (remix && int64_t(b) <= played)
+                // The block is played already, so it keeps the old gains.
+                continue;
+
+            // Mark the block as empty while it is copied.
+            m_tags[slot].store(0, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            for (size_t k = 0; k < NR_OF_TRACKS; k++)
+            {
+                memcpy(&m_ring1[(k * RING_BLOCKS + slot) * TIERING_BLOCK_SIZE], m_block1[k], sizeof(m_block1[k]));
+                memcpy(&m_ring2[(k * RING_BLOCKS + slot) * TIERING_BLOCK_SIZE], m_block2[k], sizeof(m_block2[k]));
+            }
+            m_tags[slot].store(tag, std::memory_order_release);
+            if (block * TIERING_BLOCK_SIZE < m_loopLength)
+                ramp = false;
+        }
+        m_remix = false;
+        memcpy(m_mixedGains1, m_gains1, sizeof(m_gains1));
+        memcpy(m_mixedGains2, m_gains2, sizeof(m_gains2));
+        memcpy(m_mixedNextGains1, m_nextGains1, sizeof(m_nextGains1));
+        memcpy(m_mixedNextGains2, m_nextGains2, sizeof(m_nextGains2));
+        m_mixedSwitchBlock = m_switchBlock;
+        return true;
+    }
+
+    /// The last block which may be played by now, counted over all passes of the loop.
+    uint64_t playedBlock() const
+    {
+        return m_playedBlock.load(std::memory_order_relaxed);
+    }
+
+    /// Move on to the next block in the direction the loop is played.
+    /// \param loopCounter The pass of the loop, counted down when played backwards.
+    /// \param block The block in the loop.
+    /// \param nrOfBlocks The number of blocks in the loop.
+    /// \param reverse Is the loop played backwards?
+    static void nextBlock(size_t& loopCounter, size_t& block, size_t nrOfBlocks, bool reverse)
+    {
+        if (!reverse && ++block == nrOfBlocks)
+        {
+            block = 0;
+            loopCounter++;
+        }
+        else if (reverse && block-- == 0)
+        {
+            block = nrOfBlocks - 1;
+            loopCounter--;
+        }
+    }
+
+    /// Mix the dubs of a block with their gains, each into the block of its track.
+    /// \param block The block in the loop.
+    /// \param from1 The gain of the first channel of each dub where the block is played first.
+    /// \param from2 The gain of the second channel of each dub there.
+    /// \param to1 The gain of the first channel of each dub the block ramps to.
+    /// \param to2 The gain of the second channel of each dub the block ramps to.
+    /// \param reverse Is the block played backwards, so the ramp goes from its end to its start?
+    /// \return false if the file could not be read.
+    bool fillBlock(size_t block, const float* from1, const float* from2, const float* to1, const float* to2,
+        bool reverse)
+    {
+        memset(m_block1, 0, sizeof(m_block1));
+        memset(m_block2, 0, sizeof(m_block2));
+
+        size_t blockStart = block * TIERING_BLOCK_SIZE;
+        size_t blockEnd = blockStart + TIERING_BLOCK_SIZE;
+        for (size_t t = 0; t < m_nrOfDubs; t++)
+        {
+            const Dub& dub = m_dubs[t];
+            float gain1 = from1[t];
+            float gain2 = from2[t];
+            float step1 = (to1[t] - gain1) / TIERING_BLOCK_SIZE;
+            float step2 = (to2[t] - gain2) / TIERING_BLOCK_SIZE;
+            if (reverse)
+            {
+                gain1 = to1[t];
+                gain2 = to2[t];
+                step1 = -step1;
+                step2 = -step2;
+            }
+            if (gain1 == 0.0f && gain2 == 0.0f && step1 == 0.0f && step2 == 0.0f)
+                continue;
+
+            // A dub recorded before the loop was multiplied repeats within it.
+            size_t position = blockStart;
+            while (position < blockEnd)
+            {
+                size_t index = position % dub.m_period;
+                size_t count = blockEnd - position < dub.m_period - index ? blockEnd - position : dub.m_period - index;
+                if (!addDub(dub, index, index + count, position - blockStart, gain1, gain2, step1, step2))
+                    return false;
+                // The end of a dub recorded across the end of the loop plays at the start.
+                if (dub.m_startIndex + dub.m_length > dub.m_period &&
+                    !addDub(dub, index + dub.m_period, index + dub.m_period + count, position - blockStart, gain1, gain2,
+                        step1, step2))
+                    return false;
+                position += count;
+            }
+        }
+        return true;
+    }
+
+    /// Add a part of a dub to the block being mixed for its track.
+    /// \param dub The dub.
+    /// \param start The first sample within the period of the dub, plus the period for the
+    /// part of a dub which continued at the start of the loop.
+    /// \param end The sample after the last one.
+    /// \param blockOffset Where the first sample goes in the block.
+    /// \param gain1 The gain of the first channel at the start of the block.
+    /// \param gain2 The gain of the second channel at the start of the block.
+    /// \param step1 The change of the gain of the first channel per sample.
+    /// \param step2 The change of the gain of the second channel per sample.
+    /// \return false if the file could not be read.
+    bool addDub(const Dub& dub, size_t start, size_t end, size_t blockOffset, float gain1, float gain2, float step1,
+        float step2)
+    {
+        float samples1[TIERING_BLOCK_SIZE];
+        float samples2[TIERING_BLOCK_SIZE];
+        for (size_t g = 0; g < dub.m_nrOfSegments; g++)
+        {
+            const Segment& segment = dub.m_segments[g];
+            size_t segmentStart = dub.m_startIndex + segment.m_loopOffset;
+            size_t from = segmentStart > start ? segmentStart : start;
+            size_t to = segmentStart + segment.m_length < end ? segmentStart + segment.m_length : end;
+            if (from >= to)
+                continue;
+
+            size_t index = from - segmentStart;
+            size_t count = to - from;
+            if (!readAll(m_fd, samples1, count * sizeof(float), segment.m_fileOffset + index * sizeof(float)) ||
+                !readAll(m_fd, samples2, count * sizeof(float),
+                    segment.m_fileOffset + (segment.m_length + index) * sizeof(float)))
+                return false;
+            EdgeFade fade = EdgeFade::forSegment(dub, g, m_fadeLength, m_fadeShape);
+            for (size_t s = 0; s < count; s++)
+            {
+                size_t position = blockOffset + (from - start) + s;
+                float factor = fade.gain(segment.m_loopOffset + index + s);
+                m_block1[dub.m_track][position] += samples1[s] * (gain1 + step1 * (position + 1)) * factor;
+                m_block2[dub.m_track][position] += samples2[s] * (gain2 + step2 * (position + 1)) * factor;
+            }
+        }
+        return true;
+    }
+};
+
+///
+/// What to do with a dub in the background
+///
+enum OffloadType
+{
+    /// Compress the dub into the compression pool
+    OFFLOAD_COMPRESS,
+    /// Write the dub to the tiering file
+    OFFLOAD_WRITE_FILE,
+    /// Move the dub down in the storage, into the space freed by deleted dubs before it
+    OFFLOAD_MOVE,
+    /// Mix the dubs of a scene into a scene bus
+    OFFLOAD_MIX_SCENE
+};
+
+///
+/// The memory for the recorded audio: the storage, its peak table and the compression
+/// pool. It is only allocated and freed outside of the audio thread, when the looper is
+/// created or by the LV2 worker.
+///
+struct StorageBuffers
+{
+    /// Storage for first channel
+    float* m_storage1 = NULL;
+    /// Storage for second channel
+    float* m_storage2 = NULL;
+    /// Peak of both channels for each PEAK_BLOCK_SIZE samples of the storage
+    float* m_peaks = NULL;
+    /// The compressed audio, if compression is enabled
+    uint8_t* m_compressionPool = NULL;
+    /// The number of samples per channel
+    size_t m_storageSize = 0;
+    /// The size of the compression pool in bytes
+    size_t m_compressionPoolSize = 0;
+    /// The number of samples per channel the memory is sized for
+    size_t m_budget = 0;
+
+    /// Allocate the memory. With compression, the pool takes COMPRESSION_POOL_RATIO of
+    /// the memory, the storage the rest.
+    /// \param budget The number of samples per channel the memory is sized for.
+    /// \return false if there is not enough memory. Nothing is allocated then.
+    bool allocate(size_t budget)
+    {
+        size_t storageSize = budget;
+        if (COMPRESSION_ENABLED)
+            storageSize = size_t(budget * (1.0 - COMPRESSION_POOL_RATIO));
+        m_budget = budget;
+        m_storageSize = storageSize;
+        m_storage1 = new (std::nothrow) float[storageSize];
+        m_storage2 = new (std::nothrow) float[storageSize];
+        m_peaks = new (std::nothrow) float[storageSize / PEAK_BLOCK_SIZE + 1]();
+        bool success = m_storage1 != NULL && m_storage2 != NULL && m_peaks != NULL;
+        if (COMPRESSION_ENABLED && success)
+        {
+            m_compressionPoolSize = (budget - storageSize) * 2 * sizeof(float);
+            m_compressionPool = new (std::nothrow) uint8_t[m_compressionPoolSize];
+            success = m_compressionPool != NULL;
+        }
+        if (!success)
+        {
+            release();
+            m_budget = budget;
+        }
+        return success;
+    }
+
+    /// Free the memory.
+    void release()
+    {
+        delete[] m_storage1;
+        delete[] m_storage2;
+        delete[] m_peaks;
+        delete[] m_compressionPool;
+        *this = StorageBuffers();
+    }
+};
+
+///
+/// The mix of the dubs of a scene, summed by the offloader thread, so switching to the
+/// scene does not mix its dubs on the audio thread. Each dub is mixed with the gains it
+/// settles at in the scene, a dub played with other gains is mixed on top with the
+/// difference. The memory is only allocated and freed by the offloader thread.
+///
+struct SceneBus
+{
+    /// The first channel of each track, NULL for the tracks without dubs in the mix
+    float* m_samples1[NR_OF_TRACKS] = {};
+    /// The second channel of each track
+    float* m_samples2[NR_OF_TRACKS] = {};
+    /// The number of samples allocated for each track
+    size_t m_capacity = 0;
+    /// The scene mixed
+    size_t m_scene = 0;
+    /// The length of the loop mixed
+    size_t m_loopLength = 0;
+    /// The number of samples faded at the edges of each segment
+    size_t m_fadeLength = NR_OF_BLEND_SAMPLES;
+    /// The shape of the fades
+    FadeShape m_fadeShape = FADE_LINEAR;
+    /// The first dub which may be mixed
+    size_t m_firstDub = 0;
+    /// The dub after the last one mixed
+    size_t m_endDub = 0;
+    /// The dubs as they were mixed
+    Dub m_dubs[NR_OF_DUBS];
+    /// The gain of the first channel of each dub, 0 for the dubs which are not mixed
+    float m_gains1[NR_OF_DUBS] = {};
+    /// The gain of the second channel of each dub
+    float m_gains2[NR_OF_DUBS] = {};
+
+    /// Is the dub part of the mix?
+    bool mixed(size_t dubIndex) const
+    {
+        return dubIndex >= m_firstDub && dubIndex < m_endDub &&
+            (m_gains1[dubIndex] != 0.0f || m_gains2[dubIndex] != 0.0f);
+    }
+
+    /// The tracks with dubs in the mix, a bit for each.
+    uint32_t tracks() const
+    {
+        uint32_t tracks = 0;
+        for (size_t t = m_firstDub; t < m_endDub; t++)
+        {
+            if (mixed(t))
+                tracks |= 1u << m_dubs[t].m_track;
+        }
+        return tracks;
+    }
+
+    /// The number of samples per channel allocated for all tracks.
+    size_t size() const
+    {
+        size_t size = 0;
+        for (size_t k = 0; k < NR_OF_TRACKS; k++)
+            size += m_samples1[k] != NULL ? m_capacity : 0;
+        return size;
+    }
+
+    /// Allocate the memory for the tracks with dubs in the mix and free the one of the
+    /// other tracks. The memory allocated before is kept if it is large enough.
+    /// \return false if there is not enough memory. Nothing is allocated then.
+    bool allocate()
+    {
+        if (m_capacity < m_loopLength)
+        {
+            release();
+            m_capacity = m_loopLength;
+        }
+        uint32_t tracks = this->tracks();
+        bool success = true;
+        for (size_t k = 0; k < NR_OF_TRACKS; k++)
+        {
+            if ((tracks & (1u << k)) == 0)
+            {
+                delete[] m_samples1[k];
+                delete[] m_samples2[k];
+                m_samples1[k] = m_samples2[k] = NULL;
+            }
+            else if (m_samples1[k] == NULL)
+            {
+                m_samples1[k] = new (std::nothrow) float[m_capacity];
+                m_samples2[k] = new (std::nothrow) float[m_capacity];
+                success = success && m_samples1[k] != NULL && m_samples2[k] != NULL;
+            }
+        }
+        if (!success)
+            release();
+        return success;
+    }
+
+    /// Free the memory.
+    void release()
+    {
+        for (size_t k = 0; k < NR_OF_TRACKS; k++)
+        {
+            delete[] m_samples1[k];
+            delete[] m_samples2[k];
+            m_samples1[k] = m_samples2[k] = NULL;
+        }
+        m_capacity = 0;
+    }
+};
+
+///
+/// The jobs done by the LV2 worker, outside of the audio thread
+///
+enum WorkerJobType
+{
+    /// Allocate storage of another size
+    WORKER_ALLOCATE_STORAGE,
+    /// Free storage which is not used anymore, there is no response
+    WORKER_FREE_STORAGE,
+    /// Mix the dubs for a bounce into the storage
+    WORKER_BOUNCE
+};
+
+///
+/// A request sent from the audio thread to the LV2 worker. The worker sends it back
+/// with the result as the response, which is applied at the start of the next run call.
+///
+struct WorkerJob
+{
+    /// What to do
+    WorkerJobType m_type = WORKER_FREE_STORAGE;
+    /// The storage to free, or the allocated one. Only its size is given for allocating it.
+    StorageBuffers m_buffers;
+};
+
+///
+/// A request to move the audio of a dub out of the storage (or within it), sent from the
+/// audio thread to the offloader thread.
+///
+struct OffloadJob
+{
+    /// What to do with the dub
+    OffloadType m_type = OFFLOAD_COMPRESS;
+    /// The index of the dub
+    size_t m_dubIndex = 0;
+    /// The id of the dub, to detect if it was replaced in the meantime
+    size_t m_dubId = 0;
+    /// Is the audio of the dub compressed already? Otherwise it is in the storage.
+    bool m_compressed = false;
+    /// The segments of the dub
+    Segment m_segments[NR_OF_SEGMENTS];
+    /// The number of segments
+    size_t m_nrOfSegments = 0;
+    /// Where to write the audio to in the pool, the file or the storage
+    size_t m_offset = 0;
+    /// The scene bus to mix, NULL to only free the released ones
+    SceneBus* m_sceneBus = NULL;
+    /// The scene buses whose memory is freed, a bit for each
+    uint32_t m_releasedBuses = 0;
+};
+
+///
+/// The result of an offload job, sent back to the audio thread.
+///
+struct OffloadResult
+{
+    /// What was done with the dub
+    OffloadType m_type = OFFLOAD_COMPRESS;
+    /// The index of the dub
+    size_t m_dubIndex = 0;
+    /// The id of the dub
+    size_t m_dubId = 0;
+    /// Did the audio fit into the pool or could it be written to the file?
+    bool m_success = false;
+    /// Where each segment's audio starts in the pool, the file or the storage
+    size_t m_offsets[NR_OF_SEGMENTS];
+    /// Where the audio of the dub ends in the pool, the file or the storage
+    size_t m_end = 0;
+};
+
+///
+/// Move the audio of dubs out of the storage in a background thread. The compressed
+/// audio of a segment starts with the number of blocks and the offset of each block
+/// (both uint32_t), followed by the blocks as encoded by LosslessCodec. Dubs are also
+/// moved down within the storage, in chunks from their start on. The audio thread plays
+/// the part moved already from where it was moved to (see seeMoved), so a chunk may also
+/// overwrite the audio of the dub itself once that part is not played from there anymore.
+/// The scene buses are mixed by the looper, in this thread.
+///
+class DubOffloader
+{
+public:
+    /// Mixes a scene bus and frees the released ones, returns false if there is not enough memory
+    typedef std::function<bool(const OffloadJob& job)> SceneMixer;
+
+    /// Destructor
+    ~DubOffloader()
+    {
+        stop();
+    }
+
+    /// Start the offloader thread.
+    /// \param storage1 The audio storage of the first channel.
+    /// \param storage2 The audio storage of the second channel.
+    /// \param pool Where to write the compressed audio to.
+    /// \param poolSize The size of the pool in bytes.
+    /// \param peaks The peak table of the storage, see Looper::updatePeaks.
+    /// \param fd The tiering file, -1 if there is none.
+    /// \param sceneMixer Called for the jobs mixing a scene bus.
+    void start(float* storage1, float* storage2, float* peaks, uint8_t* pool, size_t poolSize, int fd,
+        SceneMixer sceneMixer)
+    {
+        setStorage(storage1, storage2, peaks, pool, poolSize);
+        m_fd = fd;
+        m_sceneMixer = sceneMixer;
+        m_running = true;
+        m_thread = std::thread([this]() { work(); });
+    }
+
+    /// Work on other storage from the next job on. To be called from the audio thread
+    /// while no job is running: The thread only reads the storage after it got a job.
+    /// \param storage1 The audio storage of the first channel.
+    /// \param storage2 The audio storage of the second channel.
+    /// \param peaks The peak table of the storage.
+    /// \param pool Where to write the compressed audio to.
+    /// \param poolSize The size of the pool in bytes.
+    void setStorage(float* storage1, float* storage2, float* peaks, uint8_t* pool, size_t poolSize)
+    {
+        m_storage1 = storage1;
+        m_storage2 = storage2;
+        m_peaks = peaks;
+        m_pool = pool;
+        m_poolSize = poolSize;
+    }
+
+    /// Stop the offloader thread.
+    void stop()
+    {
+        if (!m_running)
+            return;
+        m_running = false;
+        m_thread.join();
+    }
+
+    /// Queue a job. To be called from the audio thread, while no job is running.
+    bool pushJob(const OffloadJob& job)
+    {
+        if (job.m_type == OFFLOAD_MOVE)
+        {
+            m_moved = 0;
+            m_movedSeen = 0;
+        }
+        return m_jobs.push(job);
+    }
+
+    /// Get how many samples of the dub moved by the current job are moved already, from the
+    /// start of its first segment on. To be called from the audio thread at the start of each
+    /// run call while the job runs: Until the next call, it only plays the audio of the dub
+    /// after those samples from where it was before.
+    size_t seeMoved()
+    {
+        size_t moved = m_moved.load();
+        m_movedSeen = moved;
+        return moved;
+    }
+
+    /// Get the result of a job, if there is any. To be called from the audio thread.
+    bool popResult(OffloadResult& result)
+    {
+        return m_results.pop(result);
+    }
+
+    /// Get the position of a block in the compressed audio of a segment.
+    /// \param pool The pool.
+    /// \param segmentOffset Where the segment's compressed audio starts.
+    /// \param block The index of the block.
+    /// \param size Will be set to the size of the encoded block.
+    /// \return Where the block starts in the pool.
+    static size_t blockOffset(const uint8_t* pool, size_t segmentOffset, size_t block, size_t& size)
+    {
+        uint32_t offsets[2];
+        memcpy(offsets, &pool[segmentOffset + (block + 1) * sizeof(uint32_t)], sizeof(offsets));
+        size = offsets[1] - offsets[0];
+        return segmentOffset + offsets[0];
+    }
+
+private:
+    /// The audio storage of the first channel
+    float* m_storage1 = NULL;
+    /// The audio storage of the second channel
+    float* m_storage2 = NULL;
+    /// The peak table of the storage
+    float* m_peaks = NULL;
+    /// Where the compressed audio goes
+    uint8_t* m_pool = NULL;
+    /// The size of the pool in bytes
+    size_t m_poolSize = 0;
+    /// The tiering file
+    int m_fd = -1;
+    /// Mixes the scene buses
+    SceneMixer m_sceneMixer;
+    /// Is the thread supposed to run?
+    std::atomic<bool> m_running{false};
+    /// The offloader thread
+    std::thread m_thread;
+    /// Jobs from the audio thread
+    SpscQueue<OffloadJob, 4> m_jobs;
+    /// Results for the audio thread
+    SpscQueue<OffloadResult, 4> m_results;
+    /// The number of samples of the dub moved, see seeMoved
+    std::atomic<size_t> m_moved{0};
+    /// The number of moved samples the audio thread plays from where they were moved to
+    std::atomic<size_t> m_movedSeen{0};
+
+    /// The body of the offloader thread.
+    void work()
+    {
+        while (m_running)
+        {
+            OffloadJob job;
+            if (!m_jobs.pop(job))
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+
+            OffloadResult result;
+            result.m_type = job.m_type;
+            result.m_dubIndex = job.m_dubIndex;
+            result.m_dubId = job.m_dubId;
+            result.m_success = true;
+            if (job.m_type == OFFLOAD_MIX_SCENE)
+            {
+                result.m_success = m_sceneMixer(job);
+                m_results.push(result);
+                continue;
+            }
+            if (job.m_type == OFFLOAD_MOVE)
+            {
+                if (!moveDub(job, result))
+                    // The thread was stopped.
+                    return;
+                m_results.push(result);
+                continue;
+            }
+            size_t offset = job.m_offset;
+            for (size_t g = 0; g < job.m_nrOfSegments && result.m_success; g++)
+            {
+                result.m_offsets[g] = offset;
+                if (job.m_type == OFFLOAD_COMPRESS)
+                    result.m_success = compressSegment(job.m_segments[g], offset);
+                else
+                    result.m_success = writeSegment(job.m_segments[g], job.m_compressed, offset);
+            }
+            result.m_end = offset;
+            // There is only one job at a time, so there is always room for the result.
+            m_results.push(result);
+        }
+    }
+
+    /// Compress one segment.
+    /// \param segment The segment.
+    /// \param offset Where to write to in the pool. Will be moved behind the written data.
+    /// \return false if the pool is full.
+    bool compressSegment(const Segment& segment, size_t& offset)
+    {
+        uint32_t nrOfBlocks = uint32_t((segment.m_length + COMPRESSION_BLOCK_SIZE - 1) / COMPRESSION_BLOCK_SIZE);
+        size_t tableSize = (nrOfBlocks + 2) * sizeof(uint32_t);
+        if (offset + tableSize > m_poolSize)
+            return false;
+
+        size_t start = offset;
+        memcpy(&m_pool[start], &nrOfBlocks, sizeof(nrOfBlocks));
+        offset += tableSize;
+        for (uint32_t b = 0; b < nrOfBlocks; b++)
+        {
+            uint32_t blockStart = uint32_t(offset - start);
+            memcpy(&m_pool[start + (b + 1) * sizeof(uint32_t)], &blockStart, sizeof(blockStart));
+
+            size_t index = segment.m_storageOffset + b * COMPRESSION_BLOCK_SIZE;
+            size_t length = segment.m_length - b * COMPRESSION_BLOCK_SIZE;
+            if (length > COMPRESSION_BLOCK_SIZE)
+                length = COMPRESSION_BLOCK_SIZE;
+            size_t size = LosslessCodec::encodeBlock(&m_storage1[index], &m_storage2[index], length,
+                &m_pool[offset], m_poolSize - offset);
+            if (size == 0)
+                return false;
+            offset += size;
+        }
+        // The end of the last block, so the size of each block is known.
+        uint32_t end = uint32_t(offset - start);
+        memcpy(&m_pool[start + (nrOfBlocks + 1) * sizeof(uint32_t)], &end, sizeof(end));
+        return true;
+    }
+
+    /// Move the audio of a dub down in the storage, the segments keep their distance. A
+    /// chunk which overwrites audio of the dub waits until the audio thread plays that part
+    /// from where it was moved to. The peaks of the blocks within the range moved to are
+    /// computed along, the ones of the blocks at its edges are shared with the audio next
+    /// to it, they are raised by the audio thread.
+    /// \param job The job, its offset is where the dub is moved to.
+    /// \param result Set to where the segments were moved to.
+    /// \return false if the thread was stopped meanwhile.
+    bool moveDub(const OffloadJob& job, OffloadResult& result)
+    {
+        size_t source = job.m_segments[0].m_storageOffset;
+        const Segment& last = job.m_segments[job.m_nrOfSegments - 1];
+        size_t length = last.m_storageOffset + last.m_length - source;
+        size_t destination = job.m_offset;
+        size_t distance = source - destination;
+        size_t chunk = distance < MOVE_CHUNK_SIZE ? distance : MOVE_CHUNK_SIZE;
+        size_t firstBlock = (destination + PEAK_BLOCK_SIZE - 1) / PEAK_BLOCK_SIZE;
+        for (size_t moved = 0; moved < length;)
+        {
+            size_t count = length - moved < chunk ? length - moved : chunk;
+            // The chunk overwrites the audio of the dub before moved + count - distance.
+            while (moved + count > distance + m_movedSeen.load())
+            {
+                if (!m_running)
+                    return false;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            size_t start = destination + moved;
+            memcpy(&m_storage1[start], &m_storage1[source + moved], count * sizeof(float));
+            memcpy(&m_storage2[start], &m_storage2[source + moved], count * sizeof(float));
+            // The block at the end of the chunk is completed by the next one.
+            size_t block = start / PEAK_BLOCK_SIZE;
+            computePeaks(block > firstBlock ? block : firstBlock, start + count);
+            moved += count;
+            m_moved = moved;
+        }
+        for (size_t g = 0; g < job.m_nrOfSegments; g++)
+            result.m_offsets[g] = destination + (job.m_segments[g].m_storageOffset - source);
+        result.m_end = destination + length;
+        return true;
+    }
+
+    /// Compute the peaks of the blocks of the storage from one on, up to the last one which
+    /// ends before a sample.
+    /// \param firstBlock The first block.
+    /// \param end The sample after the last one.
+    void computePeaks(size_t firstBlock, size_t end)
+    {
+        for (size_t block = firstBlock; (block + 1) * PEAK_BLOCK_SIZE <= end; block++)
+        {
+            float peak = 0.0f;
+            for (size_t s = block * PEAK_BLOCK_SIZE; s < (block + 1) * PEAK_BLOCK_SIZE; s++)
+            {
+                peak = fmaxf(peak, fabsf(m_storage1[s]));
+                peak = fmaxf(peak, fabsf(m_storage2[s]));
+            }
+            m_peaks[block] = peak;
+        }
+    }
+
+    /// Write one segment to the tiering file.
+    /// \param segment The segment.
+    /// \param compressed Is the audio of the segment in the pool?
+    /// \param offset Where to write to in the file. Will be moved behind the written data.
+    /// \return false if the file could not be written.
+    bool writeSegment(const Segment& segment, bool compressed, size_t& offset)
+    {
+        size_t length = segment.m_length;
+        size_t start = offset;
+        offset += 2 * length * sizeof(float);
+        if (!compressed)
+            return TieringFile::writeAll(m_fd, &m_storage1[segment.m_storageOffset], length * sizeof(float), start) &&
+                TieringFile::writeAll(m_fd, &m_storage2[segment.m_storageOffset], length * sizeof(float),
+                    start + length * sizeof(float));
+
+        float samples1[COMPRESSION_BLOCK_SIZE];
+        float samples2[COMPRESSION_BLOCK_SIZE];
+        for (size_t b = 0; b * COMPRESSION_BLOCK_SIZE < length; b++)
+        {
+            size_t index = b * COMPRESSION_BLOCK_SIZE;
+            size_t blockLength = length - index;
+            if (blockLength > COMPRESSION_BLOCK_SIZE)
+                blockLength = COMPRESSION_BLOCK_SIZE;
+            size_t size;
+            size_t position = blockOffset(m_pool, segment.m_compressedOffset, b, size);
+            LosslessCodec::decodeBlock(&m_pool[position], size, blockLength, samples1, samples2);
+            if (!TieringFile::writeAll(m_fd, samples1, blockLength * sizeof(float), start + index * sizeof(float)) ||
+                !TieringFile::writeAll(m_fd, samples2, blockLength * sizeof(float),
+                    start + (length + index) * sizeof(float)))
+                return false;
+        }
+        return true;
+    }
+};
+
+///
+/// Threads helping the audio thread to mix the dubs. The dubs are split into jobs, which
+/// are claimed by the audio thread and the mixing threads alike, so a thread which is
+/// late does not hold up the block: The audio thread only waits for the jobs which were
+/// claimed already, and only for a while. Then it takes them over. The audio thread adds
+/// its jobs to the output right away, each mixing thread to a buffer of its own, which
+/// the audio thread adds to the output at the end. The threads wait for jobs spinning,
+/// later yielding and eventually sleeping.
+///
+/// A late thread may still mix its job while the audio thread continues. So the jobs of
+/// a round only read a copy of the state made for it, of two used in turns, and each
+/// thread tells the round it is busy with: The copy is not made again for a later round
+/// as long as a thread is busy with it, and nothing the copy refers to is freed while any
+/// thread is busy. A thread only claims a job after it finished the one before, and it
+/// decodes compressed audio into a buffer of its own.
+///
+class MixingThreads
+{
+public:
+    /// Mixes a job of a round to the buses of the tracks
+    typedef std::function<void(size_t job, uint32_t round, const TrackBuses& buses)> Mixer;
+
+    static_assert(NR_OF_MIXING_THREADS <= 32, "The mixing threads must fit into a mask");
+
+    /// Destructor
+    ~MixingThreads()
+    {
+        stop();
+    }
+
+    /// Start the threads. They run at the normal priority until setPriority is called.
+    /// \param mixer Called to mix a job, from any of the threads.
+    void start(const Mixer& mixer)
+    {
+        m_mixer = mixer;
+        m_buffers1 = new float[NR_OF_MIXING_THREADS * NR_OF_TRACKS * MIXING_BUFFER_SIZE];
+        m_buffers2 = new float[NR_OF_MIXING_THREADS * NR_OF_TRACKS * MIXING_BUFFER_SIZE];
+        m_decoded1 = new float[NR_OF_MIXING_THREADS * COMPRESSION_BLOCK_SIZE];
+        m_decoded2 = new float[NR_OF_MIXING_THREADS * COMPRESSION_BLOCK_SIZE];
+        m_running = true;
+        for (size_t t = 0; t < NR_OF_MIXING_THREADS; t++)
+        {
+            m_participated[t].store(0);
+            m_busy[t].store(0);
+            m_threads[t] = std::thread([this, t]() { work(t); });
+        }
+    }
+
+    /// Stop the threads.
+    void stop()
+    {
+        if (!m_running)
+            return;
+        m_running = false;
+        for (size_t t = 0; t < NR_OF_MIXING_THREADS; t++)
+            m_threads[t].join();
+        delete[] m_buffers1;
+        delete[] m_buffers2;
+        delete[] m_decoded1;
+        delete[] m_decoded2;
+        m_buffers1 = NULL;
+        m_buffers2 = NULL;
+        m_decoded1 = NULL;
+        m_decoded2 = NULL;
+    }
+
+    /// Are the threads running?
+    bool running() const
+    {
+        return m_running;
+    }
+
+    /// Change the scheduling of the threads, e.g. to a real-time priority below the one
+    /// of the audio thread. Each thread changes its own, so the audio thread does not
+    /// wait for the system call.
+    /// \param policy The scheduling policy.
+    /// \param priority The priority.
+    void setPriority(int policy, int priority)
+    {
+        m_policy = policy;
+        m_priority = priority;
+        m_priorityRequest.fetch_add(1, std::memory_order_release);
+    }
+
+    /// Why could a thread not change its scheduling?
+    /// \return The error of the last thread which failed since the last call, 0 if none.
+    int priorityError()
+    {
+        if (m_priorityError.load(std::memory_order_relaxed) == 0)
+            return 0;
+        return m_priorityError.exchange(0);
+    }
+
+    /// Get the round of the next call of mix, to make the copy of the state its jobs read.
+    /// Two copies are used in turns, the one of round % 2. To be called from the audio
+    /// thread only.
+    /// \return The round, 0 if a thread is still busy with the round before the last one,
+    ///         which used the same copy. The jobs cannot be handed out then.
+    uint32_t nextRound() const
+    {
+        // 0 marks a thread which is not busy or never participated. The rounds alternate
+        // between odd and even, also when they wrap.
+        uint32_t round = m_round == UINT32_MAX ? 2 : m_round + 1;
+        for (size_t t = 0; t < NR_OF_MIXING_THREADS; t++)
+        {
+            uint32_t busy = m_busy[t].load();
+            if (busy != 0 && busy % 2 == round % 2)
+                return 0;
+        }
+        return round;
+    }
+
+    /// Is any thread still busy with a job, maybe of a round which ended already? The
+    /// state the jobs read must be kept until none is.
+    bool busy() const
+    {
+        for (size_t t = 0; t < NR_OF_MIXING_THREADS; t++)
+        {
+            if (m_busy[t].load() != 0)
+                return true;
+        }
+        return false;
+    }
+
+    /// Mix all jobs and add them to the buses. To be called from the audio thread only.
+    /// \param round The round of the jobs, see nextRound.
+    /// \param nrOfJobs The number of jobs, up to MAX_MIXING_JOBS.
+    /// \param buses Where to add the jobs to.
+    /// \param offset The first sample mixed by the jobs.
+    /// \param nrOfSamples The number of samples mixed by the jobs. The chunk must end
+    ///            within MIXING_BUFFER_SIZE.
+    void mix(uint32_t round, size_t nrOfJobs, const TrackBuses& buses, uint32_t offset, uint32_t nrOfSamples)
+    {
+        m_chunk.store(uint64_t(offset) << 32 | nrOfSamples, std::memory_order_relaxed);
+        m_round = round;
+        // Sequentially consistent with the flags of the threads, see claim.
+        m_jobs.store(uint64_t(m_round) << 32 | uint64_t(nrOfJobs) << 16);
+
+        bool own[MAX_MIXING_JOBS] = {};
+        size_t ownJobs = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        size_t job;
+        while (claim(job, m_round))
+        {
+            m_mixer(job, m_round, buses);
+            own[job] = true;
+            ownJobs++;
+        }
+
+        // A mixing thread may be late, e.g. because it was preempted. It gets as long as
+        // the audio thread took for a few of its jobs.
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::chrono::nanoseconds wait = std::chrono::microseconds(MIXING_MIN_WAIT);
+        if (ownJobs > 0)
+        {
+            std::chrono::nanoseconds jobs = std::chrono::duration_cast<std::chrono::nanoseconds>(now - start) *
+                MIXING_WAIT_JOBS / ownJobs;
+            wait = jobs > wait ? jobs : wait;
+        }
+        uint32_t late = 0;
+        while (!finished(nrOfJobs, own))
+        {
+            if (std::chrono::steady_clock::now() - now > wait)
+            {
+                late = takeOver(nrOfJobs, own, buses);
+                break;
+            }
+            pause();
+        }
+
+        for (size_t t = 0; t < NR_OF_MIXING_THREADS; t++)
+        {
+            if (m_participated[t].load(std::memory_order_relaxed) != m_round || (late & (1u << t)) != 0)
+                continue;
+            for (size_t k = 0; k < NR_OF_TRACKS; k++)
+            {
+                const float* partial1 = m_buffers1 + (t * NR_OF_TRACKS + k) * MIXING_BUFFER_SIZE;
+                const float* partial2 = m_buffers2 + (t * NR_OF_TRACKS + k) * MIXING_BUFFER_SIZE;
+                for (uint32_t s = offset; s < offset + nrOfSamples; s++)
+                {
+                    buses.m_outputs1[k][s] += partial1[s];
+                    buses.m_outputs2[k][s] += partial2[s];
+                }
+            }
+        }
+    }
+
+private:
+    /// The number of polls of an idle thread before it yields instead of spinning
+    static const size_t SPIN_POLLS = 100000;
+    /// The number of polls of an idle thread before it sleeps instead of yielding
+    static const size_t YIELD_POLLS = 200000;
+    /// The flag of a job which is finished, in its state
+    static const uint64_t JOB_FINISHED = 1 << 16;
+    /// The mask of all threads
+    static const uint32_t ALL_THREADS = 0xffffffff;
+
+    /// Mixes a job
+    Mixer m_mixer;
+    /// Are the threads supposed to run?
+    std::atomic<bool> m_running{false};
+    /// The threads
+    std::thread m_threads[NR_OF_MIXING_THREADS > 0 ? NR_OF_MIXING_THREADS : 1];
+    /// The first channel of the buffer of each thread, one for each track
+    float* m_buffers1 = NULL;
+    /// The second channel of the buffer of each thread, one for each track
+    float* m_buffers2 = NULL;
+    /// The round of the jobs (upper 32 bits), their number (16 bits) and the next one
+    /// to claim (lower 16 bits). A thread can only claim a job of the current round.
+    std::atomic<uint64_t> m_jobs{0};
+    /// The state of each job claimed by a mixing thread: The round (upper 32 bits),
+    /// JOB_FINISHED and the thread (lower 16 bits)
+    std::atomic<uint64_t> m_states[MAX_MIXING_JOBS];
+    /// The last round each thread added a job to its buffer in
+    std::atomic<uint32_t> m_participated[NR_OF_MIXING_THREADS > 0 ? NR_OF_MIXING_THREADS : 1];
+    /// The round each thread mixes a job of, or is about to claim one of, 0 if none
+    std::atomic<uint32_t> m_busy[NR_OF_MIXING_THREADS > 0 ? NR_OF_MIXING_THREADS : 1];
+    /// The current round, only used by the audio thread
+    uint32_t m_round = 0;
+    /// The first sample mixed in this round (upper 32 bits) and the number of samples.
+    /// A late thread may see the ones of the next round, its buffer is not used then.
+    std::atomic<uint64_t> m_chunk{0};
+    /// The first channel of the compressed block decoded by each thread
+    float* m_decoded1 = NULL;
+    /// The second channel of the compressed block decoded by each thread
+    float* m_decoded2 = NULL;
+    /// The scheduling policy of the threads
+    int m_policy = SCHED_OTHER;
+    /// The scheduling priority of the threads
+    int m_priority = 0;
+    /// Counts the calls of setPriority
+    std::atomic<uint32_t> m_priorityRequest{0};
+    /// The error of the last thread which could not change its scheduling
+    std::atomic<int> m_priorityError{0};
+
+    /// Claim the next job of a round.
+    /// \param job Set to the job claimed.
+    /// \param round The round.
+    /// \return false if all jobs are claimed, or the round is over.
+    bool claim(size_t& job, uint32_t round)
+    {
+        // A thread sets its busy flag before, so either nextRound sees the flag or the
+        // thread sees that the round is over.
+        uint64_t jobs = m_jobs.load();
+        while (uint32_t(jobs >> 32) == round && (jobs & 0xffff) < ((jobs >> 16) & 0xffff))
+        {
+            if (m_jobs.compare_exchange_weak(jobs, jobs + 1, std::memory_order_acq_rel))
+            {
+                job = size_t(jobs & 0xffff);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// Did the mixing threads finish all jobs they claimed in this round?
+    /// \param nrOfJobs The number of jobs.
+    /// \param own Which jobs the audio thread mixed itself?
+    bool finished(size_t nrOfJobs, const bool* own) const
+    {
+        for (size_t j = 0; j < nrOfJobs; j++)
+        {
+            if (own[j])
+                continue;
+            uint64_t state = m_states[j].load(std::memory_order_acquire);
+            if (uint32_t(state >> 32) != m_round || (state & JOB_FINISHED) == 0)
+                return false;
+        }
+        return true;
+    }
+
+    /// Take over the jobs of the mixing threads which are late. Their buffers are not
+    /// used in this round, so the audio thread mixes all of their jobs again, also the
+    /// ones they finished. If a thread did not tell which job it claimed yet, the job may
+    /// end up in any of the buffers, so all jobs are mixed again. The late threads stay
+    /// busy with the copy of this round meanwhile, see nextRound.
+    /// \param nrOfJobs The number of jobs.
+    /// \param own Which jobs the audio thread mixed itself?
+    /// \param buses Where to add the jobs to.
+    /// \return The threads which are late, a bit for each.
+    uint32_t takeOver(size_t nrOfJobs, const bool* own, const TrackBuses& buses)
+    {
+        // The states are read once, a late thread may change them any time.
+        uint64_t states[MAX_MIXING_JOBS];
+        uint32_t late = 0;
+        for (size_t j = 0; j < nrOfJobs; j++)
+        {
+            if (own[j])
+                continue;
+            states[j] = m_states[j].load(std::memory_order_acquire);
+            if (uint32_t(states[j] >> 32) != m_round)
+                late = ALL_THREADS;
+            else if ((states[j] & JOB_FINISHED) == 0)
+                late |= 1u << (states[j] & 0xffff);
+        }
+
+        for (size_t j = 0; j < nrOfJobs; j++)
+        {
+            if (!own[j] && (late == ALL_THREADS || (late & (1u << (states[j] & 0xffff))) != 0))
+                m_mixer(j, m_round, buses);
+        }
+        return late;
+    }
+
+    /// Tell the core that this thread is spinning, so it does not take resources from a
+    /// thread running on the same core.
+    static void pause()
+    {
+#if defined(__i386__) || defined(__x86_64__)
+        __builtin_ia32_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+
+    /// The body of a mixing thread.
+    /// \param thread The index of the thread.
+    void work(size_t thread)
+    {
+        TrackBuses buses;
+        for (size_t k = 0; k < NR_OF_TRACKS; k++)
+        {
+            buses.m_outputs1[k] = m_buffers1 + (thread * NR_OF_TRACKS + k) * MIXING_BUFFER_SIZE;
+            buses.m_outputs2[k] = m_buffers2 + (thread * NR_OF_TRACKS + k) * MIXING_BUFFER_SIZE;
+        }
+        // The caches of the dubs are only used by the audio thread.
+        buses.m_decoded1 = m_decoded1 + thread * COMPRESSION_BLOCK_SIZE;
+        buses.m_decoded2 = m_decoded2 + thread * COMPRESSION_BLOCK_SIZE;
+        buses.m_source = NULL;
+        size_t idlePolls = 0;
+        uint32_t priorityRequest = 0;
+        while (m_running)
+        {
+            if (m_priorityRequest.load(std::memory_order_acquire) != priorityRequest)
+            {
+                priorityRequest = m_priorityRequest.load(std::memory_order_acquire);
+                sched_param param;
+                param.sched_priority = m_priority;
+                int error = pthread_setschedparam(pthread_self(), m_policy, &param);
+                if (error != 0)
+                    m_priorityError.store(error);
+            }
+
+            // The thread tells the round it is busy with before it claims a job of it, so the
+            // copy of the round is not made again while it mixes the job.
+            uint64_t jobs = m_jobs.load(std::memory_order_acquire);
+            uint32_t round = uint32_t(jobs >> 32);
+            size_t job = 0;
+            bool claimed = (jobs & 0xffff) < ((jobs >> 16) & 0xffff);
+            if (claimed)
+            {
+                m_busy[thread].store(round);
+                claimed = claim(job, round);
+                if (!claimed)
+                    m_busy[thread].store(0, std::memory_order_release);
+            }
+            if (!claimed)
+            {
+                idlePolls++;
+                if (idlePolls > YIELD_POLLS)
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                else if (idlePolls > SPIN_POLLS)
+                    std::this_thread::yield();
+                continue;
+            }
+            idlePolls = 0;
+            uint64_t state = uint64_t(round) << 32 | uint64_t(thread);
+            m_states[job].store(state, std::memory_order_release);
+
+            if (m_participated[thread].load(std::memory_order_relaxed) != round)
+            {
+                uint64_t chunk = m_chunk.load(std::memory_order_relaxed);
+                uint32_t offset = uint32_t(chunk >> 32);
+                for (size_t k = 0; k < NR_OF_TRACKS; k++)
+                {
+                    memset(buses.m_outputs1[k] + offset, 0, uint32_t(chunk) * sizeof(float));
+                    memset(buses.m_outputs2[k] + offset, 0, uint32_t(chunk) * sizeof(float));
+                }
+                m_participated[thread].store(round, std::memory_order_relaxed);
+            }
+            m_mixer(job, round, buses);
+            // Not if the round ended meanwhile, the job may belong to the next one by now.
+            m_states[job].compare_exchange_strong(state, state | JOB_FINISHED, std::memory_order_acq_rel);
+            m_busy[thread].store(0, std::memory_order_release);
+        }
+    }
+};
+
+///
+/// The looper class
+///
+class Looper
+{
+public:
+    /// Constructor
+    /// \param sampleRate The sample rate is used for calculation of the storage needed
+    ///                   and also the current time.
+    /// \param map The URID map feature of the host, NULL if not supported. Without it
+    ///            messages on the control port are ignored.
+    /// \param options The options given by the host, NULL if none. Without the map they
+    ///            are ignored.
+    /// \param schedule The worker feature of the host, NULL if not supported. Without it
+    ///            the storage cannot be resized after instantiation.
+    Looper(double sampleRate, const LV2_URID_Map* map, const LV2_Options_Option* options,
+        const LV2_Worker_Schedule* schedule)
+        : m_sampleRate(sampleRate), m_schedule(schedule)
+    {
+        if (map != NULL)
+        {
+            m_uris.m_atomBlank = map->map(map->handle, LV2_ATOM__Blank);
+            m_uris.m_atomBool = map->map(map->handle, LV2_ATOM__Bool);
+            m_uris.m_atomFloat = map->map(map->handle, LV2_ATOM__Float);
+            m_uris.m_atomInt = map->map(map->handle, LV2_ATOM__Int);
+            m_uris.m_atomObject = map->map(map->handle, LV2_ATOM__Object);
+            m_uris.m_atomUrid = map->map(map->handle, LV2_ATOM__URID);
+            m_uris.m_patchSet = map->map(map->handle, LV2_PATCH__Set);
+            m_uris.m_patchProperty = map->map(map->handle, LV2_PATCH__property);
+            m_uris.m_patchValue = map->map(map->handle, LV2_PATCH__value);
+            m_uris.m_dub = map->map(map->handle, LOOPER_URI_DUB);
+            m_uris.m_dubGain = map->map(map->handle, LOOPER_URI_DUB_GAIN);
+            m_uris.m_dubMute = map->map(map->handle, LOOPER_URI_DUB_MUTE);
+            m_uris.m_dubPan = map->map(map->handle, LOOPER_URI_DUB_PAN);
+            m_uris.m_dubScenes = map->map(map->handle, LOOPER_URI_DUB_SCENES);
+            m_uris.m_dubDelete = map->map(map->handle, LOOPER_URI_DUB_DELETE);
+            m_uris.m_dubReplace = map->map(map->handle, LOOPER_URI_DUB_REPLACE);
+            m_uris.m_track = map->map(map->handle, LOOPER_URI_TRACK);
+            m_uris.m_trackGain = map->map(map->handle, LOOPER_URI_TRACK_GAIN);
+            m_uris.m_trackMute = map->map(map->handle, LOOPER_URI_TRACK_MUTE);
+            m_uris.m_timePosition = map->map(map->handle, LV2_TIME__Position);
+            m_uris.m_timeBeatsPerMinute = map->map(map->handle, LV2_TIME__beatsPerMinute);
+            m_uris.m_maxDubs = map->map(map->handle, LOOPER_URI_MAX_DUBS);
+            m_uris.m_storageSeconds = map->map(map->handle, LOOPER_URI_STORAGE_SECONDS);
+        }
+        readOptions(options);
+
+        // Allocate the needed memory
+        StorageBuffers buffers;
+        if (buffers.allocate(m_defaultStorageSize))
+            installStorage(buffers);
+        m_requestedStorageSize = m_storageBudget;
+        if (COMPRESSION_ENABLED)
+            m_decodeCaches = new DecodeCache[NR_OF_DUBS];
+
+        if (LOG_ENABLED)
+            m_logFile = fopen("/root/loopor.log", "wb");
+        if (TIERING_ENABLED && !m_tieringFile.open(TIERING_DIRECTORY))
+            log("Could not create tiering file in %s", TIERING_DIRECTORY);
+        // The offloader also compacts the storage and mixes the scene buses, so it always runs.
+        m_offloader.start(m_storage1, m_storage2, m_peaks, m_compressionPool, m_compressionPoolSize,
+            m_tieringFile.fd(), [this](const OffloadJob& job) { return mixSceneBus(job); });
+        if (OSC_ENABLED && !m_oscServer.start(OSC_PORT))
+            log("Could not open OSC port %u", unsigned(OSC_PORT));
+        if (PROFILING_ENABLED)
+            m_profiler.start("/root/loopor-profile.log");
+        if (NR_OF_MIXING_THREADS > 0)
+            m_mixingThreads.start([this](size_t job, uint32_t round, const TrackBuses& buses) {
+                mixJob(job, round, buses);
+            });
+    }
+
+    // Destructor
+    ~Looper()
+    {
+        m_mixingThreads.stop();
+        m_oscServer.stop();
+        m_profiler.stop();
+        m_offloader.stop();
+        m_tieringFile.close();
+        delete[] m_decodeCaches;
+        for (size_t b = 0; b < NR_OF_SCENE_BUSES; b++)
+            m_sceneBusSlots[b].release();
+        StorageBuffers buffers = currentStorage();
+        buffers.release();
+        m_pendingStorage.release();
+        m_freedStorage.release();
+        if (m_logFile != NULL)
+            fclose(m_logFile);
+    }
+
+    /// Was the storage allocated? Otherwise the looper cannot be used.
+    bool hasStorage() const
+    {
+        return m_storage1 != NULL;
+    }
+
+    /// Called by the host for each port to connect it to the looper.
     /// \param port The index of the port to be connected.
     /// \param data A pointer to the data where the parameter will be written to.
     void connectPort(PortIndex port, void* data)
     {
-        // Install the trivial ports
-        switch (port)
+        // Install the trivial ports
+        switch (port)
+        {
+            case LOOPER_INPUT1: m_input1 = (const float*)data; return;
+            case LOOPER_INPUT2: m_input2 = (const float*)data; return;
+            case LOOPER_OUTPUT1: m_output1 = (float*)data; return;
+            case LOOPER_OUTPUT2: m_output2 = (float*)data; return;
+            case LOOPER_THRESHOLD: m_thresholdParameter = (const float*)data; return;
+            case LOOPER_DRY_AMOUNT: m_dryAmountParameter = (const float*)data; return;
+            case LOOPER_CONTINUOUS_DUB: m_continuousDubParameter = (const float*)data; return;
+            case LOOPER_SILENCE_GAP: m_silenceGapParameter = (const float*)data; return;
+            case LOOPER_CONTROL: m_controlPort = (const LV2_Atom_Sequence*)data; return;
+            case LOOPER_FADE_LENGTH: m_fadeLengthParameter = (const float*)data; return;
+            case LOOPER_FADE_SHAPE: m_fadeShapeParameter = (const float*)data; return;
+            case LOOPER_SPEED: m_speedParameter = (const float*)data; return;
+            case LOOPER_TEMPO: m_tempoParameter = (const float*)data; return;
+            case LOOPER_FOLLOW_TEMPO: m_followTempoParameter = (const float*)data; return;
+            case LOOPER_TRACK: m_trackParameter = (const float*)data; return;
+            case LOOPER_SCENE: m_sceneParameter = (const float*)data; return;
+            case LOOPER_MAX_DUBS: m_maxDubsParameter = (const float*)data; return;
+            case LOOPER_STORAGE_SECONDS: m_storageSecondsParameter = (const float*)data; return;
+            case LOOPER_CULL_LEVEL: m_cullLevelParameter = (const float*)data; return;
+            case LOOPER_CULL_LOAD: m_cullLoadParameter = (const float*)data; return;
+            case LOOPER_STATE_OUTPUT: m_stateOutput = (float*)data; return;
+            case LOOPER_DUBS_OUTPUT: m_dubsOutput = (float*)data; return;
+            case LOOPER_RECORDED_DUBS_OUTPUT: m_recordedDubsOutput = (float*)data; return;
+            case LOOPER_STORAGE_OUTPUT: m_storageOutput = (float*)data; return;
+            case LOOPER_POSITION_OUTPUT: m_positionOutput = (float*)data; return;
+            case LOOPER_DSP_LOAD_OUTPUT: m_dspLoadOutput = (float*)data; return;
+            default: break;
+        }
+        if (port >= LOOPER_TRACK_OUTPUTS && port < LOOPER_TRACK_OUTPUTS + 2 * NR_OF_TRACKS)
+        {
+            size_t track = (port - LOOPER_TRACK_OUTPUTS) / 2;
+            if ((port - LOOPER_TRACK_OUTPUTS) % 2 == 0)
+                m_trackOutputs.m_outputs1[track] = (float*)data;
+            else
+                m_trackOutputs.m_outputs2[track] = (float*)data;
+            return;
+        }
+
+        // Install the buttons and set their callback functions.
+        if (port == LOOPER_ACTIVATE)
+        {
+            m_activateButton.connect(data, [this](bool pressed, double interval, bool doubleClick)
+            {
+                if (!pressed)
+                    return;
+                if (doubleClick)
+                {
+                    reset();
+                    return;
+                }
+                toggleRecording();
+            });
+        }
+        else if (port == LOOPER_RESET)
+        {
+            m_resetButton.connect(data, [this](bool pressed, double interval, bool doubleClick)
+            {
+                if (!pressed)
+                    return;
+                if (doubleClick)
+                {
+                    reset();
+                    return;
+                }
+
+                if (m_state == LOOPER_STATE_RECORDING || m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
+                    finishRecording();
+                else
+                    undo();
+            });
+        }
+        else if (port == LOOPER_UNDO)
+        {
+            m_undoButton.connect(data, [this](bool pressed, double interval, bool doubleClick)
+            {
+                if (!pressed)
+                    return;
+                undo();
+            });
+        }
+        else if (port == LOOPER_REDO)
+        {
+            m_redoButton.connect(data, [this](bool pressed, double interval, bool doubleClick)
+            {
+                if (!pressed)
+                    return;
+                redo();
+            });
+        }
+        else if (port == LOOPER_DUB)
+        {
+            m_dubButton.connect(data, [this](bool pressed, double interval, bool doubleClick)
+            {
+               if (!pressed)
+                    return;
+                if (doubleClick)
+                {
+                    reset();
+                    return;
+                }
+                startDub();
+            });
+        }
+        else if (port == LOOPER_BRANCH)
+        {
+            m_branchButton.connect(data, [this](bool pressed, double interval, bool doubleClick)
+            {
+                if (!pressed)
+                    return;
+                switchBranch();
+            });
+        }
+        else if (port == LOOPER_SNAPSHOT)
+        {
+            m_snapshotButton.connect(data, [this](bool pressed, double interval, bool doubleClick)
+            {
+                if (!pressed)
+                    return;
+                if (doubleClick)
+                {
+                    releaseSnapshot();
+                    return;
+                }
+                takeSnapshot();
+            });
+        }
+        else if (port == LOOPER_RESTORE)
+        {
+            m_restoreButton.connect(data, [this](bool pressed, double interval, bool doubleClick)
+            {
+                if (!pressed)
+                    return;
+                restoreSnapshot();
+            });
+        }
+    }
+
+    /// Run the looper. Called for a bunch of samples at a time. Parameters will not change within this
+    /// call!
+    /// \param The number of samples to be read from the input and writte to the output.
+    void run(uint32_t nrOfSamples)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        State startState = m_state;
+
+        processWorkerResponses();
+        processOscCommands();
+        processControlMessages();
+        processOffloading();
+        processTiering(nrOfSamples);
+        updateParameters();
+        retryFreeStorage();
+        swapStorage();
+        if (m_mixingThreads.running())
+            scheduleMixingThreads();
+
+        m_now += double(nrOfSamples) / m_sampleRate;
+        processAudio(nrOfSamples);
+        mixOutputs(nrOfSamples);
+
+        std::chrono::nanoseconds duration = std::chrono::steady_clock::now() - start;
+        updateOutputs(nrOfSamples, duration);
+        updateCulling(nrOfSamples, duration);
+        if (PROFILING_ENABLED)
+            m_profiler.add(startState, duration.count());
+    }
+
+    /// Let the mixing threads run right below the audio thread, once it is known which
+    /// priority the host gives it. That is only the case in the first call of run.
+    void scheduleMixingThreads()
+    {
+        if (!m_mixingThreadsScheduled)
+        {
+            m_mixingThreadsScheduled = true;
+            int policy;
+            sched_param param;
+            int error = pthread_getschedparam(pthread_self(), &policy, &param);
+            if (error != 0)
+                log("Could not get the priority of the audio thread: %s", strerror(error));
+            else if (policy == SCHED_FIFO || policy == SCHED_RR)
+            {
+                int priority = param.sched_priority - 1;
+                if (priority < sched_get_priority_min(policy))
+                    priority = sched_get_priority_min(policy);
+                m_mixingThreads.setPriority(policy, priority);
+            }
+        }
+        int error = m_mixingThreads.priorityError();
+        if (error != 0)
+            log("Could not set the priority of a mixing thread: %s", strerror(error));
+    }
+
+    /// Do a job. Called by the LV2 worker, not in the audio thread.
+    /// \param respond Sends the result to workResponse.
+    /// \param handle To be passed to respond.
+    /// \param size The size of the job.
+    /// \param data The job, a WorkerJob.
+    LV2_Worker_Status work(LV2_Worker_Respond_Function respond, LV2_Worker_Respond_Handle handle, uint32_t size,
+        const void* data)
+    {
+        if (size != sizeof(WorkerJob))
+            return LV2_WORKER_ERR_UNKNOWN;
+        WorkerJob job;
+        memcpy(&job, data, sizeof(job));
+        switch (job.m_type)
+        {
+            case WORKER_ALLOCATE_STORAGE:
+                // If there is not enough memory, the buffers are sent back empty.
+                job.m_buffers.allocate(job.m_buffers.m_budget);
+                break;
+            case WORKER_FREE_STORAGE:
+                job.m_buffers.release();
+                return LV2_WORKER_SUCCESS;
+            case WORKER_BOUNCE:
+                mixBounce();
+                break;
+        }
+        return respond(handle, sizeof(job), &job);
+    }
+
+    /// Queue the result of a job done by the LV2 worker. Called in the audio thread after
+    /// run, the result is applied at the start of the next run call.
+    /// \param size The size of the response.
+    /// \param data The response, a WorkerJob.
+    LV2_Worker_Status workResponse(uint32_t size, const void* data)
+    {
+        if (size != sizeof(WorkerJob))
+            return LV2_WORKER_ERR_UNKNOWN;
+        WorkerJob job;
+        memcpy(&job, data, sizeof(job));
+        // There is only one job of each type with a response at a time, so there is always room.
+        return m_workerResponses.push(job) ? LV2_WORKER_SUCCESS : LV2_WORKER_ERR_NO_SPACE;
+    }
+
+private:
+    /// Record and play back a bunch of samples.
+    /// \param The number of samples to be read from the input and writte to the output.
+    void processAudio(uint32_t nrOfSamples)
+    {
+        for (size_t k = 0; k < NR_OF_TRACKS; k++)
+        {
+            memset(m_trackOutputs.m_outputs1[k], 0, nrOfSamples * sizeof(float));
+            memset(m_trackOutputs.m_outputs2[k], 0, nrOfSamples * sizeof(float));
+        }
+        if (m_state == LOOPER_STATE_INACTIVE)
+            return;
+
+        updateMixSource();
+        m_mixBuses = m_trackOutputs;
+        if (m_stretching && !stretched())
+            finishStretch();
+        addStretchResidual(nrOfSamples);
+        if (stretched())
+        {
+            recordTail(0, nrOfSamples);
+            playStretched(nrOfSamples);
+            return;
+        }
+        if (varispeed())
+        {
+            recordTail(0, nrOfSamples);
+            playVarispeed(nrOfSamples);
+            return;
+        }
+
+        uint32_t offset = 0;
+        while (offset < nrOfSamples)
+        {
+            // Process the block in chunks which end at the end of the loop at the
+            // latest: The dubs which are active only change there.
+            uint32_t chunk = nrOfSamples - offset;
+            if (m_nrOfDubs > 0 && m_currentLoopIndex < m_loopLength && m_loopLength - m_currentLoopIndex < chunk)
+                chunk = uint32_t(m_loopLength - m_currentLoopIndex);
+            // A dub recorded across the end of the loop ends where it started.
+            if (m_recordingWrapped && m_dubs[m_nrOfDubs].m_startIndex - m_currentLoopIndex < chunk)
+                chunk = uint32_t(m_dubs[m_nrOfDubs].m_startIndex - m_currentLoopIndex);
+            if (m_state == LOOPER_STATE_RECORDING || m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
+            {
+                size_t freeStorage = contiguousFreeStorage();
+                if (freeStorage < chunk)
+                    chunk = uint32_t(freeStorage);
+            }
+
+            record(offset, chunk);
+            recordTail(offset, chunk);
+            playDubs(m_loopCounter, m_currentLoopIndex, offset, chunk, false);
+
+            if (m_nrOfDubs > 0)
+                // Only once we are actually playing anything the loop length is known.
+                m_currentLoopIndex += chunk;
+            offset += chunk;
+            advanceGains(chunk);
+
+            // Check if we are at the end of the loop. The first dub governs the length
+            // of the whole loop. So if still recording when we reach the end of the loop,
+            // we stop the recording, unless the dub started within the loop: It continues
+            // at the start of the loop until it is a whole loop long. The loop has no
+            // length as long as there is no dub, yet.
+            bool loopEnd = m_nrOfDubs > 0 && m_currentLoopIndex >= m_loopLength;
+            if (loopEnd || (m_state == LOOPER_STATE_RECORDING && contiguousFreeStorage() == 0 && !wrapStorage()))
+            {
+                // Reached the end of the loop, either because we exhausted storage
+                // or the end of the loop is there.
+                m_currentLoopIndex = 0;
+                m_loopCounter++;
+                switchScene();
+
+                // Stop the recording only, if we did not have the threshold, yet.
+                // That allows to start recording right at the start of the loop.
+                if (m_state == LOOPER_STATE_RECORDING && loopEnd && !m_recordingWrapped &&
+                    m_dubs[m_nrOfDubs].m_startIndex > 0)
+                    m_recordingWrapped = true;
+                else if (m_state == LOOPER_STATE_RECORDING)
+                    finishLoopRecording();
+            }
+            else if (m_recordingWrapped && m_currentLoopIndex >= m_dubs[m_nrOfDubs].m_startIndex)
+                finishLoopRecording();
+        }
+    }
+
+    /// Write the main outputs: the dry signal and the outputs of all tracks.
+    /// \param nrOfSamples The number of samples of the block.
+    void mixOutputs(uint32_t nrOfSamples)
+    {
+        for (uint32_t s = 0; s < nrOfSamples; ++s)
+        {
+            m_output1[s] = m_dryAmount * m_input1[s];
+            m_output2[s] = m_dryAmount * m_input2[s];
+        }
+        for (size_t k = 0; k < NR_OF_TRACKS; k++)
+        {
+            const float* output1 = m_trackOutputs.m_outputs1[k];
+            const float* output2 = m_trackOutputs.m_outputs2[k];
+            for (uint32_t s = 0; s < nrOfSamples; ++s)
+            {
+                m_output1[s] += output1[s];
+                m_output2[s] += output2[s];
+            }
+        }
+    }
+
+    /// Finish a recording which reached its full length in the loop.
+    void finishLoopRecording()
+    {
+        finishRecording();
+        if(*m_continuousDubParameter && m_nrOfDubs > 0)
+        {
+            // This is the second dub, meaning we're overdubbing so don't
+            // actually stop recording dubs until the user clicks the
+            // button again.
+            startRecording(m_track);
+        }
+    }
+
+    /// Record a chunk of the input, if recording. Also checks if the threshold is
+    /// reached when waiting for it. Silence longer than the configured gap is not
+    /// stored, instead the dub continues with a new segment once the threshold is
+    /// reached again.
+    /// \param offset The first sample of the chunk in the current block.
+    /// \param nrOfSamples The length of the chunk. Must fit into the storage.
+    void record(uint32_t offset, uint32_t nrOfSamples)
+    {
+        const float* input1 = m_input1 + offset;
+        const float* input2 = m_input2 + offset;
+        Dub& dub = m_dubs[m_nrOfDubs];
+
+        uint32_t s = 0;
+        if (m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
+        {
+            // Check if we reached the threshold to start recording.
+            while (s < nrOfSamples && fabs(input1[s]) < m_threshold && fabs(input2[s]) < m_threshold)
+                s++;
+            if (s == nrOfSamples)
+                return;
+            // The loop index only moves once there is a dub.
+            dub.m_startIndex = m_nrOfDubs > 0 ? m_currentLoopIndex + s : m_currentLoopIndex;
+            m_state = LOOPER_STATE_RECORDING;
+        }
+        if (m_state != LOOPER_STATE_RECORDING)
+            return;
+
+        // Splitting is only possible while there is still a free segment.
+        bool canSplit = m_gapSamples > 0 && dub.m_nrOfSegments < NR_OF_SEGMENTS;
+        size_t peakStart = m_nrOfUsedSamples;
+        for (; s < nrOfSamples; s++)
+        {
+            float in1 = input1[s];
+            float in2 = input2[s];
+            bool silent = fabsf(in1) < m_threshold && fabsf(in2) < m_threshold;
+            if (m_recordingGap)
+            {
+                if (silent)
+                {
+                    dub.m_length++;
+                    continue;
+                }
+                // Sound again, start a new segment.
+                Segment& segment = dub.m_segments[dub.m_nrOfSegments++];
+                segment.m_loopOffset = dub.m_length;
+                segment.m_storageOffset = m_nrOfUsedSamples;
+                segment.m_length = 0;
+                segment.m_continued = false;
+                m_recordingGap = false;
+                m_silentSamples = 0;
+                canSplit = m_gapSamples > 0 && dub.m_nrOfSegments < NR_OF_SEGMENTS;
+            }
+
+            Segment& segment = dub.m_segments[dub.m_nrOfSegments - 1];
+            m_storage1[m_nrOfUsedSamples] = in1;
+            m_storage2[m_nrOfUsedSamples] = in2;
+            m_nrOfUsedSamples++;
+            segment.m_length++;
+            dub.m_length++;
+
+            m_silentSamples = silent ? m_silentSamples + 1 : 0;
+            if (canSplit && m_silentSamples > m_gapSamples)
+            {
+                // End the segment where the silence started and reuse its memory.
+                segment.m_length -= m_silentSamples;
+                m_nrOfUsedSamples -= m_silentSamples;
+                if (m_nrOfUsedSamples < peakStart)
+                    peakStart = m_nrOfUsedSamples;
+                m_recordingGap = true;
+            }
+        }
+        updatePeaks(peakStart, m_nrOfUsedSamples);
+    }
+
+    /// Update the peak table for newly written storage. A peak block which is started
+    /// is reset, one which is continued keeps the previous peak. The peak may thus be
+    /// higher than the actual audio, but never lower.
+    /// \param start The first sample written.
+    /// \param end The sample after the last one written.
+    void updatePeaks(size_t start, size_t end)
+    {
+        while (start < end)
+        {
+            size_t block = start / PEAK_BLOCK_SIZE;
+            size_t blockEnd = (block + 1) * PEAK_BLOCK_SIZE;
+            if (blockEnd > end)
+                blockEnd = end;
+
+            float peak = start % PEAK_BLOCK_SIZE == 0 ? 0.0f : m_peaks[block];
+            for (size_t s = start; s < blockEnd; s++)
+            {
+                peak = fmaxf(peak, fabsf(m_storage1[s]));
+                peak = fmaxf(peak, fabsf(m_storage2[s]));
+            }
+            m_peaks[block] = peak;
+            start = blockEnd;
+        }
+    }
+
+    /// Record the audio played past the end of the first dub, right after it in the storage.
+    /// Once the whole tail is recorded, it becomes the end of the dub's last segment, so it
+    /// is played at the start of the loop, crossfaded with the start of the dub (see
+    /// EdgeFade). The audio of the dub itself is not changed.
+    /// \param offset The first sample of the chunk in the current block.
+    /// \param nrOfSamples The length of the chunk.
+    void recordTail(uint32_t offset, uint32_t nrOfSamples)
+    {
+        if (m_tailRecorded >= m_tailLength)
+            return;
+        Dub& dub = m_dubs[0];
+        if (m_nrOfDubs == 0 || dub.m_id != m_tailDubId || dub.storageEnd() != m_tailStorage)
+        {
+            // The loop was replaced, the tail does not continue it anymore.
+            m_tailLength = 0;
+            return;
+        }
+
+        size_t count = m_tailLength - m_tailRecorded < nrOfSamples ? m_tailLength - m_tailRecorded : nrOfSamples;
+        size_t index = m_tailStorage + m_tailRecorded;
+        memcpy(&m_storage1[index], &m_input1[offset], count * sizeof(float));
+        memcpy(&m_storage2[index], &m_input2[offset], count * sizeof(float));
+        updatePeaks(index, index + count);
+        m_tailRecorded += count;
+        if (m_tailRecorded < m_tailLength)
+            return;
+
+        dub.m_segments[dub.m_nrOfSegments - 1].m_length += m_tailLength;
+        dub.m_length += m_tailLength;
+        size_t end = (m_tailStorage + m_tailLength + PEAK_BLOCK_SIZE - 1) / PEAK_BLOCK_SIZE;
+        for (size_t block = m_tailStorage / PEAK_BLOCK_SIZE; block < end; block++)
+            dub.m_peak = fmaxf(dub.m_peak, m_peaks[block]);
+    }
+
+    /// Is the loop played at another speed, or still at a position between two samples?
+    /// Recording always plays it at its normal speed.
+    bool varispeed() const
+    {
+        return m_state == LOOPER_STATE_PLAYING && m_nrOfDubs > 0 && (m_speed != 1.0f || m_loopFraction != 0.0);
+    }
+
+    /// Play the loop at another speed or backwards. The position moves by the speed for
+    /// each sample. For each chunk the dubs are mixed into a bus covering the samples of
+    /// the loop passed, which is then read with a cubic interpolation. That way the cost
+    /// of the interpolation does not depend on the number of dubs. The gain ramps happen
+    /// in the time of the output, so the dubs whose gains change are mixed into two more
+    /// buses, see addVarispeedRamp.
+    /// \param nrOfSamples The number of samples of the block.
+    void playVarispeed(uint32_t nrOfSamples)
+    {
+        uint32_t offset = 0;
+        while (offset < nrOfSamples && m_nrOfDubs > 0)
+        {
+            uint32_t count = nrOfSamples - offset < VARISPEED_CHUNK ? nrOfSamples - offset : VARISPEED_CHUNK;
+            // Back at the normal speed, the position moves on to the next sample within the chunk.
+            double speed = m_speed == 1.0f && m_loopFraction != 0.0 ? 1.0 + (1.0 - m_loopFraction) / count : m_speed;
+            double position = m_currentLoopIndex + m_loopFraction;
+            double last = position + speed * (count - 1);
+            int64_t start = int64_t(floor(position < last ? position : last)) - 2;
+            uint32_t length = uint32_t(int64_t(floor(position < last ? last : position)) + 4 - start);
+
+            m_mixBuses = trackBuses(m_varispeedBus1, m_varispeedBus2, 0);
+            for (size_t k = 0; k < NR_OF_TRACKS; k++)
+            {
+                memset(m_varispeedBus1[k], 0, length * sizeof(float));
+                memset(m_varispeedBus2[k], 0, length * sizeof(float));
+            }
+            size_t loopCounter;
+            size_t loopIndex = loopIndexOf(start, loopCounter);
+            for (uint32_t busOffset = 0; busOffset < length; loopIndex = 0, loopCounter++)
+            {
+                uint32_t part = length - busOffset < m_loopLength - loopIndex ? length - busOffset :
+                    uint32_t(m_loopLength - loopIndex);
+                playDubs(loopCounter, loopIndex, busOffset, part, true);
+                busOffset += part;
+            }
+            // Only the tracks with dubs are interpolated, the others stay silent.
+            uint32_t tracks = usedTracks();
+            for (size_t k = 0; k < NR_OF_TRACKS; k++)
+            {
+                if ((tracks & (1u << k)) == 0)
+                    continue;
+                interpolate(m_varispeedBus1[k], position - start, speed, m_trackOutputs.m_outputs1[k] + offset, count);
+                interpolate(m_varispeedBus2[k], position - start, speed, m_trackOutputs.m_outputs2[k] + offset, count);
+            }
+
+            // The dubs whose gains change are mixed twice, with their gains at the start of
+            // the chunk and with the ones after it. Both mixes are interpolated and
+            // crossfaded over the chunk, so a ramp is followed linearly within the chunk.
+            uint32_t rampedTracks = 0;
+            for (size_t t = 0; t < m_nrOfDubs; t++)
+            {
+                GainRamp ramps[2];
+                size_t nrOfRamps = dubRamps(t, offset, 1.0f, ramps);
+                if (m_dubs[t].m_location == Dub::ON_FILE || constantRamps(ramps, nrOfRamps))
+                    continue;
+                GainRamp from;
+                GainRamp to;
+                from.m_target1 = from.m_target2 = to.m_target1 = to.m_target2 = 0.0f;
+                for (size_t r = 0; r < nrOfRamps; r++)
+                {
+                    float gain1, gain2;
+                    ramps[r].gainsAt(offset, gain1, gain2);
+                    from.m_target1 += gain1;
+                    from.m_target2 += gain2;
+                    ramps[r].gainsAt(offset + count, gain1, gain2);
+                    to.m_target1 += gain1;
+                    to.m_target2 += gain2;
+                }
+                size_t track = m_dubs[t].m_track;
+                clearVarispeedRamp(track, length, rampedTracks);
+                MixBus fromBus = m_mixBuses.track(track);
+                MixBus toBus = fromBus;
+                toBus.m_output1 = m_varispeedEnd1[track];
+                toBus.m_output2 = m_varispeedEnd2[track];
+                loopIndex = loopIndexOf(start, loopCounter);
+                for (uint32_t busOffset = 0; busOffset < length; loopIndex = 0)
+                {
+                    uint32_t part = length - busOffset < m_loopLength - loopIndex ? length - busOffset :
+                        uint32_t(m_loopLength - loopIndex);
+                    mixRepeatedDub(t, loopIndex, busOffset, part, from, fromBus);
+                    mixRepeatedDub(t, loopIndex, busOffset, part, to, toBus);
+                    busOffset += part;
+                }
+            }
+            // While the scenes are crossfaded, their buses ramp like the dubs.
+            for (size_t b = 0; b < 2 && !m_mixer.busesSettled(); b++)
+            {
+                const SceneBus* bus = m_mixedBuses[b];
+                GainRamp ramp = m_mixer.busRamp(offset, 1.0f, b == 0);
+                float from, to, unused;
+                ramp.gainsAt(offset, from, unused);
+                ramp.gainsAt(offset + count, to, unused);
+                for (size_t k = 0; k < NR_OF_TRACKS && bus != NULL; k++)
+                {
+                    if (bus->m_samples1[k] == NULL)
+                        continue;
+                    clearVarispeedRamp(k, length, rampedTracks);
+                    loopIndex = loopIndexOf(start, loopCounter);
+                    for (uint32_t busOffset = 0; busOffset < length; loopIndex = 0)
+                    {
+                        uint32_t part = length - busOffset < m_loopLength - loopIndex ? length - busOffset :
+                            uint32_t(m_loopLength - loopIndex);
+                        for (uint32_t s = 0; s < part; s++)
+                        {
+                            m_varispeedBus1[k][busOffset + s] += bus->m_samples1[k][loopIndex + s] * from;
+                            m_varispeedBus2[k][busOffset + s] += bus->m_samples2[k][loopIndex + s] * from;
+                            m_varispeedEnd1[k][busOffset + s] += bus->m_samples1[k][loopIndex + s] * to;
+                            m_varispeedEnd2[k][busOffset + s] += bus->m_samples2[k][loopIndex + s] * to;
+                        }
+                        busOffset += part;
+                    }
+                }
+            }
+            for (size_t k = 0; k < NR_OF_TRACKS; k++)
+            {
+                if ((rampedTracks & (1u << k)) == 0)
+                    continue;
+                addVarispeedRamp(m_varispeedBus1[k], m_varispeedEnd1[k], position - start, speed,
+                    m_trackOutputs.m_outputs1[k] + offset, count);
+                addVarispeedRamp(m_varispeedBus2[k], m_varispeedEnd2[k], position - start, speed,
+                    m_trackOutputs.m_outputs2[k] + offset, count);
+            }
+            m_mixBuses = m_trackOutputs;
+
+            // Rounding errors are dropped once the position is back at a whole sample.
+            double next = position + speed * count;
+            double whole = speed != m_speed ? floor(next + 0.5) : floor(next);
+            size_t pass = m_loopCounter;
+            m_loopFraction = speed != m_speed ? 0.0 : next - whole;
+            m_currentLoopIndex = loopIndexOf(int64_t(whole), m_loopCounter);
+            if (m_loopCounter != pass)
+                switchScene();
+            offset += count;
+            advanceGains(count);
+        }
+    }
+
+    /// Find a position in the loop which may be before the start or after the end of the
+    /// current pass.
+    /// \param position The position relative to the start of the current pass.
+    /// \param loopCounter Set to the pass of the loop the position is in.
+    /// \return The index in the loop.
+    size_t loopIndexOf(int64_t position, size_t& loopCounter) const
+    {
+        int64_t length = int64_t(m_loopLength);
+        int64_t passes = position >= 0 ? position / length : -((length - 1 - position) / length);
+        loopCounter = m_loopCounter + passes;
+        return size_t(position - passes * length);
+    }
+
+    /// Start the mixes of the dubs of a track whose gains change within the chunk played at
+    /// another speed, unless they are started already. The mix of the other dubs of the
+    /// track is interpolated already, so its bus is reused for the gains at the start.
+    /// \param track The track.
+    /// \param length The number of loop samples of the chunk.
+    /// \param startedTracks A bit for each track whose mixes are started already.
+    void clearVarispeedRamp(size_t track, uint32_t length, uint32_t& startedTracks)
+    {
+        if ((startedTracks & (1u << track)) != 0)
+            return;
+        startedTracks |= 1u << track;
+        memset(m_varispeedBus1[track], 0, length * sizeof(float));
+        memset(m_varispeedBus2[track], 0, length * sizeof(float));
+        memset(m_varispeedEnd1[track], 0, length * sizeof(float));
+        memset(m_varispeedEnd2[track], 0, length * sizeof(float));
+    }
+
+    /// Add a channel of the dubs whose gains change within a chunk played at another speed.
+    /// Both mixes are interpolated, and the output moves linearly from the one with the
+    /// gains at the start of the chunk to the one with the gains after it.
+    /// \param from The samples mixed with the gains at the start of the chunk.
+    /// \param to The samples mixed with the gains after the chunk.
+    /// \param position The position of the first output sample in the mixes.
+    /// \param speed The change of the position per sample.
+    /// \param output Where to add the samples to.
+    /// \param nrOfSamples The number of samples of the chunk.
+    void addVarispeedRamp(const float* from, const float* to, double position, double speed, float* output,
+        uint32_t nrOfSamples)
+    {
+        memset(m_varispeedFrom, 0, nrOfSamples * sizeof(float));
+        memset(m_varispeedTo, 0, nrOfSamples * sizeof(float));
+        interpolate(from, position, speed, m_varispeedFrom, nrOfSamples);
+        interpolate(to, position, speed, m_varispeedTo, nrOfSamples);
+        float step = 1.0f / nrOfSamples;
+        for (uint32_t s = 0; s < nrOfSamples; s++)
+            output[s] += m_varispeedFrom[s] + (m_varispeedTo[s] - m_varispeedFrom[s]) * (step * s);
+    }
+
+    /// Add samples read at a position which moves by the speed for each sample, with a
+    /// cubic (Catmull-Rom) interpolation of the four samples around it. There is no
+    /// dependency between the output samples, so the loop can be vectorized.
+    /// \param input The samples, at least one before and two after the ones passed.
+    /// \param position The position of the first output sample in the input.
+    /// \param speed The change of the position per sample, negative to read backwards.
+    /// \param output Where to add the samples to.
+    /// \param nrOfSamples The number of samples.
+    static void interpolate(const float* input, double position, double speed, float* output, uint32_t nrOfSamples)
+    {
+        for (uint32_t s = 0; s < nrOfSamples; s++)
+        {
+            double at = position + speed * s;
+            size_t index = size_t(at);
+            float fraction = float(at - double(index));
+            const float* x = input + index - 1;
+            float c1 = 0.5f * (x[2] - x[0]);
+            float c2 = x[0] - 2.5f * x[1] + 2.0f * x[2] - 0.5f * x[3];
+            float c3 = 0.5f * (x[3] - x[0]) + 1.5f * (x[1] - x[2]);
+            output[s] += ((c3 * fraction + c2) * fraction + c1) * fraction + x[1];
+        }
+    }
+
+    /// Is the loop played at another tempo? Recording always plays it at its normal tempo,
+    /// and another speed takes precedence.
+    bool stretched() const
+    {
+        return m_state == LOOPER_STATE_PLAYING && m_nrOfDubs > 0 && m_speed == 1.0f && m_tempoRatio != 1.0f;
+    }
+
+    /// Play the loop at another tempo without changing its pitch (WSOLA). The output is made
+    /// of grains of the loop which are twice as long as the hop between them and overlap
+    /// with a linear crossfade. The position of the grains in the loop moves by the tempo,
+    /// and each grain is placed near its position where it continues the grain before it
+    /// best. The grains are read from a ring the dubs are mixed into, so the cost of the
+    /// stretching does not depend on the number of dubs. The dubs are mixed into the ring
+    /// as fast as the loop is played, and the next grain is searched while the current one
+    /// is played, so each block takes the same share of the work.
+    /// \param nrOfSamples The number of samples of the block.
+    void playStretched(uint32_t nrOfSamples)
+    {
+        if (!m_stretching)
+            startStretch();
+
+        uint32_t offset = 0;
+        while (offset < nrOfSamples && m_nrOfDubs > 0)
+        {
+            if (m_stretchPlayed == STRETCH_HOP)
+                nextGrain();
+            uint32_t count = nrOfSamples - offset < STRETCH_HOP - m_stretchPlayed ? nrOfSamples - offset :
+                uint32_t(STRETCH_HOP - m_stretchPlayed);
+            double next = m_currentLoopIndex + m_loopFraction + double(m_tempoRatio) * count;
+            mixStretchRing(m_stretchPassStart + int64_t(next) + int64_t(STRETCH_LOOKAHEAD));
+            // Only needed when the tempo became slower during the hop
+            mixStretchRing(m_stretchGrain + int64_t(STRETCH_HOP + m_stretchPlayed + count));
+            playGrain(offset, count);
+            m_stretchPlayed += count;
+            searchGrain();
+
+            // The ring keeps the positions it was mixed at, also when the loop starts over.
+            double whole = floor(next);
+            size_t loopCounter = m_loopCounter;
+            m_loopFraction = next - whole;
+            m_currentLoopIndex = loopIndexOf(int64_t(whole), m_loopCounter);
+            m_stretchPassStart += int64_t(m_loopCounter - loopCounter) * int64_t(m_loopLength);
+            if (m_loopCounter != loopCounter)
+                switchScene();
+            offset += count;
+            advanceGains(count);
+        }
+        if (m_nrOfDubs == 0)
+            // All dubs were undone, the loop starts over once one is recorded or redone.
+            m_stretching = false;
+    }
+
+    /// Start playing the loop at another tempo at the current position. The grain before
+    /// the first one is the loop right before the position, so the first grain continues
+    /// what was played at the normal tempo.
+    void startStretch()
+    {
+        int64_t position = int64_t(m_currentLoopIndex);
+        m_stretching = true;
+        m_stretchPassStart = 0;
+        m_stretchMixed = position;
+        mixStretchRing(position + int64_t(STRETCH_LOOKAHEAD));
+        for (size_t s = 0; s < STRETCH_HOP; s++)
+        {
+            size_t index = size_t(position + int64_t(s)) & (STRETCH_RING_SIZE - 1);
+            float gain = FADE_TABLE.gain(FADE_LINEAR, STRETCH_HOP - s, STRETCH_HOP);
+            for (size_t k = 0; k < NR_OF_TRACKS; k++)
+            {
+                m_stretchTail1[k][s] = gain * m_stretchRing1[k][index];
+                m_stretchTail2[k][s] = gain * m_stretchRing2[k][index];
+            }
+        }
+        m_stretchGrain = position;
+        m_stretchPlayed = 0;
+        startSearch(position + int64_t(m_tempoRatio * STRETCH_HOP + 0.5f));
+    }
+
+    /// Stop playing the loop at another tempo. The loop continues within the current grain,
+    /// and the difference of the overlapping grains to it is faded out until the grain ends.
+    void finishStretch()
+    {
+        m_stretching = false;
+        m_residualLength = 0;
+        m_residualPlayed = 0;
+        if (m_nrOfDubs == 0)
+            return;
+
+        size_t pending = STRETCH_HOP - m_stretchPlayed;
+        int64_t position = m_stretchGrain + int64_t(m_stretchPlayed);
+        for (size_t s = 0; s < pending; s++)
+        {
+            size_t index = size_t(position + int64_t(s)) & (STRETCH_RING_SIZE - 1);
+            float gain = FADE_TABLE.gain(FADE_LINEAR, pending - s, pending);
+            float fadeIn = FADE_TABLE.gain(FADE_LINEAR, m_stretchPlayed + s, STRETCH_HOP);
+            for (size_t k = 0; k < NR_OF_TRACKS; k++)
+            {
+                float output1 = m_stretchTail1[k][m_stretchPlayed + s] + fadeIn * m_stretchRing1[k][index];
+                float output2 = m_stretchTail2[k][m_stretchPlayed + s] + fadeIn * m_stretchRing2[k][index];
+                m_stretchResidual1[k][s] = gain * (output1 - m_stretchRing1[k][index]);
+                m_stretchResidual2[k][s] = gain * (output2 - m_stretchRing2[k][index]);
+            }
+        }
+        m_residualLength = pending;
+        m_currentLoopIndex = loopIndexOf(position - m_stretchPassStart, m_loopCounter);
+        m_loopFraction = 0.0;
+    }
+
+    /// Add what is left of the difference faded out after playing at another tempo stopped.
+    /// \param nrOfSamples The number of samples of the block.
+    void addStretchResidual(uint32_t nrOfSamples)
+    {
+        size_t count = m_residualLength - m_residualPlayed < nrOfSamples ? m_residualLength - m_residualPlayed :
+            nrOfSamples;
+        for (size_t k = 0; k < NR_OF_TRACKS; k++)
+        {
+            float* output1 = m_trackOutputs.m_outputs1[k];
+            float* output2 = m_trackOutputs.m_outputs2[k];
+            for (size_t s = 0; s < count; s++)
+            {
+                output1[s] += m_stretchResidual1[k][m_residualPlayed + s];
+                output2[s] += m_stretchResidual2[k][m_residualPlayed + s];
+            }
+        }
+        m_residualPlayed += count;
+    }
+
+    /// Add a part of the current hop to the output: The first half of the current grain
+    /// fading in, crossfaded with the end of the grain before. The end of the current grain
+    /// is kept for the next hop instead.
+    /// \param offset The first sample in the output.
+    /// \param nrOfSamples The number of samples, up to the end of the hop.
+    void playGrain(uint32_t offset, uint32_t nrOfSamples)
+    {
+        for (uint32_t s = 0; s < nrOfSamples; s++)
+        {
+            size_t hopIndex = m_stretchPlayed + s;
+            size_t index = size_t(m_stretchGrain + int64_t(hopIndex)) & (STRETCH_RING_SIZE - 1);
+            size_t tailIndex = size_t(m_stretchGrain + int64_t(STRETCH_HOP + hopIndex)) & (STRETCH_RING_SIZE - 1);
+            float fadeIn = FADE_TABLE.gain(FADE_LINEAR, hopIndex, STRETCH_HOP);
+            float fadeOut = FADE_TABLE.gain(FADE_LINEAR, STRETCH_HOP - hopIndex, STRETCH_HOP);
+            for (size_t k = 0; k < NR_OF_TRACKS; k++)
+            {
+                float* output1 = m_trackOutputs.m_outputs1[k] + offset;
+                float* output2 = m_trackOutputs.m_outputs2[k] + offset;
+                output1[s] += m_stretchTail1[k][hopIndex] + fadeIn * m_stretchRing1[k][index];
+                output2[s] += m_stretchTail2[k][hopIndex] + fadeIn * m_stretchRing2[k][index];
+                m_stretchTail1[k][hopIndex] = fadeOut * m_stretchRing1[k][tailIndex];
+                m_stretchTail2[k][hopIndex] = fadeOut * m_stretchRing2[k][tailIndex];
+            }
+        }
+    }
+
+    /// Continue with the grain found during the hop which ended, and start searching the
+    /// one after it where the loop will be after the next hop.
+    void nextGrain()
+    {
+        m_stretchGrain = m_searchPosition + m_searchBest;
+        m_stretchPlayed = 0;
+        startSearch(m_stretchPassStart + int64_t(m_currentLoopIndex) + int64_t(m_tempoRatio * STRETCH_HOP + 0.5f));
+    }
+
+    /// Start searching where near its position the next grain continues the current one best.
+    /// \param position The position of the next grain in the loop.
+    void startSearch(int64_t position)
+    {
+        m_searchPosition = position;
+        m_searchCandidate = 0;
+        m_searchWork = 0;
+        m_searchBest = 0;
+        m_searchBestSimilarity = -FLT_MAX;
+    }
+
+    /// Compare as many offsets of the next grain as are due for the part of the hop played,
+    /// so the search is done when the hop ends. Every STRETCH_SEARCH_STEP-th offset is
+    /// compared first, then the offsets around the best one.
+    void searchGrain()
+    {
+        const size_t coarseWork = STRETCH_HOP / STRETCH_SEARCH_STEP;
+        const size_t totalWork = STRETCH_COARSE_CANDIDATES * coarseWork + STRETCH_FINE_CANDIDATES * STRETCH_HOP;
+        size_t dueWork = totalWork * m_stretchPlayed / STRETCH_HOP;
+        int64_t continuation = m_stretchGrain + int64_t(STRETCH_HOP);
+        while (m_searchWork < dueWork)
+        {
+            int64_t offset;
+            int64_t preferred;
+            size_t step;
+            if (m_searchCandidate < STRETCH_COARSE_CANDIDATES)
+            {
+                offset = int64_t(m_searchCandidate * STRETCH_SEARCH_STEP) - int64_t(STRETCH_SEARCH);
+                preferred = 0;
+                step = STRETCH_SEARCH_STEP;
+            }
+            else
+            {
+                if (m_searchCandidate == STRETCH_COARSE_CANDIDATES)
+                {
+                    m_searchCoarse = m_searchBest;
+                    m_searchBestSimilarity = -FLT_MAX;
+                }
+                offset = m_searchCoarse + int64_t(m_searchCandidate - STRETCH_COARSE_CANDIDATES) -
+                    int64_t(STRETCH_SEARCH_STEP - 1);
+                preferred = m_searchCoarse;
+                step = 1;
+            }
+            // Only needed when the tempo became slower during the hop
+            mixStretchRing(m_searchPosition + offset + int64_t(STRETCH_HOP));
+            float value = similarity(m_searchPosition + offset, continuation, step);
+            if (value > m_searchBestSimilarity || (value == m_searchBestSimilarity && offset == preferred))
+            {
+                m_searchBest = offset;
+                m_searchBestSimilarity = value;
+            }
+            m_searchCandidate++;
+            m_searchWork += STRETCH_HOP / step;
+        }
+    }
+
+    /// How similar is the sum of both channels of all tracks at a position in the ring to
+    /// the one at another position? The correlation over a hop is divided by the root of the energy
+    /// at the position, so loud positions are not preferred.
+    /// \param position The position compared.
+    /// \param reference The position compared to.
+    /// \param step Only every step-th sample is compared.
+    float similarity(int64_t position, int64_t reference, size_t step) const
+    {
+        float correlation = 0.0f;
+        float energy = 0.0f;
+        for (size_t s = 0; s < STRETCH_HOP; s += step)
+        {
+            size_t index = size_t(position + int64_t(s)) & (STRETCH_RING_SIZE - 1);
+            size_t referenceIndex = size_t(reference + int64_t(s)) & (STRETCH_RING_SIZE - 1);
+            float sample = m_stretchSum[index];
+            correlation += sample * m_stretchSum[referenceIndex];
+            energy += sample * sample;
+        }
+        return correlation / sqrtf(energy + SILENCE_FLOOR * SILENCE_FLOOR);
+    }
+
+    /// Mix the dubs into the ring up to a position. Each sample is mixed once, with the
+    /// gains the dubs have when it is mixed, so a gain change is heard STRETCH_LOOKAHEAD
+    /// loop samples later. The gain ramps start at the first sample mixed and are stretched
+    /// by the tempo. As the ring is mixed as fast as the loop is played, they continue from
+    /// one block to the next and take as long in the output as at the normal tempo.
+    /// \param end The position after the last one needed.
+    void mixStretchRing(int64_t end)
+    {
+        int64_t first = m_stretchMixed;
+        m_rampStretch = m_tempoRatio;
+        while (m_stretchMixed < end && m_nrOfDubs > 0)
+        {
+            size_t ringIndex = size_t(m_stretchMixed) & (STRETCH_RING_SIZE - 1);
+            size_t loopCounter;
+            size_t loopIndex = loopIndexOf(m_stretchMixed - m_stretchPassStart, loopCounter);
+            uint32_t count = uint32_t(end - m_stretchMixed);
+            if (STRETCH_RING_SIZE - ringIndex < count)
+                count = uint32_t(STRETCH_RING_SIZE - ringIndex);
+            if (m_loopLength - loopIndex < count)
+                count = uint32_t(m_loopLength - loopIndex);
+
+            m_mixBuses = trackBuses(m_stretchRing1, m_stretchRing2, ringIndex);
+            for (size_t k = 0; k < NR_OF_TRACKS; k++)
+            {
+                memset(m_mixBuses.m_outputs1[k], 0, count * sizeof(float));
+                memset(m_mixBuses.m_outputs2[k], 0, count * sizeof(float));
+            }
+            m_rampAhead = m_stretchMixed - first;
+            playDubs(loopCounter, loopIndex, 0, count, false);
+            for (size_t s = ringIndex; s < ringIndex + count; s++)
+            {
+                float sum = 0.0f;
+                for (size_t k = 0; k < NR_OF_TRACKS; k++)
+                    sum += m_stretchRing1[k][s] + m_stretchRing2[k][s];
+                m_stretchSum[s] = sum;
+            }
+            m_stretchMixed += count;
+        }
+        m_mixBuses = m_trackOutputs;
+        m_rampStretch = 1.0f;
+        m_rampAhead = 0;
+    }
+
+    /// Add all active dubs to the output for a chunk of the current block. The chunk
+    /// must not cross the end of the loop.
+    /// \param loopCounter The pass of the loop.
+    /// \param loopIndex The first sample in the loop.
+    /// \param offset The first sample of the chunk in the output.
+    /// \param nrOfSamples The length of the chunk.
+    /// \param settledOnly Leave out the dubs which are not on file and whose gain is changing?
+    void playDubs(size_t loopCounter, size_t loopIndex, uint32_t offset, uint32_t nrOfSamples, bool settledOnly)
+    {
+        // The gain ramps start with the chunk, or earlier if the dubs are mixed ahead.
+        uint32_t rampStart = uint32_t(int64_t(offset) - m_rampAhead);
+        selectSceneBuses();
+        addSceneBuses(loopIndex, offset, nrOfSamples, rampStart, settledOnly);
+        if (m_nrOfFileDubs == 0)
+        {
+            mixDubs(loopIndex, offset, nrOfSamples, 0, settledOnly, rampStart);
+            return;
+        }
+
+        // The dubs on file come mixed from the reader thread, one block at a time. If a
+        // block was not read in time, the dubs missing in it are silent.
+        while (nrOfSamples > 0)
+        {
+            uint32_t count = uint32_t(TIERING_BLOCK_SIZE - loopIndex % TIERING_BLOCK_SIZE);
+            if (count > nrOfSamples)
+                count = nrOfSamples;
+            size_t firstDub = m_tieringFile.mix(loopCounter, loopIndex, m_loopLength, count, m_tieringGeneration,
+                m_nrOfDubs, m_mixBuses, offset);
+            mixDubs(loopIndex, offset, count, firstDub, settledOnly, rampStart);
+            loopIndex += count;
+            offset += count;
+            nrOfSamples -= count;
+        }
+    }
+
+    /// Add the active dubs which are not on file to the output.
+    /// \param loopIndex The first sample in the loop.
+    /// \param offset The first sample in the output.
+    /// \param nrOfSamples The number of samples.
+    /// \param firstDub The first dub to add, the ones before are added already.
+    /// \param settledOnly Leave out the dubs whose gain is changing?
+    /// \param rampStart The sample in the output where the gain ramps start.
+    void mixDubs(size_t loopIndex, uint32_t offset, uint32_t nrOfSamples, size_t firstDub, bool settledOnly,
+        uint32_t rampStart)
+    {
+        size_t nrOfDubs = m_nrOfDubs > firstDub ? m_nrOfDubs - firstDub : 0;
+        uint32_t round = 0;
+        if (m_mixingThreads.running() && nrOfDubs >= MIXING_MIN_DUBS && nrOfSamples >= MIXING_MIN_SAMPLES &&
+            offset + nrOfSamples <= MIXING_BUFFER_SIZE)
+            round = m_mixingThreads.nextRound();
+        if (round == 0)
+        {
+            mixDubRange(firstDub, m_nrOfDubs, loopIndex, offset, nrOfSamples, settledOnly, rampStart, m_mixBuses);
+            return;
+        }
+
+        // The jobs only read the copy made for their round, a thread which is late may
+        // still read the one of the round before.
+        MixJob& mixJob = m_mixJobs[round % 2];
+        mixJob.m_loopIndex = loopIndex;
+        mixJob.m_offset = offset;
+        mixJob.m_nrOfSamples = nrOfSamples;
+        mixJob.m_firstDub = firstDub;
+        mixJob.m_endDub = m_nrOfDubs;
+        mixJob.m_source = m_mixSource;
+        mixJob.m_source.m_dubs = mixJob.m_dubs;
+        for (size_t t = firstDub; t < m_nrOfDubs; t++)
+        {
+            mixJob.m_nrOfRamps[t] = 0;
+            if (m_dubs[t].m_location == Dub::ON_FILE)
+                continue;
+            size_t nrOfRamps = dubRamps(t, rampStart, m_rampStretch, mixJob.m_ramps[t]);
+            if (settledOnly && !constantRamps(mixJob.m_ramps[t], nrOfRamps))
+                continue;
+            mixJob.m_nrOfRamps[t] = nrOfRamps;
+            if (nrOfRamps > 0)
+                copyForMixing(m_dubs[t], mixJob.m_dubs[t]);
+        }
+        m_mixingThreads.mix(round, (nrOfDubs + MIXING_DUBS_PER_JOB - 1) / MIXING_DUBS_PER_JOB, m_mixBuses, offset,
+            nrOfSamples);
+    }
+
+    /// Add a job of the dubs mixed by several threads to the buses, see mixDubs. Called
+    /// from the audio thread and the mixing threads.
+    /// \param job The index of the job.
+    /// \param round The round of the job, which selects the copy of the dubs it mixes.
+    /// \param buses Where to add the dubs of each track to.
+    void mixJob(size_t job, uint32_t round, const TrackBuses& buses)
+    {
+        const MixJob& mixJob = m_mixJobs[round % 2];
+        TrackBuses copyBuses = buses;
+        copyBuses.m_source = &mixJob.m_source;
+        size_t firstDub = mixJob.m_firstDub + job * MIXING_DUBS_PER_JOB;
+        size_t endDub = firstDub + MIXING_DUBS_PER_JOB < mixJob.m_endDub ? firstDub + MIXING_DUBS_PER_JOB :
+            mixJob.m_endDub;
+        for (size_t t = firstDub; t < endDub; t++)
+        {
+            for (size_t r = 0; r < mixJob.m_nrOfRamps[t]; r++)
+                mixRepeatedDub(t, mixJob.m_loopIndex, mixJob.m_offset, mixJob.m_nrOfSamples, mixJob.m_ramps[t][r],
+                    copyBuses.track(mixJob.m_dubs[t].m_track));
+        }
+    }
+
+    /// Copy what mixing a dub reads of it, only the segments used.
+    /// \param dub The dub.
+    /// \param copy Set to the copy.
+    static void copyForMixing(const Dub& dub, Dub& copy)
+    {
+        copy.m_length = dub.m_length;
+        copy.m_startIndex = dub.m_startIndex;
+        copy.m_period = dub.m_period;
+        copy.m_id = dub.m_id;
+        copy.m_track = dub.m_track;
+        copy.m_location = dub.m_location;
+        copy.m_fades = dub.m_fades;
+        copy.m_nrOfSegments = dub.m_nrOfSegments;
+        for (size_t g = 0; g < dub.m_nrOfSegments; g++)
+            copy.m_segments[g] = dub.m_segments[g];
+    }
+
+    /// Update what the audio thread mixes the dubs from, see MixSource. Called at the start
+    /// of each block, the storage and the fades do not change within it.
+    void updateMixSource()
+    {
+        m_mixSource.m_dubs = m_dubs;
+        m_mixSource.m_storage1 = m_storage1;
+        m_mixSource.m_storage2 = m_storage2;
+        m_mixSource.m_peaks = m_peaks;
+        m_mixSource.m_compressionPool = m_compressionPool;
+        m_mixSource.m_fadeLength = m_fadeLength;
+        m_mixSource.m_fadeShape = m_fadeShape;
+        m_mixSource.m_movingDub = m_movingDub;
+        m_mixSource.m_movingId = m_movingId;
+        m_mixSource.m_movingDestination = m_movingDestination;
+        m_mixSource.m_movedSamples = m_movedSamples;
+    }
+
+    /// Add a range of the active dubs which are not on file to the buses of their tracks.
+    /// \param firstDub The first dub to add.
+    /// \param endDub The dub after the last one to add.
+    /// \param loopIndex The first sample in the loop.
+    /// \param offset The first sample in the output.
+    /// \param nrOfSamples The number of samples.
+    /// \param settledOnly Leave out the dubs whose gain is changing?
+    /// \param rampStart The sample in the output where the gain ramps start.
+    /// \param buses Where to add the dubs of each track to.
+    void mixDubRange(size_t firstDub, size_t endDub, size_t loopIndex, uint32_t offset, uint32_t nrOfSamples,
+        bool settledOnly, uint32_t rampStart, const TrackBuses& buses)
+    {
+        for (size_t t = firstDub; t < endDub; t++)
+        {
+            if (m_dubs[t].m_location == Dub::ON_FILE)
+                continue;
+            GainRamp ramps[2];
+            size_t nrOfRamps = dubRamps(t, rampStart, m_rampStretch, ramps);
+            if (settledOnly && !constantRamps(ramps, nrOfRamps))
+                continue;
+            for (size_t r = 0; r < nrOfRamps; r++)
+                mixRepeatedDub(t, loopIndex, offset, nrOfSamples, ramps[r], buses.track(m_dubs[t].m_track));
+        }
+    }
+
+    /// Select the scene buses added to the output: the one of the scene played and, while
+    /// the scenes are crossfaded, the one faded out. A bus is left out once any of its
+    /// dubs was changed, e.g. deleted or moved to the file.
+    void selectSceneBuses()
+    {
+        if (m_mixer.busesSettled())
+            m_fadedBus = NULL;
+        SceneBus* played = m_sceneBuses[m_mixer.scene()];
+        m_mixedBuses[0] = played != NULL && sceneBusValid(*played) ? played : NULL;
+        m_mixedBuses[1] = m_fadedBus != NULL && sceneBusValid(*m_fadedBus) ? m_fadedBus : NULL;
+    }
+
+    /// Add the scene buses selected to the output.
+    /// \param loopIndex The first sample in the loop.
+    /// \param offset The first sample in the output.
+    /// \param nrOfSamples The number of samples.
+    /// \param rampStart The sample in the output where the crossfade starts.
+    /// \param settledOnly Leave out the buses while they are crossfaded?
+    void addSceneBuses(size_t loopIndex, uint32_t offset, uint32_t nrOfSamples, uint32_t rampStart,
+        bool settledOnly)
+    {
+        if (settledOnly && !m_mixer.busesSettled())
+            return;
+        for (size_t b = 0; b < 2; b++)
+        {
+            const SceneBus* bus = m_mixedBuses[b];
+            if (bus == NULL)
+                continue;
+            GainRamp ramp = m_mixer.busRamp(rampStart, m_rampStretch, b == 0);
+            for (size_t k = 0; k < NR_OF_TRACKS; k++)
+            {
+                if (bus->m_samples1[k] != NULL)
+                    addSamples(&bus->m_samples1[k][loopIndex], &bus->m_samples2[k][loopIndex], offset, nrOfSamples,
+                        ramp, NULL, m_mixBuses.track(k));
+            }
+        }
+    }
+
+    /// The gain ramps a dub is added with on top of the scene buses selected. That is its
+    /// own ramp minus the gains it has in the buses, so the sum is the same as without
+    /// them. A dub which is played with the gains of the buses is not added at all.
+    /// \param dubIndex The index of the dub.
+    /// \param start The first sample of the chunk in the output.
+    /// \param stretch See DubMixer::ramp.
+    /// \param ramps Set to the ramps.
+    /// \return The number of ramps, 0 if nothing of the dub is heard on top of the buses.
+    size_t dubRamps(size_t dubIndex, uint32_t start, float stretch, GainRamp (&ramps)[2]) const
+    {
+        GainRamp ramp = m_mixer.ramp(dubIndex, start, stretch);
+        const SceneBus* played = m_mixedBuses[0];
+        const SceneBus* faded = m_mixedBuses[1];
+        if (played == NULL && faded == NULL)
+        {
+            ramps[0] = ramp;
+            return m_mixer.silent(dubIndex) ? 0 : 1;
+        }
+        if (m_mixer.followsBuses(dubIndex) && played == m_followedBuses[0] && faded == m_followedBuses[1])
+            return 0;
+
+        // The buses add the dub with gains ramping like the crossfade.
+        float to1 = played != NULL && played->mixed(dubIndex) ? played->m_gains1[dubIndex] : 0.0f;
+        float to2 = played != NULL && played->mixed(dubIndex) ? played->m_gains2[dubIndex] : 0.0f;
+        float from1 = faded != NULL && faded->mixed(dubIndex) ? faded->m_gains1[dubIndex] : 0.0f;
+        float from2 = faded != NULL && faded->mixed(dubIndex) ? faded->m_gains2[dubIndex] : 0.0f;
+        GainRamp reference = m_mixer.busRamp(start, stretch, true);
+        if (reference.m_length == 0 || (from1 == to1 && from2 == to2))
+        {
+            ramp.m_gain1 -= to1;
+            ramp.m_gain2 -= to2;
+            ramp.m_target1 -= to1;
+            ramp.m_target2 -= to2;
+            ramps[0] = ramp;
+            return silentRamp(ramp) ? 0 : 1;
+        }
+        reference.m_gain1 = from1 + (to1 - from1) * reference.m_gain1;
+        reference.m_gain2 = from2 + (to2 - from2) * reference.m_gain2;
+        reference.m_step1 *= to1 - from1;
+        reference.m_step2 *= to2 - from2;
+        reference.m_target1 = to1;
+        reference.m_target2 = to2;
+        if (ramp.m_length == reference.m_length)
+        {
+            ramp.m_gain1 -= reference.m_gain1;
+            ramp.m_gain2 -= reference.m_gain2;
+            ramp.m_step1 -= reference.m_step1;
+            ramp.m_step2 -= reference.m_step2;
+            ramp.m_target1 -= to1;
+            ramp.m_target2 -= to2;
+            ramps[0] = ramp;
+            return silentRamp(ramp) ? 0 : 1;
+        }
+        size_t nrOfRamps = 0;
+        if (!m_mixer.silent(dubIndex))
+            ramps[nrOfRamps++] = ramp;
+        reference.m_gain1 = -reference.m_gain1;
+        reference.m_gain2 = -reference.m_gain2;
+        reference.m_step1 = -reference.m_step1;
+        reference.m_step2 = -reference.m_step2;
+        reference.m_target1 = -to1;
+        reference.m_target2 = -to2;
+        ramps[nrOfRamps++] = reference;
+        return nrOfRamps;
+    }
+
+    /// Are both gains of a ramp 0 all along?
+    static bool silentRamp(const GainRamp& ramp)
+    {
+        return ramp.m_gain1 == 0.0f && ramp.m_gain2 == 0.0f && ramp.m_target1 == 0.0f && ramp.m_target2 == 0.0f;
+    }
+
+    /// Are the gains of all ramps constant, see dubRamps?
+    static bool constantRamps(const GainRamp* ramps, size_t nrOfRamps)
+    {
+        for (size_t r = 0; r < nrOfRamps; r++)
+        {
+            if (ramps[r].m_length > 0)
+                return false;
+        }
+        return true;
+    }
+
+    /// The buses of the tracks in arrays with one for each track.
+    /// \param buses1 The first channel of each track.
+    /// \param buses2 The second channel of each track.
+    /// \param offset The first sample in the arrays.
+    template <size_t SIZE>
+    TrackBuses trackBuses(float (&buses1)[NR_OF_TRACKS][SIZE], float (&buses2)[NR_OF_TRACKS][SIZE],
+        size_t offset) const
+    {
+        TrackBuses buses;
+        for (size_t k = 0; k < NR_OF_TRACKS; k++)
+        {
+            buses.m_outputs1[k] = buses1[k] + offset;
+            buses.m_outputs2[k] = buses2[k] + offset;
+        }
+        buses.m_decoded1 = NULL;
+        buses.m_decoded2 = NULL;
+        buses.m_source = &m_mixSource;
+        return buses;
+    }
+
+    /// The tracks which have active dubs, a bit for each.
+    uint32_t usedTracks() const
+    {
+        uint32_t tracks = 0;
+        for (size_t t = 0; t < m_nrOfDubs; t++)
+            tracks |= 1u << m_dubs[t].m_track;
+        return tracks;
+    }
+
+    /// Add a dub to the output, wherever it is within its period.
+    /// \param dubIndex The index of the dub.
+    /// \param loopIndex The first sample in the loop.
+    /// \param offset The first sample in the output.
+    /// \param nrOfSamples The number of samples.
+    /// \param ramp The gain of the dub.
+    /// \param bus Where to add the dub to.
+    void mixRepeatedDub(size_t dubIndex, size_t loopIndex, uint32_t offset, uint32_t nrOfSamples,
+        const GainRamp& ramp, const MixBus& bus)
+    {
+        // A dub recorded before the loop was multiplied repeats within it.
+        const Dub& dub = bus.m_source->m_dubs[dubIndex];
+        size_t index = loopIndex % dub.m_period;
+        uint32_t start = 0;
+        while (start < nrOfSamples)
+        {
+            uint32_t count = nrOfSamples - start;
+            if (dub.m_period - index < count)
+                count = uint32_t(dub.m_period - index);
+            mixDub(dubIndex, index, offset + start, count, ramp, bus);
+            if (dub.m_startIndex + dub.m_length > dub.m_period)
+                // The dub was recorded across the end of the loop, its end plays at the start.
+                mixDub(dubIndex, index + dub.m_period, offset + start, count, ramp, bus);
+            start += count;
+            index = 0;
+        }
+    }
+
+    /// Add a part of a dub to the output.
+    /// \param dubIndex The index of the dub.
+    /// \param loopIndex The first sample within the period of the dub, plus the period for
+    /// the part of a dub which continued at the start of the loop.
+    /// \param offset The first sample in the output.
+    /// \param nrOfSamples The number of samples. They must not cross the end of the period.
+    /// \param ramp The gain of the dub.
+    /// \param bus Where to add the dub to.
+    void mixDub(size_t dubIndex, size_t loopIndex, uint32_t offset, uint32_t nrOfSamples, const GainRamp& ramp,
+        const MixBus& bus)
+    {
+        const MixSource& source = *bus.m_source;
+        const Dub& dub = source.m_dubs[dubIndex];
+        size_t loopStart = loopIndex;
+        size_t loopEnd = loopIndex + nrOfSamples;
+        if (dub.m_startIndex >= loopEnd || dub.m_startIndex + dub.m_length <= loopStart)
+            return;
+
+        for (size_t g = 0; g < dub.m_nrOfSegments; g++)
+        {
+            const Segment& segment = dub.m_segments[g];
+            size_t segmentStart = dub.m_startIndex + segment.m_loopOffset;
+            size_t start = segmentStart > loopStart ? segmentStart : loopStart;
+            size_t end = segmentStart + segment.m_length < loopEnd ? segmentStart + segment.m_length : loopEnd;
+            if (start >= end)
+                continue;
+
+            // Only the samples at the edges are faded, the ones between are mixed as they are.
+            EdgeFade fade = EdgeFade::forSegment(dub, g, source.m_fadeLength, source.m_fadeShape);
+            fade.m_offset = int64_t(loopStart) - int64_t(offset) - int64_t(dub.m_startIndex);
+            // The rest of a tail after its crossfade is silent.
+            if (end > dub.m_startIndex + fade.m_end)
+                end = dub.m_startIndex + fade.m_end;
+            size_t fadeInEnd = dub.m_startIndex + fade.m_start + fade.m_inLength;
+            size_t fadeOutStart = dub.m_startIndex + fade.m_end - fade.m_outLength;
+            mixSegment(dubIndex, g, start, end < fadeInEnd ? end : fadeInEnd, loopStart, offset, ramp, &fade, bus);
+            mixSegment(dubIndex, g, start > fadeInEnd ? start : fadeInEnd, end < fadeOutStart ? end : fadeOutStart,
+                loopStart, offset, ramp, NULL, bus);
+            mixSegment(dubIndex, g, start > fadeOutStart ? start : fadeOutStart, end, loopStart, offset, ramp,
+                &fade, bus);
+        }
+    }
+
+    /// Add a range of a segment to the output, wherever its audio is kept.
+    /// \param dubIndex The index of the dub.
+    /// \param segmentIndex The index of the segment in the dub.
+    /// \param start The first sample in the loop, nothing is added if it is not before the end.
+    /// \param end The sample after the last one in the loop.
+    /// \param loopStart The sample in the loop which is played at the offset.
+    /// \param offset The first sample of the chunk in the output.
+    /// \param ramp The gain of the dub.
+    /// \param fade The fades of the segment, or NULL if the range is not faded.
+    /// \param bus Where to add the segment to.
+    void mixSegment(size_t dubIndex, size_t segmentIndex, size_t start, size_t end, size_t loopStart,
+        uint32_t offset, const GainRamp& ramp, const EdgeFade* fade, const MixBus& bus)
+    {
+        if (start >= end)
+            return;
+        const MixSource& source = *bus.m_source;
+        const Dub& dub = source.m_dubs[dubIndex];
+        const Segment& segment = dub.m_segments[segmentIndex];
+        size_t segmentStart = dub.m_startIndex + segment.m_loopOffset;
+        if (dub.m_location == Dub::COMPRESSED)
+        {
+            mixCompressed(dubIndex, segmentIndex, start - segmentStart, offset + (start - loopStart), end - start,
+                ramp, fade, bus);
+            return;
+        }
+        size_t index = segment.m_storageOffset + (start - segmentStart);
+        offset += uint32_t(start - loopStart);
+        size_t length = end - start;
+        if (dubIndex == source.m_movingDub && dub.m_id == source.m_movingId)
+        {
+            // The part of the dub which is moved already may be overwritten where it was
+            // before. The peaks of where it was moved to are not all computed yet, so none
+            // of it is skipped.
+            size_t from = dub.m_segments[0].m_storageOffset;
+            size_t moved = from + source.m_movedSamples > index ? from + source.m_movedSamples - index : 0;
+            if (moved > length)
+                moved = length;
+            size_t movedIndex = source.m_movingDestination + (index - from);
+            if (moved > 0)
+                addSamples(source.m_storage1 + movedIndex, source.m_storage2 + movedIndex, offset, moved, ramp,
+                    fade, bus);
+            index += moved;
+            offset += uint32_t(moved);
+            length -= moved;
+        }
+        mixStorage(index, offset, length, ramp, fade, bus);
+    }
+
+    /// Move the gains of the dubs towards their targets and deactivate the undone dubs
+    /// once they are faded out. While recording, the undone dubs kept for redoing them on
+    /// another track stay before the recorded one.
+    /// \param nrOfSamples The number of samples played.
+    void advanceGains(uint32_t nrOfSamples)
+    {
+        m_mixer.advance(m_nrOfDubs, nrOfSamples);
+        if (m_restorePending)
+        {
+            // The dubs stay in their slots until the snapshot replaces them.
+            if (fadeOutForRestore())
+                applySnapshot();
+            return;
+        }
+        if (m_state == LOOPER_STATE_RECORDING || m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
+            return;
+        while (m_nrOfDubs > 0 && !m_mixer.active(m_nrOfDubs - 1) && m_mixer.settled(m_nrOfDubs - 1))
+            removeDub();
+    }
+
+    /// Crossfade to the scene selected, if it is not played already. Called at the start
+    /// of the loop, or right away if no loop is played. The bus of the scene played so far
+    /// is crossfaded with the one of the next scene, the dubs whose gains ramp the same way
+    /// are left out meanwhile. Only the others are mixed on their own. The switch waits
+    /// for a later start of the loop until both buses are mixed, see sceneSwitchReady.
+    void switchScene()
+    {
+        if (m_nextScene == m_mixer.scene() || !sceneSwitchReady())
+            return;
+        selectSceneBuses();
+        SceneBus* faded = m_mixedBuses[0];
+        m_mixer.setScene(m_nextScene);
+        m_fadedBus = faded;
+        selectSceneBuses();
+        m_followedBuses[0] = m_mixedBuses[0];
+        m_followedBuses[1] = m_mixedBuses[1];
+        const SceneBus* played = m_mixedBuses[0];
+        for (size_t t = 0; t < m_nrOfDubs && (played != NULL || faded != NULL); t++)
+        {
+            bool from = faded != NULL && faded->mixed(t);
+            bool to = played != NULL && played->mixed(t);
+            m_mixer.followBuses(t, from ? faded->m_gains1[t] : 0.0f, from ? faded->m_gains2[t] : 0.0f,
+                to ? played->m_gains1[t] : 0.0f, to ? played->m_gains2[t] : 0.0f);
+        }
+        m_tieringGainsChanged = true;
+    }
+
+    /// Add a range of the storage to the output, skipping all peak blocks which are
+    /// below the silence floor.
+    /// \param index The first sample in the storage.
+    /// \param offset The first sample in the output.
+    /// \param length The number of samples.
+    /// \param ramp The gain of the dub.
+    /// \param fade The fades of the segment, or NULL if the range is not faded.
+    /// \param bus Where to add the samples to.
+    void mixStorage(size_t index, uint32_t offset, size_t length, const GainRamp& ramp, const EdgeFade* fade,
+        const MixBus& bus)
+    {
+        const MixSource& source = *bus.m_source;
+        while (length > 0)
+        {
+            size_t block = index / PEAK_BLOCK_SIZE;
+            size_t count = (block + 1) * PEAK_BLOCK_SIZE - index;
+            if (count > length)
+                count = length;
+
+            if (source.m_peaks[block] >= SILENCE_FLOOR)
+                addSamples(source.m_storage1 + index, source.m_storage2 + index, offset, count, ramp, fade, bus);
+            index += count;
+            offset += count;
+            length -= count;
+        }
+    }
+
+    /// Add samples to the output with the gains of a dub. The ramp and the constant gains
+    /// after it are handled by separate loops, so there is no branch per sample. Only the
+    /// few samples at the edges of a segment are faded, with a gain per sample.
+    /// \param input1 The first channel.
+    /// \param input2 The second channel.
+    /// \param offset The first sample in the output.
+    /// \param length The number of samples.
+    /// \param ramp The gain of the dub.
+    /// \param fade The fades of the segment, or NULL if the samples are not faded.
+    /// \param bus Where to add the samples to.
+    void addSamples(const float* input1, const float* input2, uint32_t offset, size_t length, const GainRamp& ramp,
+        const EdgeFade* fade, const MixBus& bus)
+    {
+        float* output1 = bus.m_output1 + offset;
+        float* output2 = bus.m_output2 + offset;
+        size_t position = offset - ramp.m_start;
+        size_t rampLength = 0;
+        if (position < ramp.m_length)
+            rampLength = ramp.m_length - position < length ? ramp.m_length - position : length;
+
+        float gain1 = ramp.m_gain1 + ramp.m_step1 * position;
+        float gain2 = ramp.m_gain2 + ramp.m_step2 * position;
+        if (fade != NULL)
+        {
+            int64_t fadeOffset = int64_t(offset) + fade->m_offset;
+            for (size_t s = 0; s < rampLength; s++)
+            {
+                float factor = fade->gain(size_t(fadeOffset + int64_t(s)));
+                output1[s] += input1[s] * (gain1 + ramp.m_step1 * s) * factor;
+                output2[s] += input2[s] * (gain2 + ramp.m_step2 * s) * factor;
+            }
+            for (size_t s = rampLength; s < length; s++)
+            {
+                float factor = fade->gain(size_t(fadeOffset + int64_t(s)));
+                output1[s] += input1[s] * ramp.m_target1 * factor;
+                output2[s] += input2[s] * ramp.m_target2 * factor;
+            }
+            return;
+        }
+
+        for (size_t s = 0; s < rampLength; s++)
+        {
+            output1[s] += input1[s] * (gain1 + ramp.m_step1 * s);
+            output2[s] += input2[s] * (gain2 + ramp.m_step2 * s);
+        }
+
+        float target1 = ramp.m_target1;
+        float target2 = ramp.m_target2;
+        if (target1 == 1.0f && target2 == 1.0f)
+        {
+            for (size_t s = rampLength; s < length; s++)
+            {
+                output1[s] += input1[s];
+                output2[s] += input2[s];
+            }
+        }
+        else if (target1 != 0.0f || target2 != 0.0f)
+        {
+            for (size_t s = rampLength; s < length; s++)
+            {
+                output1[s] += input1[s] * target1;
+                output2[s] += input2[s] * target2;
+            }
+        }
+    }
+
+    /// Add a range of a compressed segment to the output. The blocks are decoded
+    /// just ahead of the play position, one at a time. Silent blocks are skipped
+    /// without decoding them.
+    /// \param dubIndex The index of the dub.
+    /// \param segmentIndex The index of the segment in the dub.
+    /// \param index The first sample in the segment.
+    /// \param offset The first sample in the output.
+    /// \param length The number of samples.
+    /// \param ramp The gain of the dub.
+    /// \param fade The fades of the segment, or NULL if the range is not faded.
+    /// \param bus Where to add the samples to.
+    void mixCompressed(size_t dubIndex, size_t segmentIndex, size_t index, uint32_t offset, size_t length,
+        const GainRamp& ramp, const EdgeFade* fade, const MixBus& bus)
+    {
+        const Dub& dub = bus.m_source->m_dubs[dubIndex];
+        const Segment& segment = dub.m_segments[segmentIndex];
+        const uint8_t* pool = bus.m_source->m_compressionPool;
+        DecodeCache& cache = m_decodeCaches[dubIndex];
+        while (length > 0)
+        {
+            size_t block = index / COMPRESSION_BLOCK_SIZE;
+            size_t blockIndex = index % COMPRESSION_BLOCK_SIZE;
+            size_t count = COMPRESSION_BLOCK_SIZE - blockIndex;
+            if (count > length)
+                count = length;
+
+            size_t size;
+            size_t position = DubOffloader::blockOffset(pool, segment.m_compressedOffset, block, size);
+            if (LosslessCodec::peak(&pool[position]) >= SILENCE_FLOOR)
+            {
+                size_t blockLength = segment.m_length - block * COMPRESSION_BLOCK_SIZE;
+                if (blockLength > COMPRESSION_BLOCK_SIZE)
+                    blockLength = COMPRESSION_BLOCK_SIZE;
+                const float* samples1 = cache.m_samples1;
+                const float* samples2 = cache.m_samples2;
+                if (bus.m_decoded1 != NULL)
+                {
+                    LosslessCodec::decodeBlock(&pool[position], size, blockLength, bus.m_decoded1, bus.m_decoded2);
+                    samples1 = bus.m_decoded1;
+                    samples2 = bus.m_decoded2;
+                }
+                else if (cache.m_dubId != dub.m_id || cache.m_segment != segmentIndex || cache.m_block != block)
+                {
+                    LosslessCodec::decodeBlock(&pool[position], size, blockLength,
+                        cache.m_samples1, cache.m_samples2);
+                    cache.m_dubId = dub.m_id;
+                    cache.m_segment = segmentIndex;
+                    cache.m_block = block;
+                }
+                addSamples(&samples1[blockIndex], &samples2[blockIndex], offset, count, ramp, fade, bus);
+            }
+            index += count;
+            offset += count;
+            length -= count;
+        }
+    }
+
+    /// Add a dub to a mix of the whole loop. A dub recorded before the loop was multiplied
+    /// repeats within it, one recorded across the end of the loop continues at its start.
+    /// \param dub The dub.
+    /// \param length The length of the loop.
+    /// \param mix1 The first channel of the mix.
+    /// \param mix2 The second channel of the mix.
+    /// \param gain1 The gain of the first channel.
+    /// \param gain2 The gain of the second channel.
+    /// \param fadeLength The number of samples faded at the edges of each segment.
+    /// \param fadeShape The shape of the fades.
+    void addRepeatedDub(const Dub& dub, size_t length, float* mix1, float* mix2, float gain1, float gain2,
+        size_t fadeLength, FadeShape fadeShape)
+    {
+        for (size_t repetition = 0; repetition < length; repetition += dub.m_period)
+        {
+            for (size_t g = 0; g < dub.m_nrOfSegments; g++)
+            {
+                const Segment& segment = dub.m_segments[g];
+                size_t loopIndex = (repetition + dub.m_startIndex + segment.m_loopOffset) % length;
+                size_t count = segment.m_length < length - loopIndex ? segment.m_length : length - loopIndex;
+                addSegment(dub, g, 0, count, &mix1[loopIndex], &mix2[loopIndex], gain1, gain2, fadeLength,
+                    fadeShape);
+                if (count < segment.m_length)
+                    addSegment(dub, g, count, segment.m_length - count, mix1, mix2, gain1, gain2, fadeLength,
+                        fadeShape);
+            }
+        }
+    }
+
+    /// Add a range of a segment to a buffer, no matter where its audio is. Not meant
+    /// for playback, as nothing is cached and the file might be read.
+    /// \param dub The dub.
+    /// \param segmentIndex The index of the segment in the dub.
+    /// \param index The first sample in the segment.
+    /// \param length The number of samples.
+    /// \param output1 Where to add the first channel to.
+    /// \param output2 Where to add the second channel to.
+    /// \param gain1 The gain of the first channel.
+    /// \param gain2 The gain of the second channel.
+    /// \param fadeLength The number of samples faded at the edges of the segment.
+    /// \param fadeShape The shape of the fades.
+    void addSegment(const Dub& dub, size_t segmentIndex, size_t index, size_t length, float* output1,
+        float* output2, float gain1, float gain2, size_t fadeLength, FadeShape fadeShape)
+    {
+        const Segment& segment = dub.m_segments[segmentIndex];
+        EdgeFade fade = EdgeFade::forSegment(dub, segmentIndex, fadeLength, fadeShape);
+        float samples1[COMPRESSION_BLOCK_SIZE];
+        float samples2[COMPRESSION_BLOCK_SIZE];
+        while (length > 0)
+        {
+            // Get the samples of a block, aligned to the compressed blocks.
+            size_t blockIndex = index % COMPRESSION_BLOCK_SIZE;
+            size_t count = COMPRESSION_BLOCK_SIZE - blockIndex;
+            if (count > length)
+                count = length;
+            const float* input1 = &samples1[blockIndex];
+            const float* input2 = &samples2[blockIndex];
+            if (dub.m_location == Dub::IN_STORAGE)
+            {
+                input1 = &m_storage1[segment.m_storageOffset + index];
+                input2 = &m_storage2[segment.m_storageOffset + index];
+            }
+            else if (dub.m_location == Dub::ON_FILE)
+            {
+                size_t fileOffset = segment.m_fileOffset + index * sizeof(float);
+                if (!TieringFile::readAll(m_tieringFile.fd(), &samples1[blockIndex], count * sizeof(float),
+                        fileOffset) ||
+                    !TieringFile::readAll(m_tieringFile.fd(), &samples2[blockIndex], count * sizeof(float),
+                        fileOffset + segment.m_length * sizeof(float)))
+                {
+                    log("Could not read the tiering file");
+                    return;
+                }
+            }
+            else
+            {
+                size_t block = index / COMPRESSION_BLOCK_SIZE;
+                size_t blockLength = segment.m_length - block * COMPRESSION_BLOCK_SIZE;
+                if (blockLength > COMPRESSION_BLOCK_SIZE)
+                    blockLength = COMPRESSION_BLOCK_SIZE;
+                size_t size;
+                size_t position = DubOffloader::blockOffset(m_compressionPool, segment.m_compressedOffset, block, size);
+                LosslessCodec::decodeBlock(&m_compressionPool[position], size, blockLength, samples1, samples2);
+            }
+
+            for (size_t s = 0; s < count; s++)
+            {
+                float factor = fade.gain(segment.m_loopOffset + index + s);
+                output1[s] += input1[s] * gain1 * factor;
+                output2[s] += input2[s] * gain2 * factor;
+            }
+            index += count;
+            output1 += count;
+            output2 += count;
+            length -= count;
+        }
+    }
+
+    //
+    // Input parameters
+    //
+
+    /// Threshold parameter
+    const float* m_thresholdParameter = NULL;
+
+    /// Dry amount parameter
+    const float* m_dryAmountParameter = NULL;
+
+    /// Continuous dub mode parameter
+    const float* m_continuousDubParameter = NULL;
+
+    /// Silence gap parameter
+    const float* m_silenceGapParameter = NULL;
+
+    /// Fade length parameter
+    const float* m_fadeLengthParameter = NULL;
+
+    /// Fade shape parameter
+    const float* m_fadeShapeParameter = NULL;
+
+    /// Speed parameter
+    const float* m_speedParameter = NULL;
+
+    /// Tempo parameter
+    const float* m_tempoParameter = NULL;
+
+    /// Follow tempo parameter
+    const float* m_followTempoParameter = NULL;
+
+    /// Track parameter
+    const float* m_trackParameter = NULL;
+
+    /// Scene parameter
+    const float* m_sceneParameter = NULL;
+
+    /// Max dubs parameter
+    const float* m_maxDubsParameter = NULL;
+
+    /// Storage seconds parameter
+    const float* m_storageSecondsParameter = NULL;
+
+    /// Cull level parameter
+    const float* m_cullLevelParameter = NULL;
+
+    /// Cull load parameter
+    const float* m_cullLoadParameter = NULL;
+
+    /// Mixer messages and the position of the host
+    const LV2_Atom_Sequence* m_controlPort = NULL;
+    
+    /// Activate button
+    MomentaryButton m_activateButton;
+    /// Reset button
+    MomentaryButton m_resetButton;
+    /// Undo button
+    MomentaryButton m_undoButton;
+    /// Redo button
+    MomentaryButton m_redoButton;
+    /// Dub button
+    MomentaryButton m_dubButton;
+    /// Branch button
+    MomentaryButton m_branchButton;
+    /// Snapshot button
+    MomentaryButton m_snapshotButton;
+    /// Restore button
+    MomentaryButton m_restoreButton;
+
+    //
+    // Output parameters
+    //
+
+    /// Looper state output
+    float* m_stateOutput = NULL;
+    /// Active dubs output
+    float* m_dubsOutput = NULL;
+    /// Recorded dubs output
+    float* m_recordedDubsOutput = NULL;
+    /// Storage usage output
+    float* m_storageOutput = NULL;
+    /// Loop position output
+    float* m_positionOutput = NULL;
+    /// DSP load output
+    float* m_dspLoadOutput = NULL;
+
+    //
+    // All audio inputs
+    //
+
+    /// Audio input 1
+    const float* m_input1 = NULL;
+    /// Audio input 2
+    const float* m_input2 = NULL;
+
+    //
+    // All audio outputs
+    //
+
+    /// Audio output 1, the dry signal and all tracks
+    float* m_output1 = NULL;
+    /// audio output 2
+    float* m_output2 = NULL;
+    /// The audio outputs of each track
+    TrackBuses m_trackOutputs = {{}, {}, NULL, NULL, &m_mixSource};
+    /// Where the dubs are mixed to, the outputs of the tracks unless the loop is played
+    /// at another speed or tempo
+    TrackBuses m_mixBuses = {};
+
+    //
+    // Mixing with several threads
+    //
+
+    ///
+    /// The chunk the dubs are mixed for by several threads, see mixDubs, with a copy of
+    /// what the jobs read of the dubs and their gains
+    ///
+    struct MixJob
+    {
+        /// The first sample in the loop
+        size_t m_loopIndex = 0;
+        /// The first sample in the output
+        uint32_t m_offset = 0;
+        /// The number of samples
+        uint32_t m_nrOfSamples = 0;
+        /// The first dub to add
+        size_t m_firstDub = 0;
+        /// The dub after the last one to add
+        size_t m_endDub = 0;
+        /// What the dubs are mixed from, with the copies of the dubs
+        MixSource m_source = {};
+        /// The copies of the dubs added, see copyForMixing
+        Dub m_dubs[NR_OF_DUBS];
+        /// The ramps each dub is added with, see dubRamps
+        GainRamp m_ramps[NR_OF_DUBS][2];
+        /// The number of ramps of each dub, 0 if it is not added
+        size_t m_nrOfRamps[NR_OF_DUBS] = {};
+    };
+
+    /// What the audio thread mixes the dubs from, see updateMixSource
+    MixSource m_mixSource = {};
+    /// The chunks mixed in the last two rounds of the mixing threads, a round uses the one
+    /// of its number modulo 2
+    MixJob m_mixJobs[2];
+    /// The threads helping to mix the dubs, not started if NR_OF_MIXING_THREADS is 0
+    MixingThreads m_mixingThreads;
+    /// Was the priority of the mixing threads set?
+    bool m_mixingThreadsScheduled = false;
+
+    //
+    // Leaving out the quietest dubs
+    //
+
+    /// The peaks of the dubs left out add up to less than this part of the peaks of all dubs
+    float m_cullLevel = 0.001f;
+    /// The DSP load above which the quietest dubs are left out, 1 or more to play all dubs
+    float m_cullLoad = 1.0f;
+    /// The DSP load averaged over about CULLING_LOAD_SECONDS
+    float m_averageLoad = 0.0f;
+    /// Are the quietest dubs left out?
+    bool m_culling = false;
+    /// The number of samples the load stayed below the release level while culling
+    size_t m_cullingHold = 0;
+    /// The peak of each dub in the mix, when the dubs were ranked last
+    float m_cullPeaks[NR_OF_DUBS];
+    /// The indices of the dubs which may be left out, the quietest one first
+    size_t m_cullRanking[NR_OF_DUBS];
+    /// The number of changes of the mixer when the dubs were ranked last
+    size_t m_culledChanges = 0;
+    /// The number of dubs when they were ranked last
+    size_t m_culledNrOfDubs = 0;
+    /// The id of the next dub recorded when the dubs were ranked last
+    size_t m_culledNextDubId = 0;
+    /// The cull level when the dubs were ranked last
+    float m_culledLevel = 0.0f;
+
+    //
+    // Internal state
+    //
+
+    ///
+    /// The URIDs used for the messages on the control port, 0 if the host cannot map URIs
+    ///
+    struct Uris
+    {
+        LV2_URID m_atomBlank = 0;
+        LV2_URID m_atomBool = 0;
+        LV2_URID m_atomFloat = 0;
+        LV2_URID m_atomInt = 0;
+        LV2_URID m_atomObject = 0;
+        LV2_URID m_atomUrid = 0;
+        LV2_URID m_patchSet = 0;
+        LV2_URID m_patchProperty = 0;
+        LV2_URID m_patchValue = 0;
+        LV2_URID m_dub = 0;
+        LV2_URID m_dubGain = 0;
+        LV2_URID m_dubMute = 0;
+        LV2_URID m_dubPan = 0;
+        LV2_URID m_dubScenes = 0;
+        LV2_URID m_dubDelete = 0;
+        LV2_URID m_dubReplace = 0;
+        LV2_URID m_track = 0;
+        LV2_URID m_trackGain = 0;
+        LV2_URID m_trackMute = 0;
+        LV2_URID m_timePosition = 0;
+        LV2_URID m_timeBeatsPerMinute = 0;
+        LV2_URID m_maxDubs = 0;
+        LV2_URID m_storageSeconds = 0;
+    };
+
+    /// The URIDs
+    Uris m_uris;
+    /// The stored sample rate
+    uint32_t m_sampleRate = 48000;
+    /// The current looper state
+    State m_state = LOOPER_STATE_INACTIVE;
+    /// The stored threshold as a linear value
+    float m_threshold = 0.0f;
+    /// The stored dry amount
+    float m_dryAmount = 1.0f;
+    /// The stored silence gap in samples
+    size_t m_gapSamples = 0;
+    /// The stored number of samples faded at the edges of each segment
+    size_t m_fadeLength = NR_OF_BLEND_SAMPLES;
+    /// The stored shape of the fades
+    FadeShape m_fadeShape = FADE_LINEAR;
+    /// The stored playback speed
+    float m_speed = 1.0f;
+    /// The stored track which is recorded, undone and redone (0 for the first one)
+    size_t m_track = 0;
+    /// The stored scene, it is played from the next start of the loop on (0 for all dubs)
+    size_t m_nextScene = 0;
+    /// The tempo the loop is played at, relative to the one it was recorded at
+    float m_tempoRatio = 1.0f;
+    /// The tempo of the host in beats per minute, 0 as long as the host did not tell it
+    float m_hostBpm = 0.0f;
+    /// The tempo of the host when the first dub was recorded, 0 if it was not known
+    float m_loopBpm = 0.0f;
+    /// The number of samples recorded past the end of the first dub to crossfade into
+    /// its start, 0 if there is no such tail
+    size_t m_tailLength = 0;
+    /// The number of tail samples recorded so far
+    size_t m_tailRecorded = 0;
+    /// Where the tail is recorded to in the storage, right after the first dub
+    size_t m_tailStorage = 0;
+    /// The id of the dub the tail belongs to
+    size_t m_tailDubId = 0;
+    /// Is the recording currently in a gap between segments?
+    bool m_recordingGap = false;
+    /// Did the dub being recorded continue at the start of the loop?
+    bool m_recordingWrapped = false;
+    /// The number of samples below the threshold at the end of the recording
+    size_t m_silentSamples = 0;
+    /// Where are we with the first (main) loop. The first loop governs all the loops!
+    size_t m_currentLoopIndex = 0;
+    /// The position between m_currentLoopIndex and the next sample when the loop is
+    /// played at another speed
+    double m_loopFraction = 0.0;
+    /// The lenght of the main loop
+    size_t m_loopLength = 0;
+    /// The number of times the end of the loop was reached, counting down when it is
+    /// played backwards
+    size_t m_loopCounter = 0;
+    /// Current time, sample accurate used for buttons
+    double m_now = 0;
+
+    //
+    // Storage memory for audio
+    //
+
+    /// Overall storage size for audio (number of floats per channel)
+    size_t m_storageSize = 0;
+    /// The storage size the memory was allocated for, it includes the compression pool
+    size_t m_storageBudget = 0;
+    /// The storage size given by the host at instantiation, used if the storage
+    /// parameter is 0
+    size_t m_defaultStorageSize = 0;
+    /// The storage size selected last
+    size_t m_requestedStorageSize = 0;
+    /// Storage of the size selected, allocated by the LV2 worker but not used, yet
+    StorageBuffers m_pendingStorage;
+    /// Storage which the LV2 worker did not accept to free yet, see freeStorage
+    StorageBuffers m_freedStorage;
+    /// Is the LV2 worker allocating storage?
+    bool m_storageJobPending = false;
+    /// The worker feature of the host, NULL if it is not supported
+    const LV2_Worker_Schedule* m_schedule = NULL;
+    /// The number of dubs which can be recorded, at most NR_OF_DUBS
+    size_t m_maxDubs = NR_OF_DUBS;
+    /// The number of dubs given by the host at instantiation, used if the max dubs
+    /// parameter is 0
+    size_t m_defaultMaxDubs = NR_OF_DUBS;
+    /// Where the next recorded sample will be stored. The audio still needed is the
+    /// one between storageTail() and this position. Normally the tail is at the start
+    /// of the storage, but once the oldest dubs are compressed (or bounced) their
+    /// memory is free and recording continues at the start once the end is reached.
+    size_t m_nrOfUsedSamples = 0;
+    /// Storage for first channel
+    float* m_storage1 = NULL;
+    /// Storage for second channel
+    float* m_storage2 = NULL;
+    /// Peak of both channels for each PEAK_BLOCK_SIZE samples of the storage
+    float* m_peaks = NULL;
+    /// The first channel of the loop samples mixed for a chunk played at another speed, for each track
+    float m_varispeedBus1[NR_OF_TRACKS][VARISPEED_BUS_SIZE];
+    /// The second channel of the loop samples mixed for a chunk played at another speed, for each track
+    float m_varispeedBus2[NR_OF_TRACKS][VARISPEED_BUS_SIZE];
+    /// The first channel of the dubs whose gains change within the chunk played at another
+    /// speed, mixed with their gains after it, for each track. The bus above has them mixed
+    /// with the gains at the start of the chunk then.
+    float m_varispeedEnd1[NR_OF_TRACKS][VARISPEED_BUS_SIZE];
+    /// The second channel of the dubs whose gains change, mixed with the gains after the chunk
+    float m_varispeedEnd2[NR_OF_TRACKS][VARISPEED_BUS_SIZE];
+    /// A channel of the dubs whose gains change read at another speed, with the gains at the
+    /// start of the chunk
+    float m_varispeedFrom[VARISPEED_CHUNK];
+    /// The same with the gains after the chunk
+    float m_varispeedTo[VARISPEED_CHUNK];
+    /// Is the loop played at another tempo? The state of the stretching is kept while it is.
+    bool m_stretching = false;
+    /// The number of loop samples mixed per output sample. The gain ramps of the dubs take
+    /// as many times longer.
+    float m_rampStretch = 1.0f;
+    /// The number of loop samples the dubs are mixed ahead of the one their gain ramps
+    /// start at, in the same run
+    int64_t m_rampAhead = 0;
+    /// The start of the current pass of the loop, counted in loop samples from where playing
+    /// at another tempo started. The mixed loop samples are kept at such positions.
+    int64_t m_stretchPassStart = 0;
+    /// The position after the last loop sample mixed into the ring
+    int64_t m_stretchMixed = 0;
+    /// The position of the current grain
+    int64_t m_stretchGrain = 0;
+    /// The number of samples of the current hop played
+    size_t m_stretchPlayed = 0;
+    /// The position of the next grain in the loop, which is searched during the current hop
+    int64_t m_searchPosition = 0;
+    /// The number of offsets of the next grain compared so far
+    size_t m_searchCandidate = 0;
+    /// The number of samples compared so far
+    size_t m_searchWork = 0;
+    /// The best offset of the next grain so far
+    int64_t m_searchBest = 0;
+    /// The similarity at the best offset
+    float m_searchBestSimilarity = 0.0f;
+    /// The best offset of the coarse search, the offsets around it are compared next
+    int64_t m_searchCoarse = 0;
+    /// The first channel of the mixed loop samples of each track, each at its position modulo the size
+    float m_stretchRing1[NR_OF_TRACKS][STRETCH_RING_SIZE];
+    /// The second channel of the mixed loop samples of each track, each at its position modulo the size
+    float m_stretchRing2[NR_OF_TRACKS][STRETCH_RING_SIZE];
+    /// The sum of both channels of all tracks in the ring, which the grains are searched in
+    float m_stretchSum[STRETCH_RING_SIZE];
+    /// The first channel of the end of the current grain faded out for each track, or of the
+    /// grain before for the part of the hop which is not played yet
+    float m_stretchTail1[NR_OF_TRACKS][STRETCH_HOP];
+    /// The second channel of the end of the grain faded out for each track
+    float m_stretchTail2[NR_OF_TRACKS][STRETCH_HOP];
+    /// The first channel of the difference faded out after playing at another tempo stopped, for each track
+    float m_stretchResidual1[NR_OF_TRACKS][STRETCH_HOP];
+    /// The second channel of the difference faded out after playing at another tempo stopped, for each track
+    float m_stretchResidual2[NR_OF_TRACKS][STRETCH_HOP];
+    /// The number of samples of the difference
+    size_t m_residualLength = 0;
+    /// The number of samples of the difference played so far
+    size_t m_residualPlayed = 0;
+
+    //
+    // Store information about the dubs
+    //
+
+    /// The number of dubs currently active
+    size_t m_nrOfDubs = 0;
+    /// The number of dubs which we recorded and thus could be redone
+    size_t m_maxUsedDubs = 0;
+    /// The dubs
+    Dub m_dubs[NR_OF_DUBS];
+    /// The gains of the dubs
+    DubMixer m_mixer;
+    /// The id for the next recorded dub
+    size_t m_nextDubId = 1;
+    /// Counts the dubs played in the undo history, see Dub::m_visit
+    size_t m_nextVisit = 1;
+
+    //
+    // Snapshot of the dubs
+    //
+
+    ///
+    /// The dubs as they were when the snapshot was taken. Their audio is not copied: The
+    /// storage it is in is not recorded to, and nothing is offloaded, until the snapshot
+    /// is released.
+    ///
+    struct Snapshot
+    {
+        /// Is a snapshot held?
+        bool m_taken = false;
+        /// The dubs, the ones kept for redoing them included
+        Dub m_dubs[NR_OF_DUBS];
+        /// The mixer settings of the dubs
+        DubMixer::Settings m_settings[NR_OF_DUBS];
+        /// Which dubs were faded in?
+        bool m_active[NR_OF_DUBS];
+        /// The number of dubs played
+        size_t m_nrOfDubs = 0;
+        /// The number of dubs including the ones kept for redoing them
+        size_t m_maxUsedDubs = 0;
+        /// The length of the loop
+        size_t m_loopLength = 0;
+        /// The tempo the loop was recorded at
+        float m_loopBpm = 0.0f;
+        /// Where the audio of the dubs starts in the storage
+        size_t m_storageTail = 0;
+        /// Where the audio of the dubs ends in the storage
+        size_t m_storageEnd = 0;
+        /// The number of dubs which were not in the storage
+        size_t m_nrOfOffloadedDubs = 0;
+        /// The number of dubs which were played from the file
+        size_t m_nrOfFileDubs = 0;
+    };
+
+    /// The snapshot of the dubs to go back to
+    Snapshot m_snapshot;
+    /// Is the snapshot restored once the dubs not part of it are faded out?
+    bool m_restorePending = false;
+
+    //
+    // Jobs done by the LV2 worker
+    //
+
+    /// The results of the jobs, applied at the start of run
+    SpscQueue<WorkerJob, 4> m_workerResponses;
+
+    ///
+    /// The dubs mixed by the LV2 worker for a bounce. They are copied, so the worker does
+    /// not read the dubs while they are changed. Their audio is not recorded over, and
+    /// nothing is offloaded, until the bounce is done.
+    ///
+    struct Bounce
+    {
+        /// Is the worker mixing the dubs?
+        bool m_pending = false;
+        /// Where the mix starts in the storage
+        size_t m_offset = 0;
+        /// The length of the mix, the loop length
+        size_t m_length = 0;
+        /// The oldest audio still needed when the bounce was started, see storageTail
+        size_t m_tail = 0;
+        /// The track of the dubs
+        size_t m_track = 0;
+        /// The scenes of the dubs
+        uint32_t m_scenes = ALL_SCENES;
+        /// The fades of the segments
+        size_t m_fadeLength = NR_OF_BLEND_SAMPLES;
+        /// The shape of the fades
+        FadeShape m_fadeShape = FADE_LINEAR;
+        /// The number of dubs, the mix replaces them if they are still the same
+        size_t m_nrOfDubs = 0;
+        /// The ids of the dubs
+        size_t m_ids[NR_OF_DUBS];
+        /// Which dubs were faded in?
+        bool m_active[NR_OF_DUBS];
+        /// The dubs mixed, the ones faded in
+        Dub m_dubs[NR_OF_DUBS];
+        /// The gains of the dubs mixed for the first channel
+        float m_gains1[NR_OF_DUBS];
+        /// The gains of the dubs mixed for the second channel
+        float m_gains2[NR_OF_DUBS];
+        /// The number of dubs mixed
+        size_t m_nrOfMixedDubs = 0;
+        /// Is the mix waiting for a dub to be moved in the storage? Its audio may be
+        /// overwritten where it is until then.
+        bool m_waiting = false;
+    };
+
+    /// The bounce mixed by the LV2 worker
+    Bounce m_bounce;
+
+    //
+    // Compression of older dubs
+    //
+
+    ///
+    /// The block which was decoded last for a dub
+    ///
+    struct DecodeCache
+    {
+        /// The id of the dub the samples belong to
+        size_t m_dubId = 0;
+        /// The index of the segment
+        size_t m_segment = 0;
+        /// The index of the block in the segment
+        size_t m_block = 0;
+        /// The decoded first channel
+        float m_samples1[COMPRESSION_BLOCK_SIZE];
+        /// The decoded second channel
+        float m_samples2[COMPRESSION_BLOCK_SIZE];
+    };
+
+    /// The compressed audio
+    uint8_t* m_compressionPool = NULL;
+    /// The size of the compression pool in bytes
+    size_t m_compressionPoolSize = 0;
+    /// The last decoded block for each dub
+    DecodeCache* m_decodeCaches = NULL;
+    /// The id of a dub which did not fit into the pool
+    size_t m_compressionFailedId = 0;
+
+    //
+    // Moving the oldest dubs to a file
+    //
+
+    /// The file and the thread reading it ahead of the play position
+    TieringFile m_tieringFile;
+    /// Changes whenever dubs on file are replaced by other ones
+    uint32_t m_tieringGeneration = 1;
+    /// The dubs are moved to the file from the first one on, this many are done.
+    size_t m_nrOfFileDubs = 0;
+    /// Has the next dub been written to the file? It is played from the file once
+    /// the reader thread has caught up with it.
+    bool m_fileDubWritten = false;
+    /// The id of a dub which could not be written to the file
+    size_t m_tieringFailedId = 0;
+    /// The dubs tag last sent to the reader thread
+    uint64_t m_tieringSentState = 0;
+    /// Were mixer settings or the fades changed since they were sent to the reader thread?
+    bool m_tieringGainsChanged = false;
+    /// The loop length last sent to the reader thread
+    size_t m_tieringSentLoopLength = 0;
+    /// The switch block last sent to the reader thread
+    uint64_t m_tieringSentSwitchBlock = 0;
+
+    /// Compresses dubs or writes them to the file in the background
+    DubOffloader m_offloader;
+    /// Is an offload job running?
+    bool m_offloadPending = false;
+    /// The dubs are moved out of the storage from the first one on, this many are done.
+    size_t m_nrOfOffloadedDubs = 0;
+    /// The index of the dub moved within the storage, NR_OF_DUBS if none is moved
+    size_t m_movingDub = NR_OF_DUBS;
+    /// The id of the moved dub, its slot may be recorded to again meanwhile
+    size_t m_movingId = 0;
+    /// Where the audio of the moved dub is moved to
+    size_t m_movingDestination = 0;
+    /// The number of samples of the moved dub which are played from there in this run call
+    size_t m_movedSamples = 0;
+    /// Where the audio of the moved dub ends before the move. Nothing is recorded before
+    /// it while the dub is moved.
+    size_t m_movingEnd = 0;
+
+    /// The memory for the mixes of the scenes
+    SceneBus m_sceneBusSlots[NR_OF_SCENE_BUSES];
+    /// The bus of each scene and the one of all dubs (at 0), NULL if none
+    SceneBus* m_sceneBuses[NR_OF_SCENES + 1] = {};
+    /// The bus of the scene played before, while it is faded out
+    SceneBus* m_fadedBus = NULL;
+    /// The bus mixed by the offloader thread, NULL if none
+    SceneBus* m_mixingBus = NULL;
+    /// The buses added to the output in the current chunk: the one of the scene played
+    /// and the one faded out, NULL if there is none or if it was mixed with other dubs
+    SceneBus* m_mixedBuses[2] = {};
+    /// The buses added when the scene was switched. The dubs following their crossfade
+    /// are only left out while the same buses are added.
+    SceneBus* m_followedBuses[2] = {};
+    /// The scene whose bus was checked last, besides the ones of the scene played and
+    /// the next one
+    size_t m_checkedScene = 0;
+    /// Was there not enough memory for a scene bus? No more are mixed until the reset.
+    bool m_sceneBusFailed = false;
+
+    /// Receives commands via OSC, if enabled.
+    OscServer m_oscServer;
+
+    /// Measures the time spent in run, if enabled.
+    RunTimeProfiler m_profiler;
+
+    /// If we want to log to a file, we can use this.
+    FILE* m_logFile = NULL;
+
+    /// Log function (printf-style)
+    void log(const char *formatString, ...)
+    {
+        if (!LOG_ENABLED)
+            return;
+        if (m_logFile == NULL)
+            return;
+
+        char buffer[2048];
+        va_list argumentList;
+        va_start(argumentList, formatString);
+        vsnprintf(&buffer[0], sizeof(buffer), formatString, argumentList);
+        va_end(argumentList);
+        fwrite(buffer, 1, strlen(buffer), m_logFile);
+        fprintf(m_logFile, "\n");
+        fflush(m_logFile);
+    }
+
+    /// Take over the capacity given by the host. The options which are not given keep
+    /// their defaults, NR_OF_DUBS and STORAGE_MEMORY_SECONDS.
+    /// \param options The options, terminated by one with key 0.
+    void readOptions(const LV2_Options_Option* options)
+    {
+        m_defaultStorageSize = storageSizeFor(STORAGE_MEMORY_SECONDS);
+        for (const LV2_Options_Option* option = options; option != NULL && option->key != 0; option++)
         {
-            case LOOPER_INPUT1: m_input1 = (const float*)data; return;
-            case LOOPER_INPUT2: m_input2 = (const float*)data; return;
-            case LOOPER_OUTPUT1: m_output1 = (float*)data; return;
-            case LOOPER_OUTPUT2: m_output2 = (float*)data; return;
-            case LOOPER_THRESHOLD: m_thresholdParameter = (const float*)data; return;
-            case LOOPER_DRY_AMOUNT: m_dryAmountParameter = (const float*)data; return;
-            case LOOPER_CONTINUOUS_DUB: m_continuousDubParameter = (const float*)data; return;
-            default: break;
+            float number;
+            if (m_uris.m_maxDubs == 0 || !optionNumber(*option, number) || number < 1.0f)
+                continue;
+            if (option->key == m_uris.m_maxDubs)
+                m_defaultMaxDubs = number >= NR_OF_DUBS ? NR_OF_DUBS : size_t(number + 0.5f);
+            else if (option->key == m_uris.m_storageSeconds)
+                m_defaultStorageSize = storageSizeFor(number >= MAX_STORAGE_SECONDS ? MAX_STORAGE_SECONDS : number);
         }
+        m_maxDubs = m_defaultMaxDubs;
+    }
 
-        // Install the buttons and set their callback functions.
-        if (port == LOOPER_ACTIVATE)
+    /// Get the value of an option as a number.
+    /// \param option The option.
+    /// \param number Set to the value.
+    /// \return false if the option has another type.
+    bool optionNumber(const LV2_Options_Option& option, float& number) const
+    {
+        if (option.type == m_uris.m_atomFloat && option.size == sizeof(float))
+            number = *(const float*)option.value;
+        else if (option.type == m_uris.m_atomInt && option.size == sizeof(int32_t))
+            number = float(*(const int32_t*)option.value);
+        else
+            return false;
+        return true;
+    }
+
+    /// The storage size for a number of seconds.
+    /// \param seconds The number of seconds which can be recorded.
+    size_t storageSizeFor(double seconds) const
+    {
+        return size_t(m_sampleRate * seconds * 2);
+    }
+
+    /// The storage used right now
+    StorageBuffers currentStorage() const
+    {
+        StorageBuffers buffers;
+        buffers.m_storage1 = m_storage1;
+        buffers.m_storage2 = m_storage2;
+        buffers.m_peaks = m_peaks;
+        buffers.m_compressionPool = m_compressionPool;
+        buffers.m_storageSize = m_storageSize;
+        buffers.m_compressionPoolSize = m_compressionPoolSize;
+        buffers.m_budget = m_storageBudget;
+        return buffers;
+    }
+
+    /// Use other storage from now on. Nothing must be recorded, as the audio is not copied.
+    /// \param buffers The storage.
+    void installStorage(const StorageBuffers& buffers)
+    {
+        m_storage1 = buffers.m_storage1;
+        m_storage2 = buffers.m_storage2;
+        m_peaks = buffers.m_peaks;
+        m_compressionPool = buffers.m_compressionPool;
+        m_storageSize = buffers.m_storageSize;
+        m_compressionPoolSize = buffers.m_compressionPoolSize;
+        m_storageBudget = buffers.m_budget;
+        m_nrOfUsedSamples = 0;
+    }
+
+    /// Let the LV2 worker do a job.
+    /// \param job The job.
+    /// \return false if the host does not support the worker, or it is busy.
+    bool scheduleJob(const WorkerJob& job)
+    {
+        return m_schedule != NULL &&
+            m_schedule->schedule_work(m_schedule->handle, sizeof(job), &job) == LV2_WORKER_SUCCESS;
+    }
+
+    /// Apply the results of the jobs done by the LV2 worker since the last run call.
+    void processWorkerResponses()
+    {
+        WorkerJob job;
+        while (m_workerResponses.pop(job))
         {
-            m_activateButton.connect(data, [this](bool pressed, double interval, bool doubleClick)
+            switch (job.m_type)
             {
-                if (!pressed)
-                    return;
-                if (doubleClick)
+                case WORKER_ALLOCATE_STORAGE: takeStorage(job.m_buffers); break;
+                case WORKER_BOUNCE: finishBounce(); break;
+                default: break;
+            }
+        }
+    }
+
+    /// Take over storage allocated by the LV2 worker. It is used once the looper is empty,
+    /// see swapStorage.
+    /// \param buffers The storage, empty if there was not enough memory.
+    void takeStorage(const StorageBuffers& buffers)
+    {
+        m_storageJobPending = false;
+        if (buffers.m_storage1 == NULL)
+        {
+            log("Not enough memory for %zu samples of storage", buffers.m_budget);
+            return;
+        }
+        // If another size was selected in the meantime and the storage cannot be freed right
+        // now, it is freed once the next size is requested.
+        if (buffers.m_budget != m_requestedStorageSize && freeStorage(buffers))
+            return;
+        m_pendingStorage = buffers;
+    }
+
+    /// Let the LV2 worker allocate storage of another size. Only one allocation is done
+    /// at a time, a size selected meanwhile is requested once it is done.
+    /// \param size The number of samples per channel.
+    void requestStorage(size_t size)
+    {
+        if (size == m_requestedStorageSize || m_storageJobPending || m_schedule == NULL)
+            return;
+        if (m_pendingStorage.m_storage1 != NULL)
+        {
+            // The storage allocated before is not needed anymore.
+            if (!freeStorage(m_pendingStorage))
+                return;
+            m_pendingStorage = StorageBuffers();
+        }
+        if (size != m_storageBudget)
+        {
+            WorkerJob job;
+            job.m_type = WORKER_ALLOCATE_STORAGE;
+            job.m_buffers.m_budget = size;
+            if (!scheduleJob(job))
+                return;
+            m_storageJobPending = true;
+        }
+        m_requestedStorageSize = size;
+    }
+
+    /// Let the LV2 worker free storage. If it is busy, the storage is handed over again on
+    /// each run call until it is accepted, see retryFreeStorage.
+    /// \param buffers The storage.
+    /// \return false if other storage is still waiting to be freed, try again later then.
+    bool freeStorage(const StorageBuffers& buffers)
+    {
+        if (scheduleFreeStorage(buffers))
+            return true;
+        if (m_freedStorage.m_storage1 != NULL)
+            return false;
+        m_freedStorage = buffers;
+        return true;
+    }
+
+    /// Hand the storage waiting to be freed to the LV2 worker again, if there is any.
+    void retryFreeStorage()
+    {
+        if (m_freedStorage.m_storage1 != NULL && scheduleFreeStorage(m_freedStorage))
+            m_freedStorage = StorageBuffers();
+    }
+
+    /// Queue a job for the LV2 worker to free storage.
+    /// \param buffers The storage.
+    /// \return false if the worker is busy.
+    bool scheduleFreeStorage(const StorageBuffers& buffers)
+    {
+        WorkerJob job;
+        job.m_type = WORKER_FREE_STORAGE;
+        job.m_buffers = buffers;
+        return scheduleJob(job);
+    }
+
+    /// Use the storage allocated by the LV2 worker once the looper is empty, e.g. after a
+    /// reset. The audio is not copied, so nothing is recorded or kept for redoing it, and
+    /// neither the offloader thread nor the LV2 worker use the storage. Called at the start
+    /// of run.
+    void swapStorage()
+    {
+        if (m_pendingStorage.m_storage1 == NULL || m_pendingStorage.m_budget != m_requestedStorageSize ||
+            m_state != LOOPER_STATE_INACTIVE || m_maxUsedDubs > 0 || m_offloadPending || m_snapshot.m_taken ||
+            m_bounce.m_pending || m_mixingThreads.busy())
+            // A mixing thread which is late may still read the storage.
+            return;
+        if (!freeStorage(currentStorage()))
+            return;
+        installStorage(m_pendingStorage);
+        m_pendingStorage = StorageBuffers();
+        m_offloader.setStorage(m_storage1, m_storage2, m_peaks, m_compressionPool, m_compressionPoolSize);
+    }
+
+    /// Reset everything to initial state.
+    void reset()
+    {
+        m_nrOfDubs = 0;
+        m_maxUsedDubs = 0;
+        m_nrOfUsedSamples = 0;
+        m_state = LOOPER_STATE_INACTIVE;
+        m_recordingWrapped = false;
+        m_currentLoopIndex = 0;
+        m_loopFraction = 0.0;
+        m_loopLength = 0;
+        m_loopBpm = 0.0f;
+        m_stretching = false;
+        m_residualLength = 0;
+        m_residualPlayed = 0;
+        m_nrOfUsedSamples = 0;
+        m_nrOfOffloadedDubs = 0;
+        m_snapshot.m_taken = false;
+        m_restorePending = false;
+        replaceFileDubs(0);
+        // The memory of the scene buses is freed with the next offload job.
+        for (size_t s = 0; s <= NR_OF_SCENES; s++)
+            m_sceneBuses[s] = NULL;
+        m_fadedBus = NULL;
+        m_sceneBusFailed = false;
+    }
+
+    /// Where does the oldest audio start which is still needed? That is the audio of
+    /// the oldest active dub which is neither compressed nor on file. Just like before, the audio of
+    /// dubs which could be redone is only kept as long as nothing new is recorded. While a
+    /// snapshot is held, the audio of its dubs is needed, too.
+    size_t storageTail() const
+    {
+        if (m_bounce.m_pending)
+            // The LV2 worker reads the audio of the dubs until the bounce is done.
+            return m_bounce.m_tail;
+        if (m_snapshot.m_taken)
+            // Whatever was recorded since is after the audio of the snapshot.
+            return m_snapshot.m_storageTail;
+        // The audio of deleted dubs is not needed, unless it is read by the offloader thread.
+        // That might be any dub while it mixes a scene bus.
+        size_t t = m_nrOfOffloadedDubs;
+        while (t < m_nrOfDubs && isFreed(t) &&
+            !(m_offloadPending && (t == m_nrOfOffloadedDubs || m_mixingBus != NULL)))
+            t++;
+        if (t < m_nrOfDubs)
+            return m_dubs[t].m_storageOffset;
+        if (m_state == LOOPER_STATE_RECORDING || m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
+            return m_dubs[m_nrOfDubs].m_storageOffset;
+        return m_nrOfUsedSamples;
+    }
+
+    /// Make sure that the storage a dub is moved to and from in the background is not
+    /// recorded to before the move is done. While the dub is in the stack, the storage
+    /// after the last dub is after it anyway.
+    void skipMovingDub()
+    {
+        if (m_movingDub < NR_OF_DUBS && m_nrOfDubs <= m_movingDub)
+            m_nrOfUsedSamples = m_movingEnd;
+    }
+
+    /// Make sure that the audio of the dubs in the snapshot is not recorded over. It may
+    /// be after the last dub played, e.g. after an undo or once the snapshot is restored.
+    void skipSnapshotStorage()
+    {
+        if (m_snapshot.m_taken)
+            skipStorage(m_snapshot.m_storageTail, m_snapshot.m_storageEnd);
+    }
+
+    /// Make sure that the dubs mixed for a bounce, and the mix, are not recorded over
+    /// before the bounce is done.
+    void skipBounceStorage()
+    {
+        if (m_bounce.m_pending)
+            skipStorage(m_bounce.m_tail, m_bounce.m_offset + m_bounce.m_length);
+    }
+
+    /// Move the write head behind a range of the storage, if it is within it.
+    /// \param start The first sample of the range.
+    /// \param end The sample after the last one, it may be before the start if the range
+    /// continues at the start of the storage.
+    void skipStorage(size_t start, size_t end)
+    {
+        bool inside = start <= end ? m_nrOfUsedSamples >= start && m_nrOfUsedSamples < end :
+            m_nrOfUsedSamples >= start || m_nrOfUsedSamples < end;
+        if (inside)
+            m_nrOfUsedSamples = end;
+    }
+
+    /// Is the audio of a dub in the stack not needed anymore? That is the case once a
+    /// deleted dub is faded out.
+    /// \param dubIndex The index of the dub.
+    bool isFreed(size_t dubIndex) const
+    {
+        return m_dubs[dubIndex].m_discarded && !m_mixer.active(dubIndex) && m_mixer.settled(dubIndex);
+    }
+
+    /// How many samples can be recorded at m_nrOfUsedSamples without overwriting any
+    /// needed audio?
+    size_t contiguousFreeStorage() const
+    {
+        size_t tail = storageTail();
+        if (m_nrOfUsedSamples < tail)
+            // One sample is kept free, so the tail is never reached.
+            return tail - m_nrOfUsedSamples - 1;
+        return m_storageSize - m_nrOfUsedSamples;
+    }
+
+    /// How many samples of the storage are needed?
+    size_t usedStorage() const
+    {
+        size_t tail = storageTail();
+        if (m_nrOfUsedSamples < tail)
+            return m_storageSize - tail + m_nrOfUsedSamples;
+        return m_nrOfUsedSamples - tail;
+    }
+
+    /// Continue recording at the start of the storage if the audio there is no longer
+    /// needed. The recorded dub continues with a new segment.
+    /// \return false if the storage is full.
+    bool wrapStorage()
+    {
+        size_t tail = storageTail();
+        if (m_nrOfUsedSamples < tail || tail <= 1)
+            return false;
+        if (m_movingDub < NR_OF_DUBS && (m_movingDub >= m_nrOfDubs || isFreed(m_movingDub)))
+            // The storage the dub is moved to and from is not kept by the tail.
+            return false;
+
+        Dub& dub = m_dubs[m_nrOfDubs];
+        if (m_state == LOOPER_STATE_RECORDING && !m_recordingGap)
+        {
+            if (dub.m_nrOfSegments >= NR_OF_SEGMENTS)
+                return false;
+            Segment& segment = dub.m_segments[dub.m_nrOfSegments++];
+            segment.m_loopOffset = dub.m_length;
+            segment.m_storageOffset = 0;
+            segment.m_length = 0;
+            segment.m_continued = true;
+            m_silentSamples = 0;
+        }
+        m_nrOfUsedSamples = 0;
+        return true;
+    }
+
+    /// Start recording a dub if possible (a dub and memory for audio left).
+    /// \param track The track to record on.
+    void startRecording(size_t track)
+    {
+        if (m_restorePending)
+            // The recording is on the dubs of the snapshot.
+            applySnapshot();
+        // The dubs which were undone stay behind the recording as branches of the undo
+        // history. The one played last on the track is the one the recording is on.
+        keepBranches(track);
+        size_t end = endOfActiveDubs(track);
+        if (m_nrOfDubs >= m_maxDubs)
+            // Reached maximum number of dubs, cannot start recording.
+            return;
+        skipMovingDub();
+        skipSnapshotStorage();
+        skipBounceStorage();
+        if (contiguousFreeStorage() == 0 && !wrapStorage())
+            // Memory full, cannot start recording.
+            return;
+
+        // Prepare the dub.
+        Dub& dub = m_dubs[m_nrOfDubs];
+        dub.m_storageOffset = m_nrOfUsedSamples;
+        dub.m_length = 0;
+        dub.m_nrOfSegments = 0;
+        dub.m_id = m_nextDubId++;
+        dub.m_track = track;
+        dub.m_parentId = end > 0 ? m_dubs[end - 1].m_id : 0;
+        dub.m_visit = m_nextVisit++;
+        dub.m_discarded = false;
+        dub.m_location = Dub::IN_STORAGE;
+        dub.m_fades = true;
+        // A dub recorded while a scene is played is only part of that scene.
+        m_mixer.resetDub(m_nrOfDubs, track, m_mixer.scene() == 0 ? ALL_SCENES : 1u << (m_mixer.scene() - 1));
+        if (m_nrOfOffloadedDubs > m_nrOfDubs)
+            m_nrOfOffloadedDubs = m_nrOfDubs;
+        if (m_nrOfFileDubs > m_nrOfDubs || (m_fileDubWritten && m_nrOfFileDubs == m_nrOfDubs))
+            replaceFileDubs(m_nrOfDubs);
+        // The first segment starts once the threshold is reached.
+        m_recordingGap = true;
+        m_recordingWrapped = false;
+        // Recording always plays the loop at its normal speed, from a whole sample on.
+        m_loopFraction = 0.0;
+
+        // Now start the recording.
+        m_state = LOOPER_STATE_WAITING_FOR_THRESHOLD;
+    }
+
+    /// Start recording if not recording, yet. Otherwise finish the recording.
+    void toggleRecording()
+    {
+        if (m_state == LOOPER_STATE_RECORDING || m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
+            finishRecording();
+        else
+            startRecording(m_track);
+    }
+
+    /// Finish the current recording, if any, and immediately start recording a new dub.
+    void startDub()
+    {
+        if (m_state == LOOPER_STATE_RECORDING || m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
+            finishRecording();
+        startRecording(m_track);
+    }
+
+    /// Finish the recording.
+    void finishRecording()
+    {
+        if (m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
+        {
+            // We did not actually record anything, yet. So nothing to do. Just
+            // go back to the previous state.
+            if (m_nrOfDubs == 0)
+                m_state = LOOPER_STATE_INACTIVE;
+            else
+                m_state = LOOPER_STATE_PLAYING;
+            return;
+        }
+
+        // We did record something, so make sure we will use it.
+        m_state = LOOPER_STATE_PLAYING;
+        m_recordingWrapped = false;
+        Dub& dub = m_dubs[m_nrOfDubs];
+        if (m_nrOfDubs == 0)
+        {
+            // This was the first dub which governs the loop length.
+            m_loopLength = dub.m_length;
+            m_currentLoopIndex = 0;
+            m_loopBpm = m_hostBpm;
+            startTail(dub);
+        }
+        else
+        {
+            // Other dubs do not need to keep the silence at their end.
+            trimTrailingSilence(dub);
+        }
+        dub.m_period = m_loopLength;
+        dub.m_peak = dubPeak(dub);
+
+        // Now the dub is officially ready for playing...
+        m_nrOfDubs++;
+
+        // The dubs kept for redoing them are all before the recorded one, the ones after
+        // it have been overwritten and cannot be redone!
+        m_maxUsedDubs = m_nrOfDubs;
+    }
+
+    /// Keep recording past the end of the first dub for a crossfade into its start. That
+    /// is only done if the dub ends with sound, not in a gap, and if the storage right
+    /// after it is free. The storage for the tail is taken right away, so a dub recorded
+    /// next starts after it.
+    /// \param dub The first dub.
+    void startTail(const Dub& dub)
+    {
+        m_tailLength = 0;
+        m_tailRecorded = 0;
+        if (dub.m_nrOfSegments == 0 || dub.storageEnd() != m_nrOfUsedSamples)
+            return;
+        const Segment& last = dub.m_segments[dub.m_nrOfSegments - 1];
+        if (last.m_loopOffset + last.m_length != dub.m_length)
+            return;
+        size_t length = m_fadeLength < dub.m_length / 2 ? m_fadeLength : dub.m_length / 2;
+        if (length > dub.m_segments[0].m_length)
+            length = dub.m_segments[0].m_length;
+        if (length > contiguousFreeStorage())
+            return;
+        m_tailLength = length;
+        m_tailStorage = m_nrOfUsedSamples;
+        m_tailDubId = dub.m_id;
+        m_nrOfUsedSamples += length;
+    }
+
+    /// Shorten a just recorded dub to end with the last sample reaching the threshold
+    /// and give the memory after it back to the storage.
+    void trimTrailingSilence(Dub& dub)
+    {
+        Segment& segment = dub.m_segments[dub.m_nrOfSegments - 1];
+        segment.m_length = findEndOfSound(segment.m_storageOffset, segment.m_storageOffset + segment.m_length) -
+            segment.m_storageOffset;
+        m_nrOfUsedSamples = segment.m_storageOffset + segment.m_length;
+        // Any gap after the last segment is not needed either.
+        dub.m_length = segment.m_loopOffset + segment.m_length;
+    }
+
+    /// The highest peak of a dub, taken from the peak table. The blocks at the edges of
+    /// its segments may be shared with other audio, so it may be a bit too high.
+    float dubPeak(const Dub& dub) const
+    {
+        float peak = 0.0f;
+        for (size_t g = 0; g < dub.m_nrOfSegments; g++)
+        {
+            const Segment& segment = dub.m_segments[g];
+            size_t end = (segment.m_storageOffset + segment.m_length + PEAK_BLOCK_SIZE - 1) / PEAK_BLOCK_SIZE;
+            for (size_t block = segment.m_storageOffset / PEAK_BLOCK_SIZE; block < end; block++)
+                peak = fmaxf(peak, m_peaks[block]);
+        }
+        return peak;
+    }
+
+    /// Search backwards for the last sample reaching the threshold. The peak table
+    /// is used to skip quiet blocks, so only the samples of the last loud block are
+    /// checked.
+    /// \param start The first sample in the storage to check.
+    /// \param end The sample after the last one to check.
+    /// \return The sample after the last one reaching the threshold. If there is none
+    /// (the threshold might have been changed while recording) end is returned.
+    size_t findEndOfSound(size_t start, size_t end)
+    {
+        size_t searchEnd = end;
+        while (searchEnd > start)
+        {
+            size_t block = (searchEnd - 1) / PEAK_BLOCK_SIZE;
+            size_t blockStart = block * PEAK_BLOCK_SIZE;
+            if (blockStart < start)
+                blockStart = start;
+
+            if (m_peaks[block] >= m_threshold)
+            {
+                // The peak may be higher than the audio of this dub, so check the samples.
+                for (size_t s = searchEnd; s > blockStart; s--)
                 {
-                    reset();
-                    return;
+                    if (fabsf(m_storage1[s - 1]) >= m_threshold || fabsf(m_storage2[s - 1]) >= m_threshold)
+                        return s;
                 }
+            }
+            searchEnd = blockStart;
+        }
+        return end;
+    }
+
+    /// Undo the last recorded dub of the selected track, if there is any. Will also stop
+    /// recording. So a currently recording dub will not be heard but could be redone! The
+    /// dub is faded out first and only deactivated afterwards, so there is no click.
+    void undo()
+    {
+        size_t track = m_track;
+        if (m_state == LOOPER_STATE_RECORDING || m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
+        {
+            // When we are recording, we interpret undo as undoing the current recording.
+            // So we simply finish it and then immediately undo.
+            track = m_dubs[m_nrOfDubs].m_track;
+            finishRecording();
+        }
+
+        // Dubs which are fading out already count as undone.
+        size_t end = endOfActiveDubs(track);
+        if (end == 0)
+            // Nothing to undo.
+            return;
+        m_mixer.setActive(end - 1, false);
+        m_tieringGainsChanged = true;
+    }
+
+    /// The index after the last dub of a track which is faded in (or fading in). As the
+    /// dubs of a track are undone from the last one on, all its dubs after it were undone.
+    /// \param track The track.
+    /// \return 0 if no dub of the track is played.
+    size_t endOfActiveDubs(size_t track) const
+    {
+        size_t t = m_nrOfDubs;
+        while (t > 0 && (m_dubs[t - 1].m_track != track || !m_mixer.active(t - 1)))
+            t--;
+        return t;
+    }
+
+    /// Keep the dubs which were undone for redoing them, or switching to their branch,
+    /// after a recording. That is only done as long as any dub is played, and as long as
+    /// there is a slot and storage for a whole loop left: Otherwise the undone dubs of the
+    /// recorded track are dropped. Either way the slot after the last dub kept is free for the
+    /// recording.
+    /// \param track The track which is recorded.
+    void keepBranches(size_t track)
+    {
+        restoreBranches(track, false);
+        if (m_nrOfDubs > 0 && (m_nrOfDubs >= m_maxDubs || m_storageSize - usedStorage() < m_loopLength))
+            restoreBranches(track, true);
+    }
+
+    /// Put all dubs which are kept back into the slots.
+    /// \param track The track which is recorded.
+    /// \param drop Drop the undone dubs of the track?
+    void restoreBranches(size_t track, bool drop)
+    {
+        size_t end = 0;
+        bool playing = false;
+        for (size_t t = 0; t < m_maxUsedDubs; t++)
+        {
+            Dub& dub = m_dubs[t];
+            if (t < m_nrOfDubs && m_mixer.active(t))
+            {
+                playing = true;
+                end = t + 1;
+            }
+            else
+            {
+                if (drop && dub.m_track == track)
+                    dub.m_discarded = true;
+                // A dub which is deleted or dropped is kept until it is faded out.
+                if (!dub.m_discarded || (t < m_nrOfDubs && !m_mixer.settled(t)))
+                    end = t + 1;
+            }
+        }
+        if (!playing)
+            // The recording starts a new loop.
+            end = 0;
+
+        while (m_nrOfDubs > end)
+            removeDub();
+        while (m_nrOfDubs < end)
+            restoreDub();
+        m_maxUsedDubs = m_nrOfDubs;
+    }
+
+    /// Remove the dubs which are fading out after an undo right away.
+    void removeFadingDubs()
+    {
+        while (m_nrOfDubs > 0 && !m_mixer.active(m_nrOfDubs - 1))
+            removeDub();
+    }
+
+    /// Deactivate the last dub.
+    void removeDub()
+    {
+        m_nrOfDubs--;
+        Dub& dub = m_dubs[m_nrOfDubs];
+        // Make sure that next time we record the undone dub will be overwritten, unless it
+        // is kept as a branch of the undo history then (see keepBranches).
+        m_nrOfUsedSamples = dub.m_storageOffset;
+        if (m_nrOfDubs == 0)
+        {
+            // When undoing the first dub, then we stop playing. It is like a reset, but
+            // we can still redo.
+            m_loopLength = 0;
+            m_currentLoopIndex = 0;
+            // Its storage may be recorded to again, so no tail is recorded after it.
+            m_tailLength = 0;
+        }
+    }
 
-                if (m_state == LOOPER_STATE_RECORDING || m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
-                    finishRecording();
-                else
-                    startRecording();
-            });
+    /// Redo a dub of the selected track. Redo is possible as many times as an undo was done
+    /// before. If several dubs were recorded after undoing the same dubs, the one played
+    /// last is redone.
+    void redo()
+    {
+        if (m_state == LOOPER_STATE_RECORDING)
+            // Cannot redo if recording, redo info is overwritten.
+            return;
+        size_t end = endOfActiveDubs(m_track);
+        size_t parentId = end > 0 ? m_dubs[end - 1].m_id : 0;
+        size_t next = m_maxUsedDubs;
+        for (size_t t = end; t < m_maxUsedDubs; t++)
+        {
+            const Dub& dub = m_dubs[t];
+            if (dub.m_track == m_track && !dub.m_discarded && dub.m_parentId == parentId &&
+                (next == m_maxUsedDubs || dub.m_visit > m_dubs[next].m_visit))
+                next = t;
         }
-        else if (port == LOOPER_RESET)
+        if (next == m_maxUsedDubs)
+            // Nothing to redo here, we are already at the last dub of the track.
+            return;
+        activateDub(next);
+    }
+
+    /// Replace the last dub of the selected track by the next one recorded on the same
+    /// dubs, after the last one the first one again. That way the takes recorded after
+    /// undoing a dub can be compared. The dubs after the branch switched to can be redone.
+    void switchBranch()
+    {
+        if (m_state == LOOPER_STATE_RECORDING || m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
+            return;
+        size_t end = endOfActiveDubs(m_track);
+        if (end == 0)
+            return;
+        size_t parentId = m_dubs[end - 1].m_parentId;
+        for (size_t k = 1; k < m_maxUsedDubs; k++)
         {
-            m_resetButton.connect(data, [this](bool pressed, double interval, bool doubleClick)
+            size_t t = (end - 1 + k) % m_maxUsedDubs;
+            const Dub& dub = m_dubs[t];
+            if (dub.m_track == m_track && !dub.m_discarded && dub.m_parentId == parentId)
             {
-                if (!pressed)
-                    return;
-                if (doubleClick)
-                {
-                    reset();
-                    return;
-                }
+                m_mixer.setActive(end - 1, false);
+                activateDub(t);
+                return;
+            }
+        }
+    }
 
-                if (m_state == LOOPER_STATE_RECORDING || m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
-                    finishRecording();
-                else
-                    undo();
-            });
+    /// Fade in a dub which was undone. The dubs of the other tracks before it stay undone.
+    /// \param dubIndex The index of the dub.
+    void activateDub(size_t dubIndex)
+    {
+        if (dubIndex < m_nrOfDubs)
+        {
+            // The dub is still fading out, or kept for the dubs after it, so just fade it
+            // in again.
+            m_mixer.setActive(dubIndex, true);
         }
-        else if (port == LOOPER_UNDO)
+        else
         {
-            m_undoButton.connect(data, [this](bool pressed, double interval, bool doubleClick)
-            {
-                if (!pressed)
-                    return;
-                undo();
-            });
+            while (m_nrOfDubs <= dubIndex)
+                restoreDub();
+            m_mixer.fadeIn(dubIndex);
         }
-        else if (port == LOOPER_REDO)
+        m_dubs[dubIndex].m_visit = m_nextVisit++;
+        m_tieringGainsChanged = true;
+    }
+
+    /// Delete any recorded dub. It is faded out and cannot be redone anymore, the dubs
+    /// recorded on it become branches of the dub it was recorded on. Its slot is kept
+    /// while there are dubs after it, but its storage is reused once they are moved
+    /// down (see findDubToMove).
+    /// \param dubIndex The index of the dub, 0 for the first one.
+    void deleteDub(size_t dubIndex)
+    {
+        if (dubIndex >= m_maxUsedDubs || m_dubs[dubIndex].m_discarded)
+            return;
+        Dub& dub = m_dubs[dubIndex];
+        dub.m_discarded = true;
+        for (size_t t = 0; t < m_maxUsedDubs; t++)
         {
-            m_redoButton.connect(data, [this](bool pressed, double interval, bool doubleClick)
-            {
-                if (!pressed)
-                    return;
-                redo();
-            });
+            if (m_dubs[t].m_parentId == dub.m_id)
+                m_dubs[t].m_parentId = dub.m_parentId;
         }
-        else if (port == LOOPER_DUB)
+        if (dubIndex < m_nrOfDubs && m_mixer.active(dubIndex))
         {
-            m_dubButton.connect(data, [this](bool pressed, double interval, bool doubleClick)
-            {
-               if (!pressed)
-                    return;
-                if (doubleClick)
-                {
-                    reset();
-                    return;
-                }
+            m_mixer.setActive(dubIndex, false);
+            m_tieringGainsChanged = true;
+        }
+    }
 
-                if (m_state == LOOPER_STATE_RECORDING || m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
-                    finishRecording();
-                startRecording();
-            });
+    /// Record a dub again. The new recording is on the same track, with the same mixer
+    /// settings, and the dub is deleted once it has started.
+    /// \param dubIndex The index of the dub, 0 for the first one.
+    void replaceDub(size_t dubIndex)
+    {
+        if (m_state == LOOPER_STATE_RECORDING || m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
+            finishRecording();
+        if (dubIndex >= m_maxUsedDubs || m_dubs[dubIndex].m_discarded)
+            return;
+        size_t id = m_dubs[dubIndex].m_id;
+        DubMixer::Settings settings = m_mixer.settings(dubIndex);
+        startRecording(m_dubs[dubIndex].m_track);
+        if (m_state != LOOPER_STATE_WAITING_FOR_THRESHOLD)
+            // No dub or storage left.
+            return;
+        // The dub may have been dropped to free storage, and its slot be recorded to.
+        Dub& dub = m_dubs[m_nrOfDubs];
+        if (m_dubs[dubIndex].m_id == id)
+        {
+            // The recording takes the place of the dub in the undo history.
+            if (dub.m_parentId == id)
+                dub.m_parentId = m_dubs[dubIndex].m_parentId;
+            deleteDub(dubIndex);
         }
+        m_mixer.setSettings(m_nrOfDubs, settings);
     }
 
-    /// Run the looper. Called for a bunch of samples at a time. Parameters will not change within this
-    /// call!
-    /// \param The number of samples to be read from the input and writte to the output.
-    void run(uint32_t nrOfSamples)
+    /// Put the dub after the last one back, as it is redone. It is only heard once it is
+    /// faded in.
+    void restoreDub()
     {
-        updateParameters();
+        Dub& dub = m_dubs[m_nrOfDubs];
+        // Make sure that we do not overwrite the dubs audio data when recording
+        // next time.
+        m_nrOfUsedSamples = dub.storageEnd();
+        if (m_nrOfDubs == 0)
+        {
+            // If redoing the first dub, then we start playback from the beginning.
+            m_currentLoopIndex = 0;
+            m_loopLength = dub.m_period;
+        }
+        else if (dub.m_period > m_loopLength)
+        {
+            // The dub was recorded after the loop was multiplied.
+            m_loopLength = dub.m_period;
+            m_tieringGeneration++;
+        }
+        m_nrOfDubs++;
+    }
 
-        m_now += double(nrOfSamples) / m_sampleRate;
-        if (m_state == LOOPER_STATE_INACTIVE)
+    /// Mix all active dubs into the first dub and drop the others. This frees the memory
+    /// of all but the first dub, but the bounced dubs cannot be undone anymore. Needs
+    /// free storage for a whole loop to mix into. The dubs are mixed by the LV2 worker if
+    /// the host supports it, the mix replaces them once it is done. It is dropped if the
+    /// dubs were changed in the meantime.
+    void bounce()
+    {
+        if (m_state == LOOPER_STATE_RECORDING || m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
+            finishRecording();
+        if (m_bounce.m_pending)
+            return;
+        // Undone dubs are not part of the mix, even if they are still fading out.
+        removeFadingDubs();
+        if (m_nrOfDubs < 2)
+            // Nothing to mix.
+            return;
+        // The tracks and scenes stay apart, the dubs are mixed into one on their track
+        // and in their scenes.
+        size_t track = m_dubs[m_nrOfDubs - 1].m_track;
+        uint32_t scenes = m_mixer.scenes(m_nrOfDubs - 1);
+        for (size_t t = 0; t < m_nrOfDubs; t++)
         {
-            for (uint32_t s = 0; s < nrOfSamples; ++s)
+            if (m_mixer.active(t) && (m_dubs[t].m_track != track || m_mixer.scenes(t) != scenes))
             {
-                m_output1[s] = m_dryAmount * m_input1[s];
-                m_output2[s] = m_dryAmount * m_input2[s];
+                log("Cannot bounce the dubs of several tracks or scenes");
+                return;
             }
+        }
+        // Every dub fits into the loop, repeating if it was recorded before the loop was multiplied.
+        size_t length = m_loopLength;
+        skipMovingDub();
+        skipSnapshotStorage();
+        if (contiguousFreeStorage() < length && !(wrapStorage() && contiguousFreeStorage() >= length))
+        {
+            log("Not enough memory to bounce");
             return;
         }
 
-        for (uint32_t s = 0; s < nrOfSamples; ++s)
+        // The dubs are mixed as they are heard now, with the gains of the mixer. The gain of
+        // the track and the scene played still apply to the mix.
+        Bounce& bounce = m_bounce;
+        bounce.m_offset = m_nrOfUsedSamples;
+        bounce.m_length = length;
+        bounce.m_track = track;
+        bounce.m_scenes = scenes;
+        bounce.m_fadeLength = m_fadeLength;
+        bounce.m_fadeShape = m_fadeShape;
+        bounce.m_nrOfDubs = m_nrOfDubs;
+        bounce.m_nrOfMixedDubs = 0;
+        for (size_t t = 0; t < m_nrOfDubs; t++)
+        {
+            bounce.m_ids[t] = m_dubs[t].m_id;
+            bounce.m_active[t] = m_mixer.active(t);
+            if (!m_mixer.active(t))
+                continue;
+            size_t d = bounce.m_nrOfMixedDubs++;
+            bounce.m_dubs[d] = m_dubs[t];
+            bounce.m_gains1[d] = m_mixer.dubGain1(t);
+            bounce.m_gains2[d] = m_mixer.dubGain2(t);
+        }
+        bounce.m_tail = storageTail();
+        bounce.m_pending = true;
+        // The dubs kept for redoing them are dropped once the mix replaces the dubs, or
+        // right away if it is where their audio is.
+        if (redoableAudioWithin(bounce.m_offset, bounce.m_offset + length))
+            m_maxUsedDubs = m_nrOfDubs;
+        m_nrOfUsedSamples = bounce.m_offset + length;
+        if (m_movingDub < NR_OF_DUBS)
         {
-            // Use the live input
-            float in1 = m_input1[s];
-            float in2 = m_input2[s];
+            // The dubs are mixed once the move is done, see processOffloading.
+            bounce.m_waiting = true;
+            return;
+        }
+        startBounceJob();
+    }
 
-            // Check if we reached the threshold to start recording.
-            if (m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD && (fabs(in1) >= m_threshold || fabs(in2) >= m_threshold))
-            {
-                Dub& dub = m_dubs[m_nrOfDubs];
-                dub.m_startIndex = m_currentLoopIndex;
-                m_state = LOOPER_STATE_RECORDING;
-            }
+    /// Let the LV2 worker mix the dubs of the bounce, or mix them right away without it.
+    void startBounceJob()
+    {
+        m_bounce.m_waiting = false;
+        WorkerJob job;
+        job.m_type = WORKER_BOUNCE;
+        if (scheduleJob(job))
+            return;
+        // Without the worker the dubs are mixed right away.
+        mixBounce();
+        finishBounce();
+    }
 
-            // If we are recoding do the record.
-            if (m_state == LOOPER_STATE_RECORDING)
+    /// Is any audio of the dubs which could be redone within a range of the storage?
+    /// \param start The first sample of the range.
+    /// \param end The sample after the last one.
+    bool redoableAudioWithin(size_t start, size_t end) const
+    {
+        for (size_t t = m_nrOfDubs; t < m_maxUsedDubs; t++)
+        {
+            const Dub& dub = m_dubs[t];
+            if (dub.m_location != Dub::IN_STORAGE)
+                continue;
+            for (size_t g = 0; g < dub.m_nrOfSegments; g++)
             {
-                m_storage1[m_nrOfUsedSamples] = in1;
-                m_storage2[m_nrOfUsedSamples] = in2;
-                m_nrOfUsedSamples++;
-                Dub& dub = m_dubs[m_nrOfDubs];
-                dub.m_length++;
+                const Segment& segment = dub.m_segments[g];
+                if (segment.m_storageOffset < end && segment.m_storageOffset + segment.m_length > start)
+                    return true;
             }
+        }
+        return false;
+    }
 
-            // Playback all active dubs.
-            float out1 = m_dryAmount * in1;
-            float out2 = m_dryAmount * in2;
-            for (size_t t = 0; t < m_nrOfDubs; t++)
+    /// Mix the dubs of a bounce into free storage, they may be stored sparsely, compressed
+    /// or on file. Called by the LV2 worker, so only the copy of the dubs made by bounce is
+    /// used. The peaks of the blocks at the edges of the mix are shared with other audio,
+    /// they are raised by finishBounce.
+    void mixBounce()
+    {
+        const Bounce& bounce = m_bounce;
+        size_t length = bounce.m_length;
+        float* mix1 = &m_storage1[bounce.m_offset];
+        float* mix2 = &m_storage2[bounce.m_offset];
+        memset(mix1, 0, length * sizeof(float));
+        memset(mix2, 0, length * sizeof(float));
+        // The edges of the segments are faded as when they were played when the bounce was started.
+        for (size_t d = 0; d < bounce.m_nrOfMixedDubs; d++)
+            addRepeatedDub(bounce.m_dubs[d], length, mix1, mix2, bounce.m_gains1[d], bounce.m_gains2[d],
+                bounce.m_fadeLength, bounce.m_fadeShape);
+
+        size_t end = bounce.m_offset + length;
+        for (size_t block = (bounce.m_offset + PEAK_BLOCK_SIZE - 1) / PEAK_BLOCK_SIZE;
+            (block + 1) * PEAK_BLOCK_SIZE <= end; block++)
+        {
+            float peak = 0.0f;
+            for (size_t s = block * PEAK_BLOCK_SIZE; s < (block + 1) * PEAK_BLOCK_SIZE; s++)
             {
-                Dub& dub = m_dubs[t];
-                if (m_currentLoopIndex < dub.m_startIndex)
-                    continue;
-                if (m_currentLoopIndex >= dub.m_startIndex + dub.m_length)
-                    continue;
-                size_t index = dub.m_storageOffset + (m_currentLoopIndex - dub.m_startIndex);
-                out1 += m_storage1[index];
-                out2 += m_storage2[index];
+                peak = fmaxf(peak, fabsf(m_storage1[s]));
+                peak = fmaxf(peak, fabsf(m_storage2[s]));
             }
+            m_peaks[block] = peak;
+        }
+    }
+
+    /// Mix a scene bus and free the memory of the released ones. Called from the offloader
+    /// thread, which has the audio of the dubs to itself.
+    /// \param job The job.
+    /// \return false if there is not enough memory for the bus.
+    bool mixSceneBus(const OffloadJob& job)
+    {
+        for (size_t b = 0; b < NR_OF_SCENE_BUSES; b++)
+        {
+            if ((job.m_releasedBuses >> b) & 1)
+                m_sceneBusSlots[b].release();
+        }
+        SceneBus* bus = job.m_sceneBus;
+        if (bus == NULL)
+            return true;
+        if (!bus->allocate())
+            return false;
+        for (size_t k = 0; k < NR_OF_TRACKS; k++)
+        {
+            if (bus->m_samples1[k] == NULL)
+                continue;
+            memset(bus->m_samples1[k], 0, bus->m_loopLength * sizeof(float));
+            memset(bus->m_samples2[k], 0, bus->m_loopLength * sizeof(float));
+        }
+        for (size_t t = bus->m_firstDub; t < bus->m_endDub; t++)
+        {
+            const Dub& dub = bus->m_dubs[t];
+            if (bus->mixed(t))
+                addRepeatedDub(dub, bus->m_loopLength, bus->m_samples1[dub.m_track], bus->m_samples2[dub.m_track],
+                    bus->m_gains1[t], bus->m_gains2[t], bus->m_fadeLength, bus->m_fadeShape);
+        }
+        return true;
+    }
+
+    /// Replace the bounced dubs by the mix, unless they were changed while they were mixed.
+    void finishBounce()
+    {
+        Bounce& bounce = m_bounce;
+        bounce.m_pending = false;
+        size_t mixOffset = bounce.m_offset;
+        size_t length = bounce.m_length;
+        raiseEdgePeaks(mixOffset, mixOffset + length);
+        bool unchanged = m_state == LOOPER_STATE_PLAYING && !m_restorePending && m_nrOfDubs == bounce.m_nrOfDubs &&
+            m_loopLength == length;
+        for (size_t t = 0; t < m_nrOfDubs && unchanged; t++)
+            unchanged = m_dubs[t].m_id == bounce.m_ids[t] && m_mixer.active(t) == bounce.m_active[t];
+        if (!unchanged)
+        {
+            log("The dubs were changed while they were bounced");
+            if (m_nrOfUsedSamples == mixOffset + length)
+                m_nrOfUsedSamples = mixOffset;
+            return;
+        }
 
-            // Store accumulated output.
-            m_output1[s] = out1;
-            m_output2[s] = out2;
+        // The mix replaces the first dub.
+        Dub& base = m_dubs[0];
+        base.m_storageOffset = mixOffset;
+        base.m_startIndex = 0;
+        base.m_length = length;
+        base.m_period = length;
+        base.m_id = m_nextDubId++;
+        base.m_track = bounce.m_track;
+        base.m_parentId = 0;
+        base.m_visit = m_nextVisit++;
+        base.m_discarded = false;
+        base.m_location = Dub::IN_STORAGE;
+        base.m_fades = false;
+        m_mixer.resetDub(0, bounce.m_track, bounce.m_scenes);
+        base.m_nrOfSegments = 1;
+        base.m_segments[0].m_loopOffset = 0;
+        base.m_segments[0].m_storageOffset = mixOffset;
+        base.m_segments[0].m_length = length;
+        base.m_peak = dubPeak(base);
 
-            if (m_nrOfDubs > 0)
-                // Only once we are actually playing anything the loop length is known.
-                m_currentLoopIndex++;
+        m_nrOfDubs = 1;
+        m_maxUsedDubs = 1;
+        m_nrOfOffloadedDubs = 0;
+        replaceFileDubs(0);
+        m_nrOfUsedSamples = base.storageEnd();
+    }
+
+    /// Multiply the length of the loop. The dubs recorded so far repeat within the longer
+    /// loop, so no audio is copied and no storage is used. Dubs recorded afterwards can
+    /// span the whole loop, also the one which might be recorded right now.
+    /// \param factor How many times the current loop fits into the new one.
+    void multiply(size_t factor)
+    {
+        if (m_nrOfDubs == 0 || factor < 2 || factor > MAX_LOOP_MULTIPLY || m_loopLength > UINT32_MAX / factor)
+            return;
+        if (m_recordingWrapped)
+            // The dub continued at the start of the shorter loop, so it ends there.
+            finishRecording();
+        m_loopLength *= factor;
+        // The blocks mixed ahead by the reader thread are counted with the old loop length.
+        m_tieringGeneration++;
+    }
+
+    /// Keep the dubs as they are now, to go back to them later. Any recording is finished
+    /// first. Only the dubs and their settings are copied, not their audio. A snapshot
+    /// taken before is replaced.
+    void takeSnapshot()
+    {
+        if (m_state == LOOPER_STATE_RECORDING || m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
+            finishRecording();
+        if (m_restorePending)
+            applySnapshot();
+        // The audio of the previous snapshot is not needed anymore.
+        m_snapshot.m_taken = false;
+        m_snapshot.m_storageTail = storageTail();
+        m_snapshot.m_storageEnd = m_nrOfUsedSamples;
+        if (m_maxUsedDubs > m_nrOfDubs && m_dubs[m_maxUsedDubs - 1].m_location == Dub::IN_STORAGE)
+            // The dubs kept for redoing them are after the last one played.
+            m_snapshot.m_storageEnd = m_dubs[m_maxUsedDubs - 1].storageEnd();
+        for (size_t t = 0; t < m_maxUsedDubs; t++)
+        {
+            m_snapshot.m_dubs[t] = m_dubs[t];
+            m_snapshot.m_settings[t] = m_mixer.settings(t);
+            m_snapshot.m_active[t] = t < m_nrOfDubs && m_mixer.active(t);
+        }
+        m_snapshot.m_nrOfDubs = m_nrOfDubs;
+        m_snapshot.m_maxUsedDubs = m_maxUsedDubs;
+        m_snapshot.m_loopLength = m_loopLength;
+        m_snapshot.m_loopBpm = m_loopBpm;
+        m_snapshot.m_nrOfOffloadedDubs = m_nrOfOffloadedDubs;
+        m_snapshot.m_nrOfFileDubs = m_nrOfFileDubs;
+        m_snapshot.m_taken = true;
+    }
+
+    /// Go back to the dubs of the snapshot. Any recording is finished first. The dubs
+    /// which are not part of the snapshot are faded out, then the ones of the snapshot
+    /// are faded in. Dubs which are part of both keep playing. The snapshot is kept, so
+    /// it can be restored again.
+    void restoreSnapshot()
+    {
+        if (!m_snapshot.m_taken)
+            return;
+        if (m_state == LOOPER_STATE_RECORDING || m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
+            finishRecording();
+        m_restorePending = true;
+        if (fadeOutForRestore())
+            applySnapshot();
+    }
+
+    /// Drop the snapshot. The storage of its dubs is reused, and dubs are offloaded again.
+    void releaseSnapshot()
+    {
+        if (m_restorePending)
+            applySnapshot();
+        m_snapshot.m_taken = false;
+    }
+
+    /// Is the same dub in a slot played by the snapshot and right now?
+    /// \param dubIndex The index of the slot.
+    bool playedBySnapshot(size_t dubIndex) const
+    {
+        return dubIndex < m_nrOfDubs && dubIndex < m_snapshot.m_nrOfDubs && m_mixer.active(dubIndex) &&
+            m_snapshot.m_active[dubIndex] && m_dubs[dubIndex].m_id == m_snapshot.m_dubs[dubIndex].m_id;
+    }
 
-            // At the end increment the loop index and check if we are at the end
-            // of the loop. The first dub governs the length of the whole loop.
-            // So if still recording when we reach the end of the loop, we stop
-            // the recording! Note that if we don't have a dub, yet, then m_loopLength
-            // is 0, so no extra check is needed.
-            if (m_currentLoopIndex > m_loopLength || m_nrOfUsedSamples >= m_storageSize)
+    /// Fade out the dubs which are not played by the snapshot.
+    /// \return true once they are all faded out.
+    bool fadeOutForRestore()
+    {
+        bool done = true;
+        for (size_t t = 0; t < m_nrOfDubs; t++)
+        {
+            if (playedBySnapshot(t))
+                continue;
+            if (m_mixer.active(t))
             {
-                // Reached the end of the loop, either because we exhausted storage
-                // or the end of the loop is there.
+                m_mixer.setActive(t, false);
+                m_tieringGainsChanged = true;
+            }
+            if (!m_mixer.settled(t))
+                done = false;
+        }
+        return done;
+    }
+
+    /// Replace the dubs by the ones of the snapshot. This only copies the dubs, so it
+    /// is done within a run call.
+    void applySnapshot()
+    {
+        m_restorePending = false;
+        for (size_t t = 0; t < m_snapshot.m_maxUsedDubs; t++)
+        {
+            bool played = playedBySnapshot(t);
+            m_dubs[t] = m_snapshot.m_dubs[t];
+            m_mixer.restoreDub(t, m_dubs[t].m_track, m_snapshot.m_settings[t], m_snapshot.m_active[t], played);
+        }
+        m_nrOfDubs = m_snapshot.m_nrOfDubs;
+        m_maxUsedDubs = m_snapshot.m_maxUsedDubs;
+        m_nrOfUsedSamples = m_snapshot.m_storageEnd;
+        m_nrOfOffloadedDubs = m_snapshot.m_nrOfOffloadedDubs;
+        // The file still holds the dubs of the snapshot, as nothing is written while it is held.
+        m_nrOfFileDubs = m_snapshot.m_nrOfFileDubs;
+        m_fileDubWritten = false;
+        m_tieringGeneration++;
+        m_tieringGainsChanged = true;
+        if (m_loopLength != m_snapshot.m_loopLength)
+        {
+            // The loop starts over at its length in the snapshot.
+            m_loopLength = m_snapshot.m_loopLength;
+            m_stretching = false;
+            if (m_currentLoopIndex >= m_loopLength)
                 m_currentLoopIndex = 0;
+        }
+        m_loopBpm = m_snapshot.m_loopBpm;
+        m_state = m_nrOfDubs > 0 ? LOOPER_STATE_PLAYING : LOOPER_STATE_INACTIVE;
+    }
 
-                if (m_state == LOOPER_STATE_RECORDING)
+    /// Take over the dubs offloaded in the background and start offloading the next
+    /// one. Dubs are offloaded in the order they were recorded, except for the most
+    /// recent ones. While the storage is getting full they are moved to the file,
+    /// otherwise they are compressed. If there is nothing to offload, the dubs after
+    /// deleted ones are moved down in the storage. Nothing is offloaded while a snapshot
+    /// is held.
+    void processOffloading()
+    {
+        if (m_movingDub < NR_OF_DUBS)
+            m_movedSamples = m_offloader.seeMoved();
+        OffloadResult result;
+        if (m_offloader.popResult(result))
+        {
+            m_offloadPending = false;
+            Dub& dub = m_dubs[result.m_dubIndex];
+            if (result.m_type == OFFLOAD_MIX_SCENE)
+                installSceneBus(result);
+            else if (result.m_type == OFFLOAD_MOVE)
+            {
+                m_movingDub = NR_OF_DUBS;
+                // The dub might have been replaced while it was moved.
+                if (result.m_dubIndex < m_maxUsedDubs && dub.m_id == result.m_dubId)
+                    installMovedDub(result.m_dubIndex, result);
+                relocateCopies(result);
+                if (m_bounce.m_waiting)
+                    startBounceJob();
+            }
+            else
+            {
+                size_t next = result.m_type == OFFLOAD_COMPRESS ? m_nrOfOffloadedDubs : m_nrOfFileDubs;
+                // The dub might have been replaced while it was offloaded.
+                if (result.m_dubIndex == next && result.m_dubIndex < m_maxUsedDubs && dub.m_id == result.m_dubId)
                 {
-                    // Stop the recording only, if we did not have the threshold, yet.
-                    // That allows to start recording right at the start of the loop.
-                    finishRecording();
-                    if(*m_continuousDubParameter && m_nrOfDubs > 0)
-                    {
-                        // This is the second dub, meaning we're overdubbing so don't
-                        // actually stop recording dubs until the user clicks the
-                        // button again.
-                        startRecording();
-                    }
+                    if (result.m_type == OFFLOAD_COMPRESS)
+                        installCompressedDub(dub, result);
+                    else
+                        installFileDub(result.m_dubIndex, result);
                 }
             }
         }
-    }
-
-private:
-    //
-    // Input parameters
-    //
 
-    /// Threshold parameter
-    const float* m_thresholdParameter = NULL;
+        if (m_offloadPending || m_fileDubWritten || m_tailRecorded < m_tailLength || m_mixingThreads.busy())
+            // Also wait until the tail is recorded after the first dub, and until no mixing
+            // thread which is late reads the storage or the compressed audio a job could
+            // overwrite.
+            return;
+        if (m_snapshot.m_taken || m_bounce.m_pending)
+        {
+            // The dubs of the snapshot are played from where they were when it was taken,
+            // and the bounced ones are read by the LV2 worker. The scene buses only read them.
+            pushSceneBusJob();
+            return;
+        }
+        if (m_tieringFile.fd() >= 0 && m_nrOfFileDubs + TIERING_KEEP_DUBS < m_nrOfDubs &&
+            m_dubs[m_nrOfFileDubs].m_id != m_tieringFailedId &&
+            usedStorage() > m_storageSize * TIERING_STORAGE_THRESHOLD)
+            pushOffloadJob(OFFLOAD_WRITE_FILE, m_nrOfFileDubs);
+        else if (COMPRESSION_ENABLED && m_nrOfOffloadedDubs + COMPRESSION_KEEP_RAW_DUBS < m_nrOfDubs &&
+            m_dubs[m_nrOfOffloadedDubs].m_id != m_compressionFailedId)
+            pushOffloadJob(OFFLOAD_COMPRESS, m_nrOfOffloadedDubs);
+        else if (!pushSceneBusJob() && m_state == LOOPER_STATE_PLAYING)
+        {
+            size_t destination;
+            size_t dubIndex = findDubToMove(destination);
+            if (dubIndex == m_nrOfDubs)
+                return;
+            pushOffloadJob(OFFLOAD_MOVE, dubIndex, destination);
+            if (!m_offloadPending)
+                return;
+            m_movingDub = dubIndex;
+            m_movingId = m_dubs[dubIndex].m_id;
+            m_movingDestination = destination;
+            m_movedSamples = 0;
+            m_movingEnd = m_dubs[dubIndex].storageEnd();
+        }
+    }
 
-    /// Dry amount parameter
-    const float* m_dryAmountParameter = NULL;
+    /// Find a dub to move down in the storage, right behind the dub before it. Only the
+    /// space freed by deleted dubs is used. A dub longer than that overlaps itself, it is
+    /// moved a chunk at a time (see DubOffloader::moveDub). The space moves on with each
+    /// dub moved, until the storage after the last dub is free again.
+    /// \param destination Set to where the audio of the dub is moved to.
+    /// \return The index of the dub, m_nrOfDubs if there is none to move.
+    size_t findDubToMove(size_t& destination) const
+    {
+        bool previous = false;
+        size_t end = 0;
+        for (size_t t = m_nrOfOffloadedDubs; t < m_nrOfDubs; t++)
+        {
+            const Dub& dub = m_dubs[t];
+            if (isFreed(t) || dub.m_location != Dub::IN_STORAGE || dub.m_nrOfSegments == 0)
+                continue;
+            // A dub which continues at the start of the storage is not moved, neither is
+            // the one after it, they are not behind each other.
+            size_t start = dub.m_segments[0].m_storageOffset;
+            bool contiguous = dub.storageEnd() >= start;
+            if (previous && contiguous && end < start)
+            {
+                destination = end;
+                return t;
+            }
+            previous = contiguous;
+            end = dub.storageEnd();
+        }
+        return m_nrOfDubs;
+    }
 
-    /// Continuous dub mode parameter
-    const float* m_continuousDubParameter = NULL;
-    
-    /// Activate button
-    MomentaryButton m_activateButton;
-    /// Reset button
-    MomentaryButton m_resetButton;
-    /// Undo button
-    MomentaryButton m_undoButton;
-    /// Redo button
-    MomentaryButton m_redoButton;
-    /// Dub button
-    MomentaryButton m_dubButton;
+    /// Play a dub from where it was moved to in the storage from now on.
+    /// \param dubIndex The index of the dub.
+    /// \param result The result of the move.
+    void installMovedDub(size_t dubIndex, const OffloadResult& result)
+    {
+        Dub& dub = m_dubs[dubIndex];
+        size_t end = dub.storageEnd();
+        relocateDub(dub, result);
+        // The storage after the last dub can be recorded to again.
+        if (dubIndex + 1 == m_nrOfDubs && m_state == LOOPER_STATE_PLAYING && m_nrOfUsedSamples == end)
+            m_nrOfUsedSamples = dub.storageEnd();
+    }
 
-    //
-    // All audio inputs
-    //
+    /// The audio of a moved dub may be overwritten where it was before. So the copies of it
+    /// kept by the snapshot and by a bounce waiting for the move are played from where it
+    /// was moved to, too.
+    /// \param result The result of the move.
+    void relocateCopies(const OffloadResult& result)
+    {
+        for (size_t t = 0; m_snapshot.m_taken && t < m_snapshot.m_maxUsedDubs; t++)
+        {
+            if (m_snapshot.m_dubs[t].m_id == result.m_dubId)
+                relocateDub(m_snapshot.m_dubs[t], result);
+        }
+        for (size_t d = 0; m_bounce.m_waiting && d < m_bounce.m_nrOfMixedDubs; d++)
+        {
+            if (m_bounce.m_dubs[d].m_id == result.m_dubId)
+                relocateDub(m_bounce.m_dubs[d], result);
+        }
+    }
 
-    /// Audio input 1
-    const float* m_input1 = NULL;
-    /// Audio input 2
-    const float* m_input2 = NULL;
+    /// Change a dub to where it was moved to in the storage.
+    /// \param dub The dub, or a copy of it.
+    /// \param result The result of the move.
+    void relocateDub(Dub& dub, const OffloadResult& result)
+    {
+        for (size_t g = 0; g < dub.m_nrOfSegments; g++)
+        {
+            Segment& segment = dub.m_segments[g];
+            segment.m_storageOffset = result.m_offsets[g];
+            raiseEdgePeaks(segment.m_storageOffset, segment.m_storageOffset + segment.m_length);
+        }
+        dub.m_storageOffset = dub.m_segments[0].m_storageOffset;
+    }
 
-    //
-    // All audio outputs
-    //
+    /// Raise the peaks of the blocks at the edges of a range of the storage, so they are
+    /// not lower than the audio within the range. The peaks of the blocks in between
+    /// are set by the offloader thread when it moves the audio there.
+    /// \param start The first sample of the range.
+    /// \param end The sample after the last one.
+    void raiseEdgePeaks(size_t start, size_t end)
+    {
+        if (start == end)
+            return;
+        size_t firstEnd = (start / PEAK_BLOCK_SIZE + 1) * PEAK_BLOCK_SIZE;
+        size_t lastStart = (end - 1) / PEAK_BLOCK_SIZE * PEAK_BLOCK_SIZE;
+        if (start % PEAK_BLOCK_SIZE != 0 || firstEnd > end)
+            raisePeak(start, firstEnd < end ? firstEnd : end);
+        if (end % PEAK_BLOCK_SIZE != 0 && lastStart >= firstEnd)
+            raisePeak(lastStart, end);
+    }
 
-    /// Audio output 1
-    float* m_output1 = NULL;
-    /// audio output 2
-    float* m_output2 = NULL;
+    /// Raise the peak of a block to cover some of its samples.
+    /// \param start The first sample.
+    /// \param end The sample after the last one, within the same block.
+    void raisePeak(size_t start, size_t end)
+    {
+        float& peak = m_peaks[start / PEAK_BLOCK_SIZE];
+        for (size_t s = start; s < end; s++)
+        {
+            peak = fmaxf(peak, fabsf(m_storage1[s]));
+            peak = fmaxf(peak, fabsf(m_storage2[s]));
+        }
+    }
 
-    //
-    // Internal state
-    //
+    /// Queue a job for the offloader thread.
+    /// \param type What to do with the dub.
+    /// \param dubIndex The index of the dub.
+    /// \param destination Where to move the dub to in the storage, only for OFFLOAD_MOVE.
+    void pushOffloadJob(OffloadType type, size_t dubIndex, size_t destination = 0)
+    {
+        const Dub& dub = m_dubs[dubIndex];
+        OffloadJob job;
+        job.m_type = type;
+        job.m_dubIndex = dubIndex;
+        job.m_dubId = dub.m_id;
+        job.m_compressed = dub.m_location == Dub::COMPRESSED;
+        job.m_nrOfSegments = dub.m_nrOfSegments;
+        for (size_t g = 0; g < dub.m_nrOfSegments; g++)
+            job.m_segments[g] = dub.m_segments[g];
+        if (type == OFFLOAD_MOVE)
+            job.m_offset = destination;
+        else if (dubIndex > 0)
+            job.m_offset = type == OFFLOAD_COMPRESS ? m_dubs[dubIndex - 1].m_compressedEnd :
+                m_dubs[dubIndex - 1].m_fileEnd;
+        m_offloadPending = m_offloader.pushJob(job);
+    }
 
-    /// The stored sample rate
-    uint32_t m_sampleRate = 48000;
-    /// The current looper state
-    State m_state = LOOPER_STATE_INACTIVE;
-    /// The stored threshold as a linear value
-    float m_threshold = 0.0f;
-    /// The stored dry amount
-    float m_dryAmount = 1.0f;
-    /// Where are we with the first (main) loop. The first loop governs all the loops!
-    size_t m_currentLoopIndex = 0;
-    /// The lenght of the main loop
-    size_t m_loopLength = 0;
-    /// Current time, sample accurate used for buttons
-    double m_now = 0;
+    /// Queue the mix of a scene bus for the offloader thread. The buses of the scene played
+    /// and of the next one are checked first, then the one of another scene on each call.
+    /// The buses which are not used anymore are freed with the job.
+    /// \return false if nothing was queued.
+    bool pushSceneBusJob()
+    {
+        if (!SCENE_BUSES_ENABLED)
+            return false;
+        OffloadJob job;
+        job.m_type = OFFLOAD_MIX_SCENE;
+        if (m_state != LOOPER_STATE_INACTIVE && !m_sceneBusFailed)
+        {
+            // Also while recording, so a switch to another scene is not held up. The dub
+            // recorded is not part of the buses until it is finished.
+            m_checkedScene = (m_checkedScene + 1) % (NR_OF_SCENES + 1);
+            size_t scenes[3] = {m_mixer.scene(), m_nextScene, m_checkedScene};
+            for (size_t c = 0; c < 3 && job.m_sceneBus == NULL; c++)
+                job.m_sceneBus = prepareSceneBus(scenes[c]);
+        }
+        for (size_t b = 0; b < NR_OF_SCENE_BUSES; b++)
+        {
+            SceneBus* bus = &m_sceneBusSlots[b];
+            if (bus->m_capacity > 0 && bus != job.m_sceneBus && !sceneBusUsed(bus))
+                job.m_releasedBuses |= 1u << b;
+        }
+        if (job.m_sceneBus == NULL && job.m_releasedBuses == 0)
+            return false;
+        m_offloadPending = m_offloader.pushJob(job);
+        if (m_offloadPending)
+            m_mixingBus = job.m_sceneBus;
+        return m_offloadPending;
+    }
 
-    //
-    // Storage memory for audio
-    //
+    /// Prepare the mix of the bus of a scene, unless it is mixed already with the dubs and
+    /// gains played now or does not fit into the memory for the buses. The buses of the
+    /// other scenes stay as long as they are not replaced. The bus of the scene played and
+    /// the one of the next scene always get memory, the ones of the other scenes are
+    /// dropped for them if needed.
+    /// \param scene The scene, 0 for all dubs.
+    /// \return The bus to mix, NULL if none.
+    SceneBus* prepareSceneBus(size_t scene)
+    {
+        SceneBus* installed = m_sceneBuses[scene];
+        if (installed != NULL && sceneBusCurrent(*installed))
+            return NULL;
+        uint32_t tracks = sceneBusTracks(scene);
+        size_t size = 0;
+        for (size_t k = 0; k < NR_OF_TRACKS; k++)
+            size += (tracks >> k) & 1 ? m_loopLength : 0;
+        if (size == 0)
+        {
+            // There is nothing to mix, all dubs of the scene are added on their own.
+            m_sceneBuses[scene] = NULL;
+            return NULL;
+        }
 
-    /// Overall storage size for audio (number of floats per channel)
-    size_t m_storageSize = 0;
-    /// Number of samples already used
-    size_t m_nrOfUsedSamples = 0;
-    /// Storage for first channel
-    float* m_storage1 = NULL;
-    /// Storage for second channel
-    float* m_storage2 = NULL;
+        // The bus replaced is not counted, it is freed after the new one is installed.
+        SceneBus* bus = NULL;
+        size_t usedSize = 0;
+        for (size_t b = 0; b < NR_OF_SCENE_BUSES; b++)
+        {
+            SceneBus* slot = &m_sceneBusSlots[b];
+            if (!sceneBusUsed(slot))
+                bus = bus != NULL ? bus : slot;
+            else if (slot != installed)
+                usedSize += slot->size();
+        }
+        size_t budget = size_t(m_storageSize * SCENE_BUS_RATIO);
+        bool reserved = scene == m_mixer.scene() || scene == m_nextScene;
+        if (bus == NULL || (!reserved && usedSize + size > budget))
+            return NULL;
+        for (size_t s = 0; s <= NR_OF_SCENES && usedSize + size > budget; s++)
+        {
+            // Freed with the job, see pushSceneBusJob.
+            SceneBus* other = m_sceneBuses[s];
+            if (other == NULL || s == m_mixer.scene() || s == m_nextScene || other == m_fadedBus)
+                continue;
+            usedSize -= other->size();
+            m_sceneBuses[s] = NULL;
+        }
 
-    //
-    // Store information about the dubs
-    //
+        bus->m_scene = scene;
+        bus->m_loopLength = m_loopLength;
+        bus->m_fadeLength = m_fadeLength;
+        bus->m_fadeShape = m_fadeShape;
+        bus->m_firstDub = firstMemoryDub();
+        bus->m_endDub = 0;
+        for (size_t t = 0; t < NR_OF_DUBS; t++)
+        {
+            sceneBusGains(t, scene, bus->m_gains1[t], bus->m_gains2[t]);
+            if (bus->m_gains1[t] == 0.0f && bus->m_gains2[t] == 0.0f)
+                continue;
+            bus->m_dubs[t] = m_dubs[t];
+            bus->m_endDub = t + 1;
+        }
+        return bus;
+    }
 
-    /// The number of dubs currently active
-    size_t m_nrOfDubs = 0;
-    /// The number of dubs which we recorded and thus could be redone
-    size_t m_maxUsedDubs = 0;
-    /// The dubs
-    Dub m_dubs[NR_OF_DUBS];
+    /// The tracks with dubs in the bus of a scene, a bit for each.
+    /// \param scene The scene, 0 for all dubs.
+    uint32_t sceneBusTracks(size_t scene) const
+    {
+        uint32_t tracks = 0;
+        for (size_t t = 0; t < m_nrOfDubs; t++)
+        {
+            float gain1, gain2;
+            sceneBusGains(t, scene, gain1, gain2);
+            if (gain1 != 0.0f || gain2 != 0.0f)
+                tracks |= 1u << m_dubs[t].m_track;
+        }
+        return tracks;
+    }
 
-    /// If we want to log to a file, we can use this.
-    FILE* m_logFile = NULL;
+    /// Can the scene switch to the next one without adding the dubs of either scene on
+    /// their own? Both buses must be mixed and valid, unless a scene has no dubs in memory.
+    /// Without a loop played, or if there is no memory for the buses, it switches anyway.
+    bool sceneSwitchReady() const
+    {
+        if (!SCENE_BUSES_ENABLED || m_sceneBusFailed || m_state == LOOPER_STATE_INACTIVE || m_nrOfDubs == 0)
+            return true;
+        return sceneBusReady(m_mixer.scene()) && sceneBusReady(m_nextScene);
+    }
 
-    /// Log function (printf-style)
-    void log(const char *formatString, ...)
+    /// Is the bus of a scene mixed and valid, or not needed as none of its dubs is in memory?
+    /// \param scene The scene, 0 for all dubs.
+    bool sceneBusReady(size_t scene) const
     {
-        if (!LOG_ENABLED)
+        const SceneBus* bus = m_sceneBuses[scene];
+        if (bus != NULL && sceneBusValid(*bus))
+            return true;
+        return sceneBusTracks(scene) == 0;
+    }
+
+    /// Add a scene bus mixed by the offloader thread, unless its dubs were changed
+    /// meanwhile. It replaces the bus mixed for the scene before.
+    void installSceneBus(const OffloadResult& result)
+    {
+        SceneBus* bus = m_mixingBus;
+        m_mixingBus = NULL;
+        if (bus == NULL)
             return;
-        if (m_logFile == NULL)
+        if (!result.m_success)
+        {
+            log("Not enough memory for a scene bus");
+            m_sceneBusFailed = true;
             return;
+        }
+        if (sceneBusValid(*bus))
+            m_sceneBuses[bus->m_scene] = bus;
+    }
 
-        char buffer[2048];
-        va_list argumentList;
-        va_start(argumentList, formatString);
-        vsnprintf(&buffer[0], sizeof(buffer), formatString, argumentList);
-        va_end(argumentList);
-        fwrite(buffer, 1, strlen(buffer), m_logFile);
-        fprintf(m_logFile, "\n");
-        fflush(m_logFile);
+    /// The gains a dub is mixed with into the bus of a scene: the ones it settles at when
+    /// the scene is played, 0 if it is not mixed into the bus.
+    /// \param dubIndex The index of the dub.
+    /// \param scene The scene, 0 for all dubs.
+    /// \param gain1 Set to the gain of the first channel.
+    /// \param gain2 Set to the gain of the second channel.
+    void sceneBusGains(size_t dubIndex, size_t scene, float& gain1, float& gain2) const
+    {
+        gain1 = gain2 = 0.0f;
+        const Dub& dub = m_dubs[dubIndex];
+        if (dubIndex < firstMemoryDub() || dubIndex >= m_nrOfDubs || dub.m_discarded ||
+            dub.m_location == Dub::ON_FILE || dub.m_nrOfSegments == 0)
+            return;
+        gain1 = m_mixer.playedGain1(dubIndex, scene);
+        gain2 = m_mixer.playedGain2(dubIndex, scene);
     }
 
-    /// Reset everything to initial state.
-    void reset()
+    /// Can a scene bus still be added to the output? Its dubs must still be played from
+    /// memory as they were mixed, with the same loop length and fades. Only their gains
+    /// may have changed, those are made up for by the dubs added on their own.
+    bool sceneBusValid(const SceneBus& bus) const
     {
-        m_nrOfDubs = 0;
-        m_maxUsedDubs = 0;
-        m_nrOfUsedSamples = 0;
-        m_state = LOOPER_STATE_INACTIVE;
-        m_currentLoopIndex = 0;
-        m_loopLength = 0;
-        m_nrOfUsedSamples = 0;
+        if (bus.m_loopLength != m_loopLength || bus.m_fadeLength != m_fadeLength ||
+            bus.m_fadeShape != m_fadeShape || bus.m_endDub > m_nrOfDubs)
+            return false;
+        size_t first = firstMemoryDub();
+        for (size_t t = bus.m_firstDub; t < bus.m_endDub; t++)
+        {
+            if (!bus.mixed(t))
+                continue;
+            const Dub& dub = m_dubs[t];
+            const Dub& mixed = bus.m_dubs[t];
+            if (t < first || dub.m_id != mixed.m_id || dub.m_discarded || dub.m_location == Dub::ON_FILE ||
+                dub.m_length != mixed.m_length || dub.m_startIndex != mixed.m_startIndex ||
+                dub.m_period != mixed.m_period || dub.m_nrOfSegments != mixed.m_nrOfSegments ||
+                dub.m_fades != mixed.m_fades)
+                return false;
+        }
+        return true;
     }
 
-    /// Start recording a dub if possible (a dub and memory for audio left).
-    void startRecording()
+    /// Is a scene bus valid and mixed with the gains the dubs settle at now?
+    bool sceneBusCurrent(const SceneBus& bus) const
     {
-        if (m_nrOfDubs >= NR_OF_DUBS)
-            // Reached maximum number of dubs, cannot start recording.
-            return;
-        if (m_nrOfUsedSamples >= m_storageSize)
-            // Memory full, cannot start recording.
-            return;
+        if (!sceneBusValid(bus))
+            return false;
+        for (size_t t = 0; t < m_nrOfDubs; t++)
+        {
+            float gain1, gain2;
+            sceneBusGains(t, bus.m_scene, gain1, gain2);
+            bool mixed = bus.mixed(t);
+            if (gain1 != (mixed ? bus.m_gains1[t] : 0.0f) || gain2 != (mixed ? bus.m_gains2[t] : 0.0f))
+                return false;
+        }
+        return true;
+    }
 
-        // Prepare the dub.
-        Dub& dub = m_dubs[m_nrOfDubs];
-        dub.m_storageOffset = m_nrOfUsedSamples;
-        dub.m_length = 0;
+    /// Is a scene bus installed, faded out or being mixed?
+    bool sceneBusUsed(const SceneBus* bus) const
+    {
+        if (bus == m_fadedBus || bus == m_mixingBus)
+            return true;
+        for (size_t s = 0; s <= NR_OF_SCENES; s++)
+        {
+            if (m_sceneBuses[s] == bus)
+                return true;
+        }
+        return false;
+    }
 
-        // Now start the recording.
-        m_state = LOOPER_STATE_WAITING_FOR_THRESHOLD;
+    /// The first dub which is not mixed by the reader thread of the file.
+    size_t firstMemoryDub() const
+    {
+        return m_nrOfFileDubs + (m_fileDubWritten ? 1 : 0);
     }
 
-    /// Finish the recording.
-    void finishRecording()
+    /// Play a dub from the compression pool from now on.
+    void installCompressedDub(Dub& dub, const OffloadResult& result)
     {
-        if (m_state == LOOPER_STATE_WAITING_FOR_THRESHOLD)
+        if (!result.m_success)
         {
-            // We did not actually record anything, yet. So nothing to do. Just
-            // go back to the previous state.
-            if (m_nrOfDubs == 0)
-                m_state = LOOPER_STATE_INACTIVE;
-            else
-                m_state = LOOPER_STATE_PLAYING;
+            log("Compression pool full");
+            m_compressionFailedId = dub.m_id;
             return;
         }
+        for (size_t g = 0; g < dub.m_nrOfSegments; g++)
+            dub.m_segments[g].m_compressedOffset = result.m_offsets[g];
+        dub.m_compressedEnd = result.m_end;
+        dub.m_location = Dub::COMPRESSED;
+        m_nrOfOffloadedDubs++;
+    }
 
-        // We did record something, so make sure we will use it.
-        m_state = LOOPER_STATE_PLAYING;
-        Dub& dub = m_dubs[m_nrOfDubs];
-        if (m_nrOfDubs == 0)
+    /// Hand a dub written to the file to the reader thread. It is still played as
+    /// before until the reader thread has caught up with it.
+    void installFileDub(size_t dubIndex, const OffloadResult& result)
+    {
+        Dub& dub = m_dubs[dubIndex];
+        if (!result.m_success)
         {
-            // This was the first dub which governs the loop length.
-            m_loopLength = dub.m_length;
-            m_currentLoopIndex = 0;
+            log("Could not write the tiering file");
+            m_tieringFailedId = dub.m_id;
+            return;
         }
+        for (size_t g = 0; g < dub.m_nrOfSegments; g++)
+            dub.m_segments[g].m_fileOffset = result.m_offsets[g];
+        dub.m_fileEnd = result.m_end;
 
-        // Fixup the start and the end of the loop. We simply fade in and out over
-        // 32 samples for now. Not sure if that's good for everything, seems to work
-        // nicely enough, though.
-        size_t length = dub.m_length > NR_OF_BLEND_SAMPLES ? NR_OF_BLEND_SAMPLES : dub.m_length;
-        size_t startIndex = dub.m_storageOffset;
-        size_t endIndex = dub.m_storageOffset + dub.m_length - 1;
-        for (size_t s = 0; s < length; s++)
+        TieringFile::Command command;
+        command.m_addDub = true;
+        command.m_dubIndex = dubIndex;
+        command.m_dub = dub;
+        m_fileDubWritten = m_tieringFile.pushCommand(command);
+    }
+
+    /// Keep the reader thread of the file up to date. Once it has mixed a written dub
+    /// ahead of the play position, the dub is played from the file and its memory is
+    /// freed.
+    /// \param nrOfSamples The number of samples played in this run call.
+    void processTiering(uint32_t nrOfSamples)
+    {
+        if (m_tieringFile.fd() < 0)
+            return;
+
+        if (m_fileDubWritten && m_nrOfFileDubs < m_nrOfDubs &&
+            m_tieringFile.ready() == TieringFile::dubsTag(m_tieringGeneration, m_nrOfFileDubs + 1))
         {
-            float factor = float(s) / length;
-            m_storage1[startIndex] *= factor;
-            m_storage2[startIndex] *= factor;
-            startIndex++;
-            m_storage1[endIndex] *= factor;
-            m_storage2[endIndex] *= factor;
-            endIndex--;
+            Dub& dub = m_dubs[m_nrOfFileDubs];
+            if (dub.m_location == Dub::IN_STORAGE)
+            {
+                // It is the oldest dub in the storage, so its memory is free now.
+                dub.m_compressedEnd = m_nrOfFileDubs > 0 ? m_dubs[m_nrOfFileDubs - 1].m_compressedEnd : 0;
+                m_nrOfOffloadedDubs++;
+            }
+            dub.m_location = Dub::ON_FILE;
+            m_nrOfFileDubs++;
+            m_fileDubWritten = false;
         }
 
-        // Now the dub is officially ready for playing...
-        m_nrOfDubs++;
+        size_t nrOfDubs = m_nrOfFileDubs + (m_fileDubWritten ? 1 : 0);
+        if (nrOfDubs > m_nrOfDubs)
+            nrOfDubs = m_nrOfDubs;
+        uint64_t state = TieringFile::dubsTag(m_tieringGeneration, nrOfDubs);
+        // At another speed the loop is read around the samples passed, at another tempo
+        // it is mixed ahead of them for the grains.
+        bool varispeed = !stretched() && this->varispeed();
+        bool reverse = varispeed && m_speed < 0.0f;
+        // The dubs on file are mixed for the next scene from the next start of the loop on.
+        uint64_t switchBlock = 0;
+        if (m_nextScene != m_mixer.scene() && m_loopLength > 0 && sceneSwitchReady())
+            switchBlock = reverse ? TieringFile::streamBlock(uint32_t(m_loopCounter - 1), m_loopLength - 1,
+                m_loopLength) : TieringFile::streamBlock(uint32_t(m_loopCounter + 1), 0, m_loopLength);
+        if (state != m_tieringSentState || m_loopLength != m_tieringSentLoopLength || m_tieringGainsChanged ||
+            switchBlock != m_tieringSentSwitchBlock)
+        {
+            TieringFile::Command command;
+            command.m_generation = m_tieringGeneration;
+            command.m_nrOfDubs = nrOfDubs;
+            command.m_loopLength = m_loopLength;
+            command.m_fadeLength = m_fadeLength;
+            command.m_fadeShape = m_fadeShape;
+            for (size_t t = 0; t < nrOfDubs; t++)
+            {
+                // The reader thread does not fade, undone dubs on file are dropped instead. That
+                // includes the ones kept for the dubs of other tracks after them.
+                command.m_gains1[t] = m_mixer.active(t) ? m_mixer.mixGain1(t) : 0.0f;
+                command.m_gains2[t] = m_mixer.active(t) ? m_mixer.mixGain2(t) : 0.0f;
+                command.m_nextGains1[t] = m_mixer.active(t) ? m_mixer.sceneGain1(t, m_nextScene) : 0.0f;
+                command.m_nextGains2[t] = m_mixer.active(t) ? m_mixer.sceneGain2(t, m_nextScene) : 0.0f;
+            }
+            command.m_switchBlock = switchBlock;
+            if (m_tieringFile.pushCommand(command))
+            {
+                m_tieringSentState = state;
+                m_tieringSentLoopLength = m_loopLength;
+                m_tieringSentSwitchBlock = switchBlock;
+                m_tieringGainsChanged = false;
+            }
+        }
+        size_t nrOfLoopSamples = nrOfSamples;
+        if (stretched())
+            nrOfLoopSamples = size_t(m_tempoRatio * nrOfSamples) + STRETCH_LOOKAHEAD;
+        else if (varispeed)
+            nrOfLoopSamples = size_t(fabsf(m_speed) * nrOfSamples) + 3;
+        m_tieringFile.setPosition(m_loopCounter, m_currentLoopIndex, m_loopLength, nrOfLoopSamples, reverse);
+    }
 
-        // Note that when recording a new dub we need to reset max dubs as well, even if
-        // once had more dubs: They have been overwritten and cannot be redone!
-        m_maxUsedDubs = m_nrOfDubs;
+    /// The dubs on file from the given one on are replaced by other ones, so the reader
+    /// thread has to start over.
+    /// \param dubIndex The first dub replaced.
+    void replaceFileDubs(size_t dubIndex)
+    {
+        if (m_nrOfFileDubs > dubIndex)
+            m_nrOfFileDubs = dubIndex;
+        m_fileDubWritten = false;
+        m_tieringGeneration++;
     }
 
-    /// Undo the last recorded dub, if there is any. Will also stop recording. So a currently
-    /// recording dub will not be heard but could be redone!
-    void undo()
+    /// Execute all commands received via OSC since the last run call and queue
+    /// a reply with the resulting state for each of them.
+    void processOscCommands()
     {
-        if (m_state == LOOPER_STATE_RECORDING)
-            // When we are recording, we interpret undo as undoing the current recording.
-            // So we simply finish it and then immediately undo.
-            finishRecording();
-        if (m_nrOfDubs == 0)
-            // Nothing to undo.
+        if (!OSC_ENABLED)
             return;
 
-        // Deactivate the undone dub.
-        m_nrOfDubs--;
-        Dub& dub = m_dubs[m_nrOfDubs];
-        // Make sure that next time we record the undone dub will be overwritten. Recording
-        // next time will invalidate any possiblity to redo!
-        m_nrOfUsedSamples = dub.m_storageOffset;
-        if (m_nrOfDubs == 0)
+        OscCommand command;
+        while (m_oscServer.popCommand(command))
         {
-            // When undoing the first dub, then we stop playing. It is like a reset, but
-            // we can still redo.
-            m_loopLength = 0;
-            m_currentLoopIndex = 0;
+            switch (command.m_type)
+            {
+                case OSC_COMMAND_RECORD: toggleRecording(); break;
+                case OSC_COMMAND_DUB: startDub(); break;
+                case OSC_COMMAND_UNDO: undo(); break;
+                case OSC_COMMAND_REDO: redo(); break;
+                case OSC_COMMAND_RESET: reset(); break;
+                case OSC_COMMAND_BOUNCE: bounce(); break;
+                case OSC_COMMAND_MULTIPLY: multiply(command.m_argument > 0 ? size_t(command.m_argument) : 2); break;
+                case OSC_COMMAND_BRANCH: switchBranch(); break;
+                case OSC_COMMAND_DELETE: deleteDub(size_t(command.m_argument)); break;
+                case OSC_COMMAND_REPLACE: replaceDub(size_t(command.m_argument)); break;
+                case OSC_COMMAND_SNAPSHOT: takeSnapshot(); break;
+                case OSC_COMMAND_RESTORE: restoreSnapshot(); break;
+                case OSC_COMMAND_RELEASE: releaseSnapshot(); break;
+                case OSC_COMMAND_QUERY: break;
+            }
+
+            OscReply reply;
+            reply.m_receiver = command.m_sender;
+            reply.m_state = m_state;
+            reply.m_nrOfDubs = int32_t(m_nrOfDubs);
+            reply.m_maxUsedDubs = int32_t(m_maxUsedDubs);
+            reply.m_loopLength = int32_t(m_loopLength);
+            reply.m_loopIndex = int32_t(m_currentLoopIndex);
+            reply.m_usedSamples = int32_t(usedStorage());
+            m_oscServer.pushReply(reply);
         }
     }
 
-    /// Redo a dub. Redo is possible as many times as an undo was done _after_ the last
-    /// recording operation. Recording will invalidate all redos - similar to what a
-    /// text editor does.
-    void redo()
+    /// Apply the mixer settings received on the control port since the last run call.
+    /// They are patch:Set messages with the index of the dub as additional property,
+    /// e.g. [ a patch:Set; loopor:dub 2; patch:property loopor:dubGain; patch:value -6.0 ],
+    /// or with the index of the track instead for the settings of a whole track. The scenes
+    /// of a dub are set the same way, e.g. [ a patch:Set; loopor:dub 2; patch:property
+    /// loopor:dubScenes; patch:value 5 ] for the first and the third scene.
+    /// The tempo of the host is taken from the time:Position objects it sends.
+    void processControlMessages()
     {
-        if (m_state == LOOPER_STATE_RECORDING)
-            // Cannot redo if recording, redo info is overwritten.
+        if (m_controlPort == NULL || m_uris.m_atomObject == 0)
             return;
-        if (m_nrOfDubs == m_maxUsedDubs)
-            // Nothing to redo here, we are already at the last track.
+
+        LV2_ATOM_SEQUENCE_FOREACH(m_controlPort, event)
+        {
+            if (event->body.type != m_uris.m_atomObject && event->body.type != m_uris.m_atomBlank)
+                continue;
+            const LV2_Atom_Object* object = (const LV2_Atom_Object*)&event->body;
+            if (object->body.otype == m_uris.m_timePosition)
+            {
+                const LV2_Atom* bpm = NULL;
+                lv2_atom_object_get(object, m_uris.m_timeBeatsPerMinute, &bpm, 0);
+                if (bpm != NULL && bpm->type == m_uris.m_atomFloat && ((const LV2_Atom_Float*)bpm)->body > 0.0f)
+                    m_hostBpm = ((const LV2_Atom_Float*)bpm)->body;
+                continue;
+            }
+            if (object->body.otype != m_uris.m_patchSet)
+                continue;
+
+            const LV2_Atom* dub = NULL;
+            const LV2_Atom* track = NULL;
+            const LV2_Atom* property = NULL;
+            const LV2_Atom* value = NULL;
+            float number;
+            lv2_atom_object_get(object, m_uris.m_dub, &dub, m_uris.m_track, &track, m_uris.m_patchProperty,
+                &property, m_uris.m_patchValue, &value, 0);
+            if (property == NULL || property->type != m_uris.m_atomUrid || value == NULL || !toNumber(value, number))
+                continue;
+            if (dub != NULL && dub->type == m_uris.m_atomInt)
+                setDubMix(((const LV2_Atom_Int*)dub)->body, ((const LV2_Atom_URID*)property)->body, number);
+            else if (track != NULL && track->type == m_uris.m_atomInt)
+                setTrackMix(((const LV2_Atom_Int*)track)->body, ((const LV2_Atom_URID*)property)->body, number);
+        }
+    }
+
+    /// Get the value of a float, int or bool atom.
+    /// \param value The atom.
+    /// \param number Set to the value.
+    /// \return false if the atom has another type.
+    bool toNumber(const LV2_Atom* value, float& number) const
+    {
+        if (value->type == m_uris.m_atomFloat)
+            number = ((const LV2_Atom_Float*)value)->body;
+        else if (value->type == m_uris.m_atomInt || value->type == m_uris.m_atomBool)
+            number = float(((const LV2_Atom_Int*)value)->body);
+        else
+            return false;
+        return true;
+    }
+
+    /// Change a mixer setting of a dub, or delete it or record it again.
+    /// \param dubIndex The index of the dub, 0 for the first one.
+    /// \param property The setting: gain in dB, mute, pan (-1..1) or the scenes the dub is
+    /// part of (a bit for each scene, the lowest one for the first scene). Or the command:
+    /// delete or replace, only done if the value is not 0.
+    /// \param number The new value.
+    void setDubMix(int32_t dubIndex, LV2_URID property, float number)
+    {
+        if (dubIndex < 0 || size_t(dubIndex) >= m_maxUsedDubs)
+            // Only recorded dubs can be changed, their settings are reset when recording.
             return;
 
-        // Can redo!
-        Dub& dub = m_dubs[m_nrOfDubs];
-        // Make sure that we do not overwrite the dubs audio data when recording
-        // next time.
-        m_nrOfUsedSamples = dub.m_storageOffset + dub.m_length;
-        if (m_nrOfDubs == 0)
+        if (property == m_uris.m_dubDelete || property == m_uris.m_dubReplace)
         {
-            // If redoing the first dub, then we start playback from the beginning.
-            m_currentLoopIndex = 0;
-            m_loopLength = dub.m_length;
+            if (number == 0.0f)
+                return;
+            if (property == m_uris.m_dubDelete)
+                deleteDub(dubIndex);
+            else
+                replaceDub(dubIndex);
+            return;
         }
+        if (property == m_uris.m_dubGain)
+            m_mixer.setGain(dubIndex, dbToFloat(number < MAX_DUB_GAIN_DB ? number : MAX_DUB_GAIN_DB));
+        else if (property == m_uris.m_dubMute)
+            m_mixer.setMute(dubIndex, number != 0.0f);
+        else if (property == m_uris.m_dubPan)
+            m_mixer.setPan(dubIndex, number < -1.0f ? -1.0f : (number > 1.0f ? 1.0f : number));
+        else if (property == m_uris.m_dubScenes)
+            m_mixer.setScenes(dubIndex, number <= 0.0f ? 0 : uint32_t(number) & ALL_SCENES);
+        else
+            return;
+        m_tieringGainsChanged = true;
+    }
 
-        // Now activate the redone dub.
-        m_nrOfDubs++;
+    /// Change a mixer setting of a track. It applies to all of its dubs, also the ones
+    /// recorded later.
+    /// \param track The index of the track, 0 for the first one.
+    /// \param property The setting: gain in dB or mute.
+    /// \param number The new value.
+    void setTrackMix(int32_t track, LV2_URID property, float number)
+    {
+        if (track < 0 || size_t(track) >= NR_OF_TRACKS)
+            return;
+
+        if (property == m_uris.m_trackGain)
+            m_mixer.setTrackGain(track, dbToFloat(number < MAX_DUB_GAIN_DB ? number : MAX_DUB_GAIN_DB));
+        else if (property == m_uris.m_trackMute)
+            m_mixer.setTrackMute(track, number != 0.0f);
+        else
+            return;
+        m_tieringGainsChanged = true;
+    }
+
+    /// Update all the output parameters. Called once at the end of each run call.
+    /// \param nrOfSamples The number of samples processed in this run call.
+    /// \param duration The time spent in this run call.
+    void updateOutputs(uint32_t nrOfSamples, std::chrono::nanoseconds duration)
+    {
+        if (m_stateOutput != NULL)
+            *m_stateOutput = float(m_state);
+        if (m_dubsOutput != NULL)
+            *m_dubsOutput = float(m_nrOfDubs);
+        if (m_recordedDubsOutput != NULL)
+            *m_recordedDubsOutput = float(m_maxUsedDubs);
+        if (m_storageOutput != NULL)
+            *m_storageOutput = 100.0f * float(usedStorage()) / float(m_storageSize);
+        if (m_positionOutput != NULL)
+            *m_positionOutput = m_loopLength > 0 ? float(m_currentLoopIndex) / float(m_loopLength) : 0.0f;
+        if (m_dspLoadOutput != NULL && nrOfSamples > 0)
+            *m_dspLoadOutput = float(duration.count() * 1e-9 * m_sampleRate / nrOfSamples);
+    }
+
+    /// Leave out the quietest dubs while the DSP load is above the one set, and play them
+    /// again once it stayed well below for a while. Called once at the end of each run call.
+    /// \param nrOfSamples The number of samples processed in this run call.
+    /// \param duration The time spent in this run call.
+    void updateCulling(uint32_t nrOfSamples, std::chrono::nanoseconds duration)
+    {
+        if (nrOfSamples == 0)
+            return;
+        float load = float(duration.count() * 1e-9 * m_sampleRate / nrOfSamples);
+        float weight = float(nrOfSamples / (CULLING_LOAD_SECONDS * m_sampleRate));
+        m_averageLoad += (load - m_averageLoad) * (weight < 1.0f ? weight : 1.0f);
+
+        bool culling = m_culling;
+        if (m_cullLoad >= 1.0f)
+            culling = false;
+        else if (m_averageLoad > m_cullLoad)
+        {
+            culling = true;
+            m_cullingHold = 0;
+        }
+        else if (culling && m_averageLoad < m_cullLoad * CULLING_RELEASE_RATIO)
+        {
+            m_cullingHold += nrOfSamples;
+            culling = m_cullingHold < CULLING_HOLD_SECONDS * m_sampleRate;
+        }
+        else
+            m_cullingHold = 0;
+
+        // The ranking only changes with the dubs or their gains.
+        if (culling == m_culling && m_mixer.nrOfChanges() == m_culledChanges && m_nrOfDubs == m_culledNrOfDubs &&
+            m_nextDubId == m_culledNextDubId && m_cullLevel == m_culledLevel)
+            return;
+        m_culling = culling;
+        cullDubs();
+        m_culledChanges = m_mixer.nrOfChanges();
+        m_culledNrOfDubs = m_nrOfDubs;
+        m_culledNextDubId = m_nextDubId;
+        m_culledLevel = m_cullLevel;
+    }
+
+    /// Rank the active dubs by their peak in the mix and, while culling, leave out the
+    /// quietest ones as long as their peaks add up to less than the cull level relative to
+    /// the peaks of all dubs. So the mix changes by that level at most. The dubs on file
+    /// are mixed by the reader thread, leaving them out would not save anything.
+    void cullDubs()
+    {
+        size_t nrOfRanked = 0;
+        float mixPeak = 0.0f;
+        for (size_t t = 0; t < m_nrOfDubs; t++)
+        {
+            if (!m_mixer.active(t))
+            {
+                m_mixer.setCulled(t, false);
+                continue;
+            }
+            float peak = m_dubs[t].m_peak * fmaxf(m_mixer.mixGain1(t), m_mixer.mixGain2(t));
+            m_cullPeaks[t] = peak;
+            mixPeak += peak;
+            if (!m_culling || m_dubs[t].m_location == Dub::ON_FILE)
+            {
+                m_mixer.setCulled(t, false);
+                continue;
+            }
+            // Insert the dub into the ranking, the quietest one first.
+            size_t r = nrOfRanked++;
+            for (; r > 0 && m_cullPeaks[m_cullRanking[r - 1]] > peak; r--)
+                m_cullRanking[r] = m_cullRanking[r - 1];
+            m_cullRanking[r] = t;
+        }
+
+        float culledPeak = 0.0f;
+        for (size_t r = 0; r < nrOfRanked; r++)
+        {
+            size_t t = m_cullRanking[r];
+            culledPeak += m_cullPeaks[t];
+            m_mixer.setCulled(t, culledPeak <= mixPeak * m_cullLevel);
+        }
     }
 
     /// Update all the parameters from the inputs.
@@ -642,11 +7809,75 @@ private:
     {
         m_threshold = dbToFloat(*m_thresholdParameter);
         m_dryAmount = *m_dryAmountParameter;
+        m_gapSamples = m_silenceGapParameter != NULL ? size_t(*m_silenceGapParameter * m_sampleRate) : 0;
+        // The fades are applied when playing, so changing them takes effect right away.
+        size_t fadeLength = m_fadeLength;
+        FadeShape fadeShape = m_fadeShape;
+        if (m_fadeLengthParameter != NULL)
+        {
+            float length = *m_fadeLengthParameter;
+            m_fadeLength = length <= 0.0f ? 0 : (length >= MAX_BLEND_SAMPLES ? MAX_BLEND_SAMPLES : size_t(length));
+        }
+        if (m_fadeShapeParameter != NULL)
+            m_fadeShape = *m_fadeShapeParameter >= 0.5f ? FADE_EQUAL_POWER : FADE_LINEAR;
+        if (m_fadeLength != fadeLength || m_fadeShape != fadeShape)
+            m_tieringGainsChanged = true;
+        if (m_speedParameter != NULL)
+        {
+            float speed = *m_speedParameter;
+            m_speed = speed <= -MAX_PLAYBACK_SPEED ? -MAX_PLAYBACK_SPEED :
+                (speed >= MAX_PLAYBACK_SPEED ? MAX_PLAYBACK_SPEED : speed);
+        }
+        // Following the host, the tempo changes along with the one of the host since the
+        // first dub was recorded.
+        float tempo = m_tempoParameter != NULL ? *m_tempoParameter : 1.0f;
+        if (m_followTempoParameter != NULL && *m_followTempoParameter >= 0.5f && m_hostBpm > 0.0f &&
+            m_loopBpm > 0.0f)
+            tempo *= m_hostBpm / m_loopBpm;
+        m_tempoRatio = tempo <= MIN_TEMPO_RATIO ? MIN_TEMPO_RATIO :
+            (tempo >= MAX_TEMPO_RATIO ? MAX_TEMPO_RATIO : tempo);
+        if (m_trackParameter != NULL)
+        {
+            float track = *m_trackParameter;
+            m_track = track <= 1.0f ? 0 : (track >= NR_OF_TRACKS ? NR_OF_TRACKS - 1 : size_t(track + 0.5f) - 1);
+        }
+        if (m_sceneParameter != NULL)
+        {
+            float scene = *m_sceneParameter;
+            size_t nextScene = scene <= 0.0f ? 0 : (scene >= NR_OF_SCENES ? NR_OF_SCENES : size_t(scene + 0.5f));
+            if (nextScene != m_nextScene)
+                // The reader thread mixes the dubs on file for the next scene ahead.
+                m_tieringGainsChanged = true;
+            m_nextScene = nextScene;
+        }
+        // Without a loop playing, there is no start of the loop to wait for.
+        if (m_state == LOOPER_STATE_INACTIVE || m_nrOfDubs == 0)
+            switchScene();
+        if (m_maxDubsParameter != NULL)
+        {
+            // A lower number only stops recording more dubs, the ones recorded stay.
+            float maxDubs = *m_maxDubsParameter;
+            m_maxDubs = maxDubs < 1.0f ? m_defaultMaxDubs :
+                (maxDubs >= NR_OF_DUBS ? NR_OF_DUBS : size_t(maxDubs + 0.5f));
+        }
+        if (m_storageSecondsParameter != NULL)
+        {
+            float seconds = *m_storageSecondsParameter;
+            requestStorage(seconds < 1.0f ? m_defaultStorageSize :
+                storageSizeFor(seconds >= MAX_STORAGE_SECONDS ? MAX_STORAGE_SECONDS : seconds));
+        }
+        if (m_cullLevelParameter != NULL)
+            m_cullLevel = dbToFloat(*m_cullLevelParameter);
+        if (m_cullLoadParameter != NULL)
+            m_cullLoad = *m_cullLoadParameter;
         m_activateButton.run(m_now);
         m_resetButton.run(m_now);
         m_undoButton.run(m_now);
         m_redoButton.run(m_now);
         m_dubButton.run(m_now);
+        m_branchButton.run(m_now);
+        m_snapshotButton.run(m_now);
+        m_restoreButton.run(m_now);
     }
 };
 
@@ -656,12 +7887,60 @@ private:
 static LV2_Handle instantiate(const LV2_Descriptor* descriptor, double rate, const char* bundlePath,
     const LV2_Feature* const* features)
 {
-    return (LV2_Handle)new Looper(rate);
+    const LV2_URID_Map* map = NULL;
+    const LV2_Options_Option* options = NULL;
+    const LV2_Worker_Schedule* schedule = NULL;
+    for (size_t f = 0; features != NULL && features[f] != NULL; f++)
+    {
+        if (strcmp(features[f]->URI, LV2_URID__map) == 0)
+            map = static_cast<const LV2_URID_Map*>(features[f]->data);
+        else if (strcmp(features[f]->URI, LV2_OPTIONS__options) == 0)
+            options = static_cast<const LV2_Options_Option*>(features[f]->data);
+        else if (strcmp(features[f]->URI, LV2_WORKER__schedule) == 0)
+            schedule = static_cast<const LV2_Worker_Schedule*>(features[f]->data);
+    }
+    Looper* looper = new Looper(rate, map, options, schedule);
+    if (!looper->hasStorage())
+    {
+        delete looper;
+        return NULL;
+    }
+    return (LV2_Handle)looper;
 }
 static void activate(LV2_Handle instance) {}
 static void deactivate(LV2_Handle instance) {}
 static void cleanup(LV2_Handle instance) { delete static_cast<Looper*>(instance); }
-static const void* extensionData(const char* uri) { return NULL; }
+static LV2_Worker_Status work(LV2_Handle instance, LV2_Worker_Respond_Function respond,
+    LV2_Worker_Respond_Handle handle, uint32_t size, const void* data)
+{
+    Looper* looper = static_cast<Looper*>(instance);
+    return looper->work(respond, handle, size, data);
+}
+static LV2_Worker_Status workResponse(LV2_Handle instance, uint32_t size, const void* data)
+{
+    Looper* looper = static_cast<Looper*>(instance);
+    return looper->workResponse(size, data);
+}
+
+///
+/// The worker interface, used for the jobs which are not done in the audio thread
+///
+static const LV2_Worker_Interface worker =
+{
+    /// Do a job in the worker thread.
+    work,
+    /// Take over the result in the audio thread.
+    workResponse,
+    /// Called after each run (unused).
+    NULL
+};
+
+static const void* extensionData(const char* uri)
+{
+    if (strcmp(uri, LV2_WORKER__interface) == 0)
+        return &worker;
+    return NULL;
+}
 static void connectPort(LV2_Handle instance, uint32_t port, void* data)
 {
     Looper* looper = static_cast<Looper*>(instance);
@@ -692,7 +7971,7 @@ static const LV2_Descriptor descriptor =
     deactivate,
     /// Cleanup, will destroy the plugin.
     cleanup,
-    /// Get information about used extensions (unused).
+    /// Get the interfaces of the extensions, only the worker.
     extensionData
 };
 